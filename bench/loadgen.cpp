@@ -0,0 +1,382 @@
+// HTTP压测工具, 基于项目自己的EventLoop/Connection, 每个线程一个事件循环
+//
+// 闭环(-m closed): 每个连接保持-P个未完成的请求, 收到响应后立即发送下一个, 测量最大吞吐
+// 开环(-m open):   按-r指定的总速率定时发送, 不等待响应, 延迟从计划发送的时刻算起(避免协调遗漏)
+// 连接抖动(-C):    每个请求使用一个新连接(Connection: close), 延迟包含建立连接的时间
+//
+// 只支持带Content-Length的响应, 分块编码的响应按错误处理
+#include "../src/server.hpp"
+#include <getopt.h>
+#include <cinttypes>
+
+namespace {
+
+struct Options {
+    std::string _host = "127.0.0.1";
+    uint16_t _port = 8888;
+    std::string _path = "/hello";
+    int _threads = 2;
+    int _connections = 64;
+    int _duration = 10; // 秒
+    int _warmup = 1; // 秒, 这段时间的数据不计入结果
+    bool _open_loop = false;
+    double _rate = 10000; // 开环模式的总请求速率(每秒)
+    int _pipeline = 1; // 闭环模式每个连接未完成的请求数
+    bool _churn = false;
+    PollerBackend _backend = PollerBackend::kEpoll;
+};
+
+// 每个连接的状态: 已发出还没有收到响应的请求的开始时间, 以及响应的解析进度
+struct ClientState : public ConnectionContext {
+    std::deque<uint64_t> _inflight;
+    bool _in_body = false;
+    size_t _body_left = 0;
+    int _status = 0;
+    bool _close = false; // 服务器要求关闭连接
+    bool _answered = false; // 是否收到过响应
+    bool _failed = false; // 响应无法解析
+
+    void Reset() override {
+        _inflight.clear();
+        _in_body = false;
+        _body_left = 0;
+        _status = 0;
+        _close = false;
+        _answered = false;
+        _failed = false;
+    }
+};
+
+bool StartsWithIgnoreCase(std::string_view s, std::string_view prefix) {
+    if (s.size() < prefix.size()) return false;
+    for (size_t i = 0; i < prefix.size(); i++) {
+        if (tolower(static_cast<unsigned char>(s[i])) != prefix[i]) return false;
+    }
+    return true;
+}
+
+// 每个线程一个, 除了统计数据以外只在所属的事件循环线程中访问
+class Worker {
+public:
+    static constexpr size_t kMaxInflight = 1024; // 开环模式下每个连接最多积压的请求
+    static constexpr uint64_t kTickMs = 1;
+    static constexpr uint64_t kReconnectMs = 100;
+
+    Worker(EventLoop* loop, const Options& opt, int connections, double rate)
+        : _loop(loop), _opt(opt), _target(connections), _rate(rate) {
+        _request = "GET " + opt._path + " HTTP/1.1\r\nHost: " + opt._host + "\r\n";
+        _request += opt._churn ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n";
+        _tick_timer.SetTask([this] { Tick(); });
+        _reconnect_timer.SetTask([this] { Refill(); });
+    }
+    void Start() {
+        _loop->RunInLoop([this] {
+            _start_ns = MonotonicNs();
+            Refill();
+            if (_opt._open_loop) _loop->AddTimer(&_tick_timer, kTickMs);
+            });
+    }
+
+    Histogram _latency; // 纳秒
+    Counter _responses; // 2xx/3xx响应
+    Counter _bad_status; // 4xx/5xx响应
+    Counter _errors; // 连接失败、连接中断和无法解析的响应
+    Counter _missed; // 开环模式下因为积压过多而没有发出的请求
+    Counter _connects;
+private:
+    // 补足连接数
+    void Refill() {
+        while (_conns.size() < static_cast<size_t>(_target)) {
+            if (!Connect()) {
+                // 稍后重试, 避免服务器不可用时空转
+                if (!_reconnect_timer.IsLinked()) _loop->AddTimer(&_reconnect_timer, kReconnectMs);
+                return;
+            }
+        }
+    }
+    bool Connect() {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (fd == -1) {
+            _errors.Add();
+            return false;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_opt._port);
+        addr.sin_addr.s_addr = inet_addr(_opt._host.c_str());
+        // 非阻塞连接, 连接建立之前写入的数据留在输出队列中, 可写时再发送
+        if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1 && errno != EINPROGRESS) {
+            close(fd);
+            _errors.Add();
+            return false;
+        }
+        _connects.Add();
+        auto conn = std::make_shared<Connection>(_loop, ++_next_id, fd);
+        conn->SetTypedContext(ContextPool<ClientState>::Acquire());
+        conn->SetMessageCallback([this](const PtrConnection& conn, Buffer* buf) { OnMessage(conn, buf); });
+        conn->SetServerCloseCallback([this](const PtrConnection& conn) { OnClose(conn); });
+        _conns.push_back(conn);
+        conn->Establish();
+        if (!_opt._open_loop) {
+            for (int i = 0; i < _opt._pipeline; i++) SendRequest(conn, MonotonicNs());
+        }
+        return true;
+    }
+    void SendRequest(const PtrConnection& conn, uint64_t start_ns) {
+        conn->GetTypedContext<ClientState>()->_inflight.push_back(start_ns);
+        conn->Send(_request.data(), _request.size());
+    }
+    void OnMessage(const PtrConnection& conn, Buffer* buf) {
+        auto st = conn->GetTypedContext<ClientState>();
+        while (buf->ReadableSize() > 0) {
+            if (!st->_in_body && !ParseHead(st, buf)) {
+                if (st->_status < 0) Fail(conn);
+                return;
+            }
+            size_t n = std::min(st->_body_left, buf->ReadableSize());
+            buf->MoveReadIdx(n);
+            st->_body_left -= n;
+            if (st->_body_left > 0) return;
+            st->_in_body = false;
+            st->_answered = true;
+            if (st->_inflight.empty()) {
+                // 没有请求却收到了响应
+                Fail(conn);
+                return;
+            }
+            _latency.Record(MonotonicNs() - st->_inflight.front());
+            st->_inflight.pop_front();
+            if (st->_status < 400) _responses.Add();
+            else _bad_status.Add();
+            if (_opt._churn || st->_close) {
+                // 剩下的请求不会再有响应
+                _errors.Add(st->_inflight.size());
+                st->_inflight.clear();
+                conn->Shutdown();
+                return;
+            }
+            if (!_opt._open_loop) SendRequest(conn, MonotonicNs());
+        }
+    }
+    // 解析响应头, 数据不完整时返回false, 出错时把_status设为-1
+    static bool ParseHead(ClientState* st, Buffer* buf) {
+        std::string_view data(buf->ReadPos(), buf->ReadableSize());
+        size_t end = data.find("\r\n\r\n");
+        if (end == std::string_view::npos) {
+            if (data.size() > 64 * 1024) st->_status = -1;
+            return false;
+        }
+        std::string_view head = data.substr(0, end + 2);
+        if (head.substr(0, 5) != "HTTP/" || head.size() < 12) {
+            st->_status = -1;
+            return false;
+        }
+        st->_status = atoi(std::string(head.substr(9, 3)).c_str());
+        st->_body_left = 0;
+        st->_close = false;
+        size_t pos = head.find("\r\n") + 2;
+        while (pos < head.size()) {
+            size_t eol = head.find("\r\n", pos);
+            std::string_view line = head.substr(pos, eol - pos);
+            pos = eol + 2;
+            if (StartsWithIgnoreCase(line, "content-length:")) {
+                st->_body_left = strtoull(std::string(line.substr(15)).c_str(), nullptr, 10);
+            }
+            else if (StartsWithIgnoreCase(line, "transfer-encoding:")) {
+                st->_status = -1;
+                return false;
+            }
+            else if (StartsWithIgnoreCase(line, "connection:") && line.find("close") != std::string_view::npos) {
+                st->_close = true;
+            }
+        }
+        st->_in_body = true;
+        buf->MoveReadIdx(end + 4);
+        return true;
+    }
+    void Fail(const PtrConnection& conn) {
+        conn->GetTypedContext<ClientState>()->_failed = true;
+        conn->Shutdown();
+    }
+    void OnClose(const PtrConnection& conn) {
+        auto st = conn->GetTypedContext<ClientState>();
+        if (st != nullptr) {
+            // 连接失败或者中断, 未完成的请求都算作错误
+            if (st->_failed || !st->_answered || !st->_inflight.empty()) {
+                _errors.Add(std::max<size_t>(st->_inflight.size(), 1));
+            }
+        }
+        bool answered = st != nullptr && st->_answered;
+        for (size_t i = 0; i < _conns.size(); i++) {
+            if (_conns[i] == conn) {
+                _conns[i] = std::move(_conns.back());
+                _conns.pop_back();
+                break;
+            }
+        }
+        // 正常结束的连接立即补充, 失败的连接稍后重试
+        if (answered) _loop->QueueInLoop([this] { Refill(); });
+        else if (!_reconnect_timer.IsLinked()) _loop->AddTimer(&_reconnect_timer, kReconnectMs);
+    }
+    // 开环模式: 补发从开始到现在应该发出的请求, 开始时间按计划的发送时刻计算
+    void Tick() {
+        uint64_t now = MonotonicNs();
+        uint64_t due = static_cast<uint64_t>((now - _start_ns) * _rate / 1e9);
+        while (_issued < due) {
+            uint64_t planned = _start_ns + static_cast<uint64_t>(_issued * 1e9 / _rate);
+            _issued++;
+            if (_conns.empty()) {
+                _missed.Add();
+                continue;
+            }
+            auto& conn = _conns[_next_conn++ % _conns.size()];
+            auto st = conn->GetTypedContext<ClientState>();
+            if (st == nullptr || st->_inflight.size() >= kMaxInflight) {
+                _missed.Add();
+                continue;
+            }
+            // 一个刻度以内的滞后是发送节拍本身造成的, 从实际发送时刻算起; 更多的滞后说明发送端被拖慢, 计入延迟
+            SendRequest(conn, planned + kTickMs * 1000000 < now ? planned : now);
+        }
+        _loop->AddTimer(&_tick_timer, kTickMs);
+    }
+private:
+    EventLoop* _loop;
+    const Options& _opt;
+    int _target; // 本线程的连接数
+    double _rate; // 本线程的请求速率
+    std::string _request;
+    std::vector<PtrConnection> _conns;
+    uint64_t _next_id = 0;
+    uint64_t _start_ns = 0;
+    uint64_t _issued = 0; // 开环模式下已经计划的请求数
+    size_t _next_conn = 0;
+    TimerNode _tick_timer;
+    TimerNode _reconnect_timer;
+};
+
+// 所有线程的统计数据之和
+struct Totals {
+    Histogram::Snapshot _latency;
+    uint64_t _responses = 0;
+    uint64_t _bad_status = 0;
+    uint64_t _errors = 0;
+    uint64_t _missed = 0;
+    uint64_t _connects = 0;
+    uint64_t _bytes_read = 0;
+};
+
+Totals Collect(const std::vector<std::unique_ptr<Worker>>& workers, const std::vector<EventLoop*>& loops) {
+    Totals t;
+    for (auto& w : workers) {
+        w->_latency.AddTo(t._latency);
+        t._responses += w->_responses.Value();
+        t._bad_status += w->_bad_status.Value();
+        t._errors += w->_errors.Value();
+        t._missed += w->_missed.Value();
+        t._connects += w->_connects.Value();
+    }
+    for (auto loop : loops) t._bytes_read += loop->GetMetrics()._bytes_read.Value();
+    return t;
+}
+
+// 两次统计之间的差值
+Totals Diff(const Totals& end, const Totals& begin) {
+    Totals d;
+    for (int i = 0; i < Histogram::kBuckets; i++) d._latency._counts[i] = end._latency._counts[i] - begin._latency._counts[i];
+    d._latency._count = end._latency._count - begin._latency._count;
+    d._latency._sum = end._latency._sum - begin._latency._sum;
+    d._responses = end._responses - begin._responses;
+    d._bad_status = end._bad_status - begin._bad_status;
+    d._errors = end._errors - begin._errors;
+    d._missed = end._missed - begin._missed;
+    d._connects = end._connects - begin._connects;
+    d._bytes_read = end._bytes_read - begin._bytes_read;
+    return d;
+}
+
+void Usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -h host        server address (default 127.0.0.1)\n"
+        "  -p port        server port (default 8888)\n"
+        "  -u path        request path (default /hello)\n"
+        "  -t threads     client event loops (default 2)\n"
+        "  -c conns       total connections (default 64)\n"
+        "  -d seconds     measured duration (default 10)\n"
+        "  -w seconds     warmup excluded from results (default 1)\n"
+        "  -m closed|open closed loop or fixed-rate open loop (default closed)\n"
+        "  -r rate        open loop requests per second, all threads (default 10000)\n"
+        "  -P depth       closed loop pipelined requests per connection (default 1)\n"
+        "  -C             connection churn: one request per connection\n"
+        "  -e epoll|uring client poller backend (default epoll)\n", prog);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    int c;
+    while ((c = getopt(argc, argv, "h:p:u:t:c:d:w:m:r:P:Ce:")) != -1) {
+        switch (c) {
+        case 'h': opt._host = optarg; break;
+        case 'p': opt._port = static_cast<uint16_t>(atoi(optarg)); break;
+        case 'u': opt._path = optarg; break;
+        case 't': opt._threads = std::max(atoi(optarg), 1); break;
+        case 'c': opt._connections = std::max(atoi(optarg), 1); break;
+        case 'd': opt._duration = std::max(atoi(optarg), 1); break;
+        case 'w': opt._warmup = std::max(atoi(optarg), 0); break;
+        case 'm': opt._open_loop = std::string(optarg) == "open"; break;
+        case 'r': opt._rate = std::max(atof(optarg), 1.0); break;
+        case 'P': opt._pipeline = std::max(atoi(optarg), 1); break;
+        case 'C': opt._churn = true; break;
+        case 'e': opt._backend = std::string(optarg) == "uring" ? PollerBackend::kIoUring : PollerBackend::kEpoll; break;
+        default:
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    lg.setLevel(Fatal);
+    opt._threads = std::min(opt._threads, opt._connections);
+
+    EventLoop base(opt._backend);
+    LoopThreadPool pool(&base, opt._threads);
+    pool.Create();
+    auto loops = pool.GetLoops();
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < opt._threads; i++) {
+        int conns = opt._connections / opt._threads + (i < opt._connections % opt._threads ? 1 : 0);
+        workers.push_back(std::make_unique<Worker>(loops[i], opt, conns, opt._rate / opt._threads));
+    }
+    for (auto& w : workers) w->Start();
+
+    std::this_thread::sleep_for(std::chrono::seconds(opt._warmup));
+    Totals begin = Collect(workers, loops);
+    uint64_t begin_ns = MonotonicNs();
+    std::this_thread::sleep_for(std::chrono::seconds(opt._duration));
+    Totals end = Collect(workers, loops);
+    double seconds = (MonotonicNs() - begin_ns) / 1e9;
+    Totals t = Diff(end, begin);
+
+    auto ms = [&](double q) { return t._latency.Quantile(q) / 1e6; };
+    printf("%s loop, %d threads, %d connections%s", opt._open_loop ? "open" : "closed", opt._threads, opt._connections,
+        opt._churn ? ", churn" : "");
+    if (opt._open_loop) printf(", target %.0f req/s", opt._rate);
+    else printf(", pipeline %d", opt._pipeline);
+    printf("\n");
+    printf("  requests   %" PRIu64 " in %.2fs, %.0f req/s, %.2f MB/s\n", t._latency._count, seconds,
+        t._latency._count / seconds, t._bytes_read / seconds / 1e6);
+    printf("  latency    p50 %.3fms  p90 %.3fms  p99 %.3fms  p999 %.3fms  max %.3fms  mean %.3fms\n",
+        ms(0.5), ms(0.9), ms(0.99), ms(0.999), ms(1.0),
+        t._latency._count ? t._latency._sum / 1e6 / t._latency._count : 0.0);
+    printf("  responses  %" PRIu64 " ok, %" PRIu64 " 4xx/5xx, %" PRIu64 " errors", t._responses, t._bad_status, t._errors);
+    if (opt._open_loop) printf(", %" PRIu64 " missed", t._missed);
+    if (opt._churn) printf(", %.0f conn/s", t._connects / seconds);
+    printf("\n");
+    fflush(stdout);
+    // 连接还在各个事件循环中, 直接结束进程
+    _exit(t._errors > 0 ? 2 : 0);
+}
@@ -0,0 +1,200 @@
+// 核心组件的微基准测试(Google Benchmark): Buffer、HTTP请求解析、WebSocket去掩码、时间轮刷新、跨线程任务投递、协程
+#include "../src/http/http.hpp"
+#include <benchmark/benchmark.h>
+
+namespace {
+
+// 运行在后台线程中的事件循环, 进程退出前一直运行
+EventLoop* BackgroundLoop() {
+    static LoopThread* thread = new LoopThread();
+    return thread->GetLoop();
+}
+
+// 写入后读出, 模拟一次请求的输入缓冲区使用方式
+void BM_BufferWriteRead(benchmark::State& state) {
+    std::string chunk(state.range(0), 'x');
+    std::string out(chunk.size(), '\0');
+    Buffer buf;
+    for (auto _ : state) {
+        buf.Write(chunk);
+        buf.Read(out.data(), out.size(), true);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * chunk.size());
+}
+BENCHMARK(BM_BufferWriteRead)->Arg(64)->Arg(1024)->Arg(16 * 1024);
+
+// 从内存池借用缓冲区再归还, 空闲连接每次读事件都会这样做
+void BM_BufferReserveRelease(benchmark::State& state) {
+    for (auto _ : state) {
+        Buffer buf;
+        buf.Reserve(BufferPool::kMinChunkSize);
+        buf.Write("GET / HTTP/1.1\r\n\r\n", 18);
+        buf.MoveReadIdx(18);
+        buf.Release();
+        benchmark::DoNotOptimize(buf.Capacity());
+    }
+}
+BENCHMARK(BM_BufferReserveRelease);
+
+// 解析一个典型的浏览器GET请求, 包括请求行、头部和没有正文的结束判断
+void BM_HttpContextParse(benchmark::State& state) {
+    const std::string request =
+        "GET /static/app.js?v=123&lang=zh HTTP/1.1\r\n"
+        "Host: example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+        "Cookie: session=0123456789abcdef; theme=dark\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+    HttpContext context;
+    Buffer buf;
+    for (auto _ : state) {
+        buf.Write(request);
+        context.RecvHttpRequest(&buf);
+        if (context.HeadReady()) context.RecvHttpRequest(&buf);
+        if (context.GetRecvState() != HttpRecvState::kRECV_HTTP_DONE) {
+            state.SkipWithError("request not parsed");
+            break;
+        }
+        benchmark::DoNotOptimize(context.GetRequest()._path.data());
+        context.Clear();
+    }
+    state.SetBytesProcessed(state.iterations() * request.size());
+}
+BENCHMARK(BM_HttpContextParse);
+
+// 带Content-Length正文的POST请求
+void BM_HttpContextParseBody(benchmark::State& state) {
+    std::string body(state.range(0), 'b');
+    std::string request = "POST /api/items HTTP/1.1\r\nHost: example.com\r\nContent-Type: application/json\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    HttpContext context;
+    Buffer buf;
+    for (auto _ : state) {
+        buf.Write(request);
+        context.RecvHttpRequest(&buf);
+        if (context.HeadReady()) context.RecvHttpRequest(&buf);
+        if (context.GetRecvState() != HttpRecvState::kRECV_HTTP_DONE) {
+            state.SkipWithError("request not parsed");
+            break;
+        }
+        context.Clear();
+    }
+    state.SetBytesProcessed(state.iterations() * request.size());
+}
+BENCHMARK(BM_HttpContextParseBody)->Arg(256)->Arg(64 * 1024);
+
+// WebSocket负载原地去掩码(offset为1, 掩码需要旋转)
+void BM_WsUnmask(benchmark::State& state) {
+    std::string payload(state.range(0), 'w');
+    const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+    for (auto _ : state) {
+        Ws::Unmask(payload.data(), payload.size(), key, 1);
+        benchmark::DoNotOptimize(payload.data());
+    }
+    state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK(BM_WsUnmask)->Arg(125)->Arg(4096)->Arg(64 * 1024);
+
+// 解析一个加掩码的文本帧并校验UTF-8, 单帧消息直接以输入缓冲区的视图交付
+void BM_WsParseFrame(benchmark::State& state) {
+    std::string payload(state.range(0), 'p');
+    const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+    std::string frame(Ws::kMaxHeaderSize, '\0');
+    frame.resize(Ws::EncodeHeader(frame.data(), Ws::kText, payload.size()));
+    frame[1] = static_cast<char>(frame[1] | 0x80);
+    frame.append(reinterpret_cast<const char*>(key), 4);
+    Ws::Unmask(payload.data(), payload.size(), key, 0);
+    frame += payload;
+    Ws::Parser parser;
+    Buffer buf;
+    for (auto _ : state) {
+        buf.Write(frame);
+        size_t size = 0;
+        if (parser.Parse(&buf, [&](Ws::Opcode, std::string_view data) { size = data.size(); return true; }) != 0 || size != payload.size()) {
+            state.SkipWithError("frame not parsed");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+}
+BENCHMARK(BM_WsParseFrame)->Arg(125)->Arg(16 * 1024);
+
+// 刷新活跃连接的超时定时器, 每次读事件都会刷新一次
+void BM_TimerWheelRefresh(benchmark::State& state) {
+    EventLoop loop;
+    std::vector<TimerNode> nodes(state.range(0));
+    for (auto& node : nodes) {
+        node.SetTask([] {});
+        loop.AddTimer(&node, 30 * 1000);
+    }
+    size_t i = 0;
+    for (auto _ : state) {
+        loop.RefreshTimer(&nodes[i]);
+        if (++i == nodes.size()) i = 0;
+    }
+    for (auto& node : nodes) loop.CancelTimer(&node);
+}
+BENCHMARK(BM_TimerWheelRefresh)->Arg(1)->Arg(10000)->Arg(100000);
+
+// 从其他线程向事件循环投递任务(多生产者), 只测量投递的开销
+void BM_QueueInLoop(benchmark::State& state) {
+    EventLoop* loop = BackgroundLoop();
+    static std::atomic<uint64_t> executed{ 0 };
+    uint64_t queued = 0;
+    for (auto _ : state) {
+        loop->QueueInLoop([] { executed.fetch_add(1, std::memory_order_relaxed); });
+        queued++;
+    }
+    state.SetItemsProcessed(queued);
+    // 计时结束后等待队列清空, 避免影响下一组测试
+    std::atomic<bool> done{ false };
+    loop->QueueInLoop([&done] { done = true; });
+    while (!done) std::this_thread::yield();
+}
+BENCHMARK(BM_QueueInLoop)->Threads(1)->Threads(4)->UseRealTime();
+
+// 投递任务并等待执行完成: 一次唤醒事件循环的往返延迟
+void BM_QueueInLoopRoundTrip(benchmark::State& state) {
+    EventLoop* loop = BackgroundLoop();
+    std::atomic<bool> done{ false };
+    for (auto _ : state) {
+        done.store(false, std::memory_order_relaxed);
+        loop->QueueInLoop([&done] { done.store(true, std::memory_order_release); });
+        while (!done.load(std::memory_order_acquire)) std::this_thread::yield();
+    }
+}
+BENCHMARK(BM_QueueInLoopRoundTrip)->UseRealTime();
+
+CoTask<int> CoChild(int x) { co_return x + 1; }
+CoTask<void> CoParent(int x, int& out) { out = co_await CoChild(x); }
+
+// 启动一个等待子协程的顶层协程: 两个协程帧的分配(来自帧池)、恢复和销毁
+void BM_CoroutineSpawn(benchmark::State& state) {
+    int out = 0;
+    for (auto _ : state) {
+        CoSpawn(CoParent(out, out));
+        benchmark::DoNotOptimize(out);
+    }
+}
+BENCHMARK(BM_CoroutineSpawn);
+
+// 对照: 回调方式, 两层std::function(捕获超过内联大小, 同样需要分配)
+void BM_CallbackChain(benchmark::State& state) {
+    int out = 0;
+    std::string pad = "padding";
+    for (auto _ : state) {
+        std::function<void(int)> done = [&out, pad](int v) { out = v; };
+        std::function<void(int)> child = [done, pad](int x) { done(x + 1); };
+        child(out);
+        benchmark::DoNotOptimize(out);
+    }
+}
+BENCHMARK(BM_CallbackChain);
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,318 @@
+#pragma once
+#include "server.hpp"
+#include <optional>
+#include <exception>
+#include <string_view>
+
+// 协程帧的内存, 按大小分级复用FreeList(线程本地, 不加锁), 超过最大级别的直接分配
+// 协程都在事件循环线程中创建和销毁, 帧的内存在各自的线程中循环使用
+class CoFrameAllocator {
+public:
+    static constexpr std::size_t kMinSize = 128;
+    static constexpr int kClasses = 6; // 128B, 256B, ..., 4KiB
+
+    static void* Allocate(std::size_t size) {
+        switch (ClassOf(size)) {
+        case 0: return FreeList<kMinSize << 0, kAlign>::Allocate();
+        case 1: return FreeList<kMinSize << 1, kAlign>::Allocate();
+        case 2: return FreeList<kMinSize << 2, kAlign>::Allocate();
+        case 3: return FreeList<kMinSize << 3, kAlign>::Allocate();
+        case 4: return FreeList<kMinSize << 4, kAlign>::Allocate();
+        case 5: return FreeList<kMinSize << 5, kAlign>::Allocate();
+        default: return ::operator new(size, std::align_val_t(kAlign));
+        }
+    }
+    static void Deallocate(void* frame, std::size_t size) {
+        switch (ClassOf(size)) {
+        case 0: FreeList<kMinSize << 0, kAlign>::Deallocate(frame); break;
+        case 1: FreeList<kMinSize << 1, kAlign>::Deallocate(frame); break;
+        case 2: FreeList<kMinSize << 2, kAlign>::Deallocate(frame); break;
+        case 3: FreeList<kMinSize << 3, kAlign>::Deallocate(frame); break;
+        case 4: FreeList<kMinSize << 4, kAlign>::Deallocate(frame); break;
+        case 5: FreeList<kMinSize << 5, kAlign>::Deallocate(frame); break;
+        default: ::operator delete(frame, std::align_val_t(kAlign)); break;
+        }
+    }
+private:
+    static constexpr std::size_t kAlign = alignof(std::max_align_t);
+    // 超过最大级别时返回-1
+    static int ClassOf(std::size_t size) {
+        int cls = 0;
+        while (cls < kClasses && (kMinSize << cls) < size) cls++;
+        return cls < kClasses ? cls : -1;
+    }
+};
+
+// 协程的promise公共部分: 帧从CoFrameAllocator分配, 结束时转到等待者继续执行(对称转移, 不增加调用栈)
+struct CoPromiseBase {
+    std::coroutine_handle<> _continuation = std::noop_coroutine();
+    std::exception_ptr _exception;
+
+    static void* operator new(std::size_t size) { return CoFrameAllocator::Allocate(size); }
+    static void operator delete(void* frame, std::size_t size) { CoFrameAllocator::Deallocate(frame, size); }
+
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            return handle.promise()._continuation;
+        }
+        void await_resume() const noexcept {}
+    };
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() { _exception = std::current_exception(); }
+};
+
+template <class T>
+struct CoPromise : CoPromiseBase {
+    std::optional<T> _value;
+    template <class U>
+    void return_value(U&& value) { _value.emplace(std::forward<U>(value)); }
+    T Result() {
+        if (_exception) std::rethrow_exception(_exception);
+        return std::move(*_value);
+    }
+};
+template <>
+struct CoPromise<void> : CoPromiseBase {
+    void return_void() const noexcept {}
+    void Result() {
+        if (_exception) std::rethrow_exception(_exception);
+    }
+};
+
+// 惰性启动的协程, co_await时才开始执行, 执行完后回到等待者; 异常在co_await处重新抛出
+// 顶层的协程通过CoSpawn启动
+template <class T = void>
+class CoTask {
+public:
+    struct promise_type : CoPromise<T> {
+        CoTask get_return_object() { return CoTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    CoTask() = default;
+    CoTask(CoTask&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+    CoTask& operator=(CoTask&& other) noexcept {
+        if (this != &other) {
+            if (_handle) _handle.destroy();
+            _handle = std::exchange(other._handle, nullptr);
+        }
+        return *this;
+    }
+    CoTask(const CoTask&) = delete;
+    CoTask& operator=(const CoTask&) = delete;
+    ~CoTask() {
+        if (_handle) _handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return !_handle || _handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        _handle.promise()._continuation = awaiting;
+        return _handle;
+    }
+    T await_resume() { return _handle.promise().Result(); }
+private:
+    explicit CoTask(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+    std::coroutine_handle<promise_type> _handle;
+};
+
+// 立即执行、结束时自己销毁的协程, 只用于CoSpawn; 异常不能被捕获, 直接抛出到恢复它的回调中
+struct CoDetached {
+    struct promise_type {
+        static void* operator new(std::size_t size) { return CoFrameAllocator::Allocate(size); }
+        static void operator delete(void* frame, std::size_t size) { CoFrameAllocator::Deallocate(frame, size); }
+        CoDetached get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const { throw; }
+    };
+};
+
+namespace detail {
+inline CoDetached RunDetached(CoTask<void> task) { co_await task; }
+}
+
+// 在当前线程中启动顶层协程, 运行到第一个挂起点后返回
+inline void CoSpawn(CoTask<void> task) { detail::RunDetached(std::move(task)); }
+
+// 协程方式读写的连接: 接管连接的消息、关闭和低水位回调, 读写在协程中挂起等待, 不阻塞事件循环
+// 所有操作必须在连接所属的事件循环线程中进行; 连接关闭(包括对端关闭)后读操作返回剩余的数据
+class CoConnection {
+public:
+    // Write在输出队列超过该大小时挂起, 直到回落到该大小以下
+    static constexpr size_t kWriteLowWater = 64 * 1024;
+
+    CoConnection() = default;
+    // 接管连接, 必须在连接所属的事件循环线程中(如连接建立回调中)调用
+    static CoConnection Attach(const PtrConnection& conn) {
+        conn->SetTypedContext(ContextPool<State>::Acquire());
+        conn->SetMessageCallback([](const PtrConnection& conn, Buffer* buf) {
+            auto state = conn->GetTypedContext<State>();
+            state->_input = buf;
+            state->WakeReader();
+            });
+        conn->SetCloseCallback([](const PtrConnection& conn) {
+            // 在上下文被回收之前唤醒还在等待的协程
+            auto state = conn->GetTypedContext<State>();
+            state->_closed = true;
+            state->WakeReader();
+            state->WakeWriter();
+            });
+        conn->SetLowWaterCallback([](const PtrConnection& conn) {
+            conn->GetTypedContext<State>()->WakeWriter();
+            }, kWriteLowWater);
+        return CoConnection(conn);
+    }
+
+    class ReadAwaiter;
+    class WriteAwaiter;
+    // 读取n个字节, 连接关闭时可能不足n个
+    inline ReadAwaiter Read(size_t n);
+    // 读取当前已经到达的全部数据(至少1个字节), 连接关闭且没有剩余数据时返回空
+    inline ReadAwaiter ReadSome();
+    // 读取到delim为止(包括delim), 连接关闭时返回剩余的数据
+    inline ReadAwaiter ReadUntil(std::string_view delim);
+    // 发送数据, 输出队列回落到kWriteLowWater以下后继续, 连接关闭时返回false
+    inline WriteAwaiter Write(std::string data);
+    // 发送完输出队列后关闭连接
+    void Close() { _conn->Shutdown(); }
+    bool IsOpen() const { return State::Of(_conn) != nullptr && _conn->IsConnected(); }
+    const PtrConnection& Get() const { return _conn; }
+    EventLoop* GetLoop() const { return _conn->GetLoop(); }
+private:
+    struct State : public ConnectionContext {
+        Buffer* _input = nullptr; // 连接的输入缓冲区, 第一次收到数据时设置
+        bool _closed = false;
+        std::coroutine_handle<> _reader; // 等待数据的协程
+        ReadAwaiter* _read = nullptr;
+        std::coroutine_handle<> _writer; // 等待输出队列回落的协程
+        void Reset() override {
+            _input = nullptr;
+            _closed = false;
+            _reader = nullptr;
+            _read = nullptr;
+            _writer = nullptr;
+        }
+        inline void WakeReader();
+        void WakeWriter() {
+            if (_writer) std::exchange(_writer, nullptr).resume();
+        }
+        // 连接已经关闭时返回nullptr
+        static State* Of(const PtrConnection& conn) {
+            return conn ? conn->GetTypedContext<State>() : nullptr;
+        }
+    };
+    explicit CoConnection(PtrConnection conn) : _conn(std::move(conn)) {}
+
+    PtrConnection _conn;
+};
+
+class CoConnection::ReadAwaiter {
+public:
+    ReadAwaiter(const ReadAwaiter&) = delete;
+    ReadAwaiter& operator=(const ReadAwaiter&) = delete;
+    // 协程在等待中被销毁时取消等待
+    ~ReadAwaiter() {
+        State* state = State::Of(_conn);
+        if (state != nullptr && state->_read == this) {
+            state->_reader = nullptr;
+            state->_read = nullptr;
+        }
+    }
+    bool await_ready() {
+        _state = State::Of(_conn);
+        return _state == nullptr || _state->_closed || _conn->GetState() != ConnectionState::kConnected || Satisfied();
+    }
+    void await_suspend(std::coroutine_handle<> handle) {
+        _state->_reader = handle;
+        _state->_read = this;
+    }
+    std::string await_resume() {
+        _state = State::Of(_conn);
+        if (_state == nullptr || _state->_input == nullptr) return {};
+        Buffer* buf = _state->_input;
+        return buf->ReadAsString(std::min(Wanted(), buf->ReadableSize()), true);
+    }
+private:
+    friend class CoConnection;
+    ReadAwaiter(PtrConnection conn, size_t n, std::string_view delim) : _conn(std::move(conn)), _n(n), _delim(delim) {}
+    // 缓冲区中的数据是否已经满足要求
+    bool Satisfied() {
+        if (_state->_input == nullptr) return false;
+        Buffer* buf = _state->_input;
+        if (!_delim.empty()) {
+            std::string_view data(buf->ReadPos(), buf->ReadableSize());
+            auto pos = data.find(_delim, _scan);
+            if (pos == std::string_view::npos) {
+                // 下次从可能跨越边界的位置继续查找
+                _scan = data.size() >= _delim.size() ? data.size() - _delim.size() + 1 : 0;
+                return false;
+            }
+            _found = pos + _delim.size();
+            return true;
+        }
+        return _n == 0 ? buf->ReadableSize() > 0 : buf->ReadableSize() >= _n;
+    }
+    // 本次读取的字节数(没有满足要求时取出全部剩余数据)
+    size_t Wanted() const {
+        if (!_delim.empty()) return _found ? _found : SIZE_MAX;
+        return _n == 0 ? SIZE_MAX : _n;
+    }
+
+    PtrConnection _conn;
+    State* _state = nullptr;
+    size_t _n; // 0表示读取已经到达的全部数据
+    std::string_view _delim; // 非空时读取到分隔符为止
+    size_t _scan = 0; // 已经确认没有分隔符的长度
+    size_t _found = 0; // 找到的分隔符结尾的位置
+};
+
+void CoConnection::State::WakeReader() {
+    if (!_reader) return;
+    // 关闭时直接唤醒, 否则数据满足要求才唤醒
+    if (!_closed && !_read->Satisfied()) return;
+    _read = nullptr;
+    std::exchange(_reader, nullptr).resume();
+}
+
+class CoConnection::WriteAwaiter {
+public:
+    bool await_ready() const {
+        State* state = State::Of(_conn);
+        return state == nullptr || state->_closed || _conn->OutputSize() <= kWriteLowWater;
+    }
+    void await_suspend(std::coroutine_handle<> handle) { State::Of(_conn)->_writer = handle; }
+    bool await_resume() const {
+        State* state = State::Of(_conn);
+        return state != nullptr && !state->_closed && _conn->IsConnected();
+    }
+private:
+    friend class CoConnection;
+    explicit WriteAwaiter(PtrConnection conn) : _conn(std::move(conn)) {}
+    PtrConnection _conn;
+};
+
+CoConnection::ReadAwaiter CoConnection::Read(size_t n) { return ReadAwaiter(_conn, std::max<size_t>(n, 1), {}); }
+CoConnection::ReadAwaiter CoConnection::ReadSome() { return ReadAwaiter(_conn, 0, {}); }
+CoConnection::ReadAwaiter CoConnection::ReadUntil(std::string_view delim) { return ReadAwaiter(_conn, 0, delim); }
+CoConnection::WriteAwaiter CoConnection::Write(std::string data) {
+    if (State::Of(_conn) != nullptr) _conn->Send(std::move(data));
+    return WriteAwaiter(_conn);
+}
+
+namespace detail {
+inline CoTask<void> ServeConnection(CoTask<void> task, CoConnection conn) {
+    co_await task;
+    conn.Close();
+}
+}
+
+// 每个新连接启动一个协程处理, 协程返回后关闭连接
+inline void CoServe(TcpServer& server, std::function<CoTask<void>(CoConnection)> handler) {
+    server.SetConnectedCallback([handler = std::move(handler)](const PtrConnection& conn) {
+        CoConnection co = CoConnection::Attach(conn);
+        CoSpawn(detail::ServeConnection(handler(co), co));
+        });
+}
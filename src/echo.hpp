@@ -13,7 +13,7 @@ private:
 
     void OnMessage(const PtrConnection& conn, Buffer* buffer) {
         std::string msg = buffer->ReadAsString(buffer->ReadableSize(), true);
-        conn->Send(msg.data(), msg.size());
+        conn->Send(std::move(msg));
         conn->Shutdown();
     }
 public:
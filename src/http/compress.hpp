@@ -0,0 +1,135 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef HTTP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HTTP_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+// 响应正文压缩, 编解码库在构建时探测(HTTP_HAVE_ZLIB / HTTP_HAVE_BROTLI)
+namespace Compress {
+    enum Encoding { kIdentity = 0, kGzip = 1, kBrotli = 2 };
+
+    // Content-Encoding中的名字
+    inline const char* Name(int encoding) {
+        switch (encoding) {
+        case kGzip:
+            return "gzip";
+        case kBrotli:
+            return "br";
+        default:
+            return "identity";
+        }
+    }
+    // 预压缩文件的后缀
+    inline const char* Suffix(int encoding) {
+        switch (encoding) {
+        case kGzip:
+            return ".gz";
+        case kBrotli:
+            return ".br";
+        default:
+            return "";
+        }
+    }
+    // 是否可以在运行时压缩
+    inline bool Supported(int encoding) {
+        switch (encoding) {
+#ifdef HTTP_HAVE_ZLIB
+        case kGzip:
+            return true;
+#endif
+#ifdef HTTP_HAVE_BROTLI
+        case kBrotli:
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+    // 按Accept-Encoding协商, 返回客户端接受的编码的位集合(1 << Encoding)
+    inline int Accepted(std::string_view header) {
+        int accepted = 0, rejected = 0;
+        bool any = false;
+        while (!header.empty()) {
+            size_t comma = std::min(header.find(','), header.size());
+            auto item = header.substr(0, comma);
+            header.remove_prefix(std::min(comma + 1, header.size()));
+            // coding;q=0.5
+            size_t semi = std::min(item.find(';'), item.size());
+            auto coding = item.substr(0, semi);
+            while (!coding.empty() && coding.front() == ' ') coding.remove_prefix(1);
+            while (!coding.empty() && coding.back() == ' ') coding.remove_suffix(1);
+            bool zero = false;
+            auto q = item.find("q=", semi);
+            if (q != std::string_view::npos) {
+                std::string value(item.substr(q + 2));
+                zero = strtod(value.c_str(), nullptr) <= 0;
+            }
+            int bit = 0;
+            if (coding == "gzip" || coding == "x-gzip") bit = 1 << kGzip;
+            else if (coding == "br") bit = 1 << kBrotli;
+            else if (coding == "*") any = !zero;
+            if (zero) rejected |= bit;
+            else accepted |= bit;
+        }
+        if (any) accepted |= ((1 << kGzip) | (1 << kBrotli)) & ~rejected;
+        return accepted;
+    }
+    // 正文是否值得压缩(文本类的MIME类型)
+    inline bool Compressible(std::string_view mime) {
+        mime = mime.substr(0, mime.find(';'));
+        if (mime.substr(0, 5) == "text/") return true;
+        static constexpr std::string_view kTypes[] = {
+            "application/json", "application/javascript", "application/xml", "application/xhtml+xml",
+            "application/x-javascript", "application/wasm", "image/svg+xml", "image/x-icon"
+        };
+        for (auto type : kTypes) {
+            if (mime == type) return true;
+        }
+        return false;
+    }
+    // 压缩data到out, 失败或者库不可用时返回false
+    // level为0~9(gzip)或0~11(brotli)
+    inline bool Encode(int encoding, [[maybe_unused]] std::string_view data, [[maybe_unused]] std::string& out,
+        [[maybe_unused]] int level) {
+        switch (encoding) {
+#ifdef HTTP_HAVE_ZLIB
+        case kGzip: {
+            z_stream zs{};
+            // windowBits加16生成gzip格式
+            if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+            out.resize(deflateBound(&zs, data.size()));
+            zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+            zs.avail_in = static_cast<uInt>(data.size());
+            zs.next_out = reinterpret_cast<Bytef*>(out.data());
+            zs.avail_out = static_cast<uInt>(out.size());
+            int ret = deflate(&zs, Z_FINISH);
+            out.resize(zs.total_out);
+            deflateEnd(&zs);
+            return ret == Z_STREAM_END;
+        }
+#endif
+#ifdef HTTP_HAVE_BROTLI
+        case kBrotli: {
+            size_t size = BrotliEncoderMaxCompressedSize(data.size());
+            if (size == 0) return false;
+            out.resize(size);
+            if (!BrotliEncoderCompress(level, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(),
+                reinterpret_cast<const uint8_t*>(data.data()), &size, reinterpret_cast<uint8_t*>(out.data()))) {
+                return false;
+            }
+            out.resize(size);
+            return true;
+        }
+#endif
+        default:
+            return false;
+        }
+    }
+}
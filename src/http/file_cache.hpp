@@ -0,0 +1,204 @@
+#pragma once
+#include "../server.hpp"
+#include <list>
+#include <unordered_set>
+#include <sys/inotify.h>
+
+// 缓存的静态文件, 创建后只读, 可以被所有线程共享
+struct CachedFile {
+    std::string _key; // 缓存的键, 压缩版本为"路径|编码"
+    std::string _path; // 内容来源的磁盘文件, 用于检查文件是否变化
+    std::shared_ptr<const std::string> _body; // 文件内容, 为空表示该编码不值得使用(压缩后没有变小)
+    std::string _mime;
+    std::string _encoding; // Content-Encoding, 原始内容为空
+    std::string _etag;
+    std::string _last_modified;
+    std::string _headers; // 预先生成的Content-Type/Content-Length/ETag/Last-Modified等头部
+    size_t _size = 0; // 正文大小
+    size_t _file_size = 0; // 读取时磁盘文件的大小
+    struct timespec _mtime{};
+};
+
+// 静态文件的LRU缓存, 按解析后的路径(压缩版本为"路径|编码")索引, 所有事件循环线程共享
+// 文件所在目录通过inotify监听, 文件被修改、删除或替换时立即失效;
+// 无法监听时退化为每秒最多stat一次, 比较修改时间和大小
+class FileCache {
+public:
+    static constexpr size_t kDefaultCapacity = 64 * 1024 * 1024;
+    static constexpr size_t kDefaultMaxFileSize = 256 * 1024;
+    static constexpr uint64_t kRevalidateMs = 1000;
+
+    explicit FileCache(size_t capacity = kDefaultCapacity, size_t max_file_size = kDefaultMaxFileSize)
+        : _capacity(capacity)
+        , _max_file_size(max_file_size)
+        , _inotify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+        if (_inotify == -1) {
+            lg(Warning, "inotify init failed: %s, file cache falls back to stat", strerror(errno));
+        }
+    }
+    ~FileCache() {
+        if (_channel) _channel->Remove();
+        if (_inotify != -1) close(_inotify);
+    }
+    FileCache(const FileCache&) = delete;
+    FileCache& operator=(const FileCache&) = delete;
+
+    // 设置缓存总大小和单个文件的大小上限, 总大小为0时关闭缓存
+    void SetCapacity(size_t capacity, size_t max_file_size) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _capacity = capacity;
+        _max_file_size = max_file_size;
+        Evict();
+    }
+    bool Cacheable(size_t size) const {
+        return _capacity > 0 && size <= _max_file_size;
+    }
+    // 在指定的事件循环中处理inotify事件, 必须在该事件循环线程中(或者启动之前)调用
+    void Attach(EventLoop* loop) {
+        if (_inotify == -1 || _channel) return;
+        _channel = std::make_unique<Channel>(_inotify, loop);
+        _channel->SetReadCallback([this] { HandleEvents(); });
+        _channel->EnableRead();
+    }
+    // 压缩版本的键
+    static std::string VariantKey(const std::string& path, const char* encoding) {
+        return path + "|" + encoding;
+    }
+    // 查找缓存, 命中时移动到LRU的头部
+    std::shared_ptr<const CachedFile> Get(const std::string& key) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(key);
+        if (it == _index.end()) return nullptr;
+        auto entry = it->second;
+        if (entry->_wd == -1) {
+            uint64_t now = NowMs();
+            if (now - entry->_checked_ms >= kRevalidateMs) {
+                if (!Unchanged(*entry->_file)) {
+                    Erase(entry);
+                    return nullptr;
+                }
+                entry->_checked_ms = now;
+            }
+        }
+        _lru.splice(_lru.begin(), _lru, entry);
+        return entry->_file;
+    }
+    // 加入缓存, 超过总大小时淘汰最久未使用的文件
+    void Put(const std::shared_ptr<const CachedFile>& file) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending.erase(file->_key);
+        if (!Cacheable(file->_size)) return;
+        auto it = _index.find(file->_key);
+        if (it != _index.end()) Erase(it->second);
+        auto slash = file->_path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : file->_path.substr(0, slash + 1);
+        std::string name = slash == std::string::npos ? file->_path : file->_path.substr(slash + 1);
+        int wd = -1;
+        if (_channel) {
+            wd = inotify_add_watch(_inotify, dir.c_str(), IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE
+                | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+            if (wd == -1) lg(Warning, "inotify watch %s failed: %s", dir.c_str(), strerror(errno));
+        }
+        // 先建立监听再检查文件, 读取之后发生的修改要么在这里发现, 要么产生inotify事件
+        if (!Unchanged(*file)) return;
+        _lru.push_front(Entry{ file, wd, std::move(name), NowMs() });
+        _index[file->_key] = _lru.begin();
+        _bytes += file->_size;
+        Evict();
+    }
+    // 使指定的缓存失效
+    void Invalidate(const std::string& key) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(key);
+        if (it != _index.end()) Erase(it->second);
+    }
+    // 标记某个键正在后台生成, 已经在生成时返回false, 避免重复提交
+    bool MarkPending(const std::string& key) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _pending.insert(key).second;
+    }
+    // 后台生成失败时取消标记(成功时由Put取消)
+    void ClearPending(const std::string& key) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending.erase(key);
+    }
+    void Clear() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _lru.clear();
+        _index.clear();
+        _bytes = 0;
+    }
+private:
+    struct Entry {
+        std::shared_ptr<const CachedFile> _file;
+        int _wd; // 所在目录的inotify监听, -1表示没有监听
+        std::string _name; // 文件名
+        uint64_t _checked_ms; // 上一次确认文件没有变化的时间
+    };
+    using EntryIter = std::list<Entry>::iterator;
+
+    static uint64_t NowMs() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+    // 文件的修改时间和大小是否与缓存一致
+    static bool Unchanged(const CachedFile& file) {
+        struct stat st{};
+        if (stat(file._path.c_str(), &st) == -1 || !S_ISREG(st.st_mode)) return false;
+        return static_cast<size_t>(st.st_size) == file._file_size
+            && st.st_mtim.tv_sec == file._mtime.tv_sec && st.st_mtim.tv_nsec == file._mtime.tv_nsec;
+    }
+    void Erase(EntryIter entry) {
+        _bytes -= entry->_file->_size;
+        _index.erase(entry->_file->_key);
+        _lru.erase(entry);
+    }
+    void Evict() {
+        while (!_lru.empty() && _bytes > _capacity) Erase(std::prev(_lru.end()));
+    }
+    // 使某个目录下的文件失效, name为空时整个目录失效
+    void InvalidateWatch(int wd, const char* name) {
+        for (auto it = _lru.begin(); it != _lru.end();) {
+            auto cur = it++;
+            if (cur->_wd == wd && (name == nullptr || cur->_name == name)) Erase(cur);
+        }
+    }
+    void HandleEvents() {
+        alignas(struct inotify_event) char buf[4096];
+        for (;;) {
+            ssize_t n = read(_inotify, buf, sizeof(buf));
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) continue;
+                break;
+            }
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (char* p = buf; p < buf + n;) {
+                auto ev = reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    // 事件丢失, 无法确定哪些文件发生了变化
+                    _lru.clear();
+                    _index.clear();
+                    _bytes = 0;
+                }
+                else if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    InvalidateWatch(ev->wd, nullptr);
+                }
+                else if (ev->len > 0) {
+                    InvalidateWatch(ev->wd, ev->name);
+                }
+            }
+        }
+    }
+private:
+    std::mutex _mutex; // 保护LRU链表、索引和总大小
+    std::list<Entry> _lru; // 头部是最近使用的
+    std::unordered_map<std::string, EntryIter> _index;
+    std::unordered_set<std::string> _pending; // 正在后台生成的键
+    size_t _bytes = 0; // 缓存的文件总大小
+    std::atomic<size_t> _capacity;
+    std::atomic<size_t> _max_file_size;
+    int _inotify;
+    std::unique_ptr<Channel> _channel; // inotify事件
+};
@@ -1,6 +1,16 @@
 #pragma once
 #include "../server.hpp"
+#include "router.hpp"
+#include "file_cache.hpp"
+#include "compress.hpp"
+#include "websocket.hpp"
+#include "../worker.hpp"
+#include "../coro.hpp"
 #include <fstream>
+#include <string_view>
+#include <charconv>
+#include <algorithm>
+#include <random>
 #include <sys/stat.h>
 #include <regex>
 
@@ -79,6 +89,41 @@ namespace Util {
         }
         return result;
     }
+    // 原地URL解码, 解码后的长度写回len, 遇到非法的%转义返回false
+    bool UrlDecodeInPlace(char* str, size_t& len, bool plus_as_space = false) {
+        auto hex = [](char c) -> int {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+            };
+        size_t j = 0;
+        for (size_t i = 0; i < len; i++, j++) {
+            if (str[i] == '%') {
+                if (i + 2 >= len) return false;
+                int hi = hex(str[i + 1]), lo = hex(str[i + 2]);
+                if (hi < 0 || lo < 0) return false;
+                str[j] = static_cast<char>(hi << 4 | lo);
+                i += 2;
+            }
+            else if (str[i] == '+' && plus_as_space) {
+                str[j] = ' ';
+            }
+            else {
+                str[j] = str[i];
+            }
+        }
+        len = j;
+        return true;
+    }
+    // 不区分大小写比较
+    bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+        if (a.size() != b.size()) return false;
+        for (size_t i = 0; i < a.size(); i++) {
+            if (tolower(static_cast<unsigned char>(a[i])) != tolower(static_cast<unsigned char>(b[i]))) return false;
+        }
+        return true;
+    }
     // URL编码
     std::string UrlEncode(const std::string& str, bool space_as_plus = false) {
         std::string result;
@@ -198,6 +243,29 @@ namespace Util {
         }
         return "application/octet-stream";
     }
+    // HTTP日期格式, 如 Sun, 06 Nov 1994 08:49:37 GMT
+    std::string HttpDate(time_t t) {
+        struct tm tm{};
+        gmtime_r(&t, &tm);
+        char buf[64];
+        size_t n = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return std::string(buf, n);
+    }
+    // 解析HTTP日期(IMF-fixdate格式), 失败返回false
+    bool ParseHttpDate(std::string_view str, time_t& t) {
+        std::string date(str);
+        struct tm tm{};
+        const char* end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (end == nullptr || *end != '\0') return false;
+        t = timegm(&tm);
+        return true;
+    }
+    // 根据修改时间和大小生成ETag
+    std::string MakeETag(const struct timespec& mtime, size_t size) {
+        char buf[64];
+        int n = snprintf(buf, sizeof(buf), "\"%lx-%zx\"", static_cast<unsigned long>(mtime.tv_sec), size);
+        return std::string(buf, n);
+    }
     // 判断文件是否是一个目录
     bool IsDirectory(const std::string& file) {
         struct stat st{};
@@ -240,68 +308,150 @@ namespace Util {
     }
 }
 
+// 请求中的字段列表, 键值都是指向请求自身存储的视图, 查找时键不区分大小写
+using HttpFields = RouteParams;
+
 class HttpRequest {
 public:
+    HttpRequest() = default;
+    // 拷贝时把视图重新指向新对象自己的存储
+    HttpRequest(const HttpRequest& other) { *this = other; }
+    HttpRequest& operator=(const HttpRequest& other) {
+        if (this == &other) return *this;
+        _raw = other._raw;
+        _owned = other._owned;
+        _body = other._body;
+        auto rebase = [&](std::string_view v) -> std::string_view {
+            const char* p = v.data();
+            if (p >= other._raw.data() && p < other._raw.data() + other._raw.size()) {
+                return { _raw.data() + (p - other._raw.data()), v.size() };
+            }
+            for (size_t i = 0; i < other._owned.size(); i++) {
+                if (p == other._owned[i].first.data()) return _owned[i].first;
+                if (p == other._owned[i].second.data()) return _owned[i].second;
+            }
+            return v;
+            };
+        _method = rebase(other._method);
+        _path = rebase(other._path);
+        _version = rebase(other._version);
+        _headers.clear();
+        for (auto& [k, v] : other._headers) _headers.emplace_back(rebase(k), rebase(v));
+        _params.clear();
+        for (auto& [k, v] : other._params) _params.emplace_back(rebase(k), rebase(v));
+        _captures.clear();
+        for (auto& [k, v] : other._captures) _captures.emplace_back(k, rebase(v));
+        return *this;
+    }
+    // 清空请求, 保留已经分配的空间供下一个请求使用
     void Clear() {
-        _method.clear();
-        _path.clear();
+        _method = {};
+        _path = {};
         _version = "HTTP/1.1";
         _body.clear();
         _headers.clear();
         _params.clear();
-        std::smatch match;
-        _matches.swap(match);
+        _captures.clear();
+        _raw.clear();
+        _owned.clear();
     }
     // 插入头部字段
     void SetHeader(const std::string& key, const std::string& value) {
-        _headers[key] = value;
+        auto& [k, v] = _owned.emplace_back(key, value);
+        SetField(_headers, k, v);
     }
     // 是否存在指定的头部字段
-    bool HasHeader(const std::string& key) const {
-        return _headers.find(key) != _headers.end();
+    bool HasHeader(std::string_view key) const {
+        return FindField(_headers, key) != nullptr;
     }
     // 获取指定头部字段的值
-    std::string GetHeader(const std::string& key) const {
-        auto it = _headers.find(key);
-        if (it != _headers.end()) {
-            return it->second;
-        }
-        return "";
+    std::string GetHeader(std::string_view key) const {
+        return std::string(HeaderView(key));
+    }
+    // 获取指定头部字段的值, 不拷贝
+    std::string_view HeaderView(std::string_view key) const {
+        auto field = FindField(_headers, key);
+        return field ? field->second : std::string_view();
     }
     // 插入URL参数
     void SetParam(const std::string& key, const std::string& value) {
-        _params[key] = value;
+        auto& [k, v] = _owned.emplace_back(key, value);
+        SetField(_params, k, v);
     }
     // 是否存在指定的URL参数
-    bool HasParam(const std::string& key) const {
-        return _params.find(key) != _params.end();
+    bool HasParam(std::string_view key) const {
+        return FindField(_params, key) != nullptr;
     }
     // 获取指定URL参数的值
-    std::string GetParam(const std::string& key) const {
-        auto it = _params.find(key);
-        if (it != _params.end()) {
-            return it->second;
+    std::string GetParam(std::string_view key) const {
+        return std::string(ParamView(key));
+    }
+    // 获取指定URL参数的值, 不拷贝
+    std::string_view ParamView(std::string_view key) const {
+        auto field = FindField(_params, key);
+        return field ? field->second : std::string_view();
+    }
+    // 获取路由捕获的参数
+    std::string GetCapture(std::string_view name) const {
+        return std::string(CaptureView(name));
+    }
+    std::string_view CaptureView(std::string_view name) const {
+        for (auto& [k, v] : _captures) {
+            if (k == name) return v;
         }
-        return "";
+        return {};
+    }
+    // 获取正文长度, 格式错误时返回false
+    bool GetContentLength(size_t& length) const {
+        length = 0;
+        auto value = HeaderView("Content-Length");
+        if (value.empty()) return !HasHeader("Content-Length");
+        auto [p, ec] = std::from_chars(value.data(), value.data() + value.size(), length);
+        return ec == std::errc() && p == value.data() + value.size();
     }
-    // 获取正文长度
     size_t GetContentLength() const {
-        return HasHeader("Content-Length") ? std::stoul(GetHeader("Content-Length")) : 0;
+        size_t length;
+        return GetContentLength(length) ? length : 0;
     }
-    // 是否是短连接
+    // 是否是长连接
     bool IsKeepAlive() const {
-        return HasHeader("Connection") && GetHeader("Connection") == "keep-alive";
+        return Util::EqualsIgnoreCase(HeaderView("Connection"), "keep-alive");
     }
 
-    std::string _method;
-    std::string _path;
-    std::string _version = "HTTP/1.1";
+    std::string_view _method;
+    std::string_view _path; // 已经URL解码
+    std::string_view _version = "HTTP/1.1";
     std::string _body;
-    std::smatch _matches;
-    std::unordered_map<std::string, std::string> _headers; // 头部字段
-    std::unordered_map<std::string, std::string> _params; // URL参数
+    HttpFields _headers; // 头部字段
+    HttpFields _params; // URL参数
+    HttpFields _captures; // 路由捕获的参数(:name, *name, 正则捕获组"1","2"...)
+private:
+    friend class HttpContext;
+
+    static const std::pair<std::string_view, std::string_view>* FindField(const HttpFields& fields, std::string_view key) {
+        for (auto& field : fields) {
+            if (Util::EqualsIgnoreCase(field.first, key)) return &field;
+        }
+        return nullptr;
+    }
+    static void SetField(HttpFields& fields, std::string_view key, std::string_view value) {
+        for (auto& field : fields) {
+            if (Util::EqualsIgnoreCase(field.first, key)) {
+                field = { key, value };
+                return;
+            }
+        }
+        fields.emplace_back(key, value);
+    }
+
+    std::string _raw; // 请求行和头部的原始数据, 所有视图都指向这里
+    std::deque<std::pair<std::string, std::string>> _owned; // 通过SetHeader/SetParam插入的字段
 };
 
+class HttpStream;
+// 流式响应的生产者, 在连接所属的事件循环线程中调用
+using StreamProducer = std::function<void(const std::shared_ptr<HttpStream>&)>;
+
 class HttpResponse {
 public:
     explicit HttpResponse(int status_code = 200) : _status_code(status_code), _redirect(false) {}
@@ -311,6 +461,13 @@ public:
         _redirect = false;
         _redirect_url.clear();
         _body.clear();
+        _shared_body.reset();
+        _file.reset();
+        _file_offset = 0;
+        _file_length = 0;
+        _cached.reset();
+        _chain.Clear();
+        _producer = nullptr;
         _headers.clear();
     }
     void SetHeader(const std::string& key, const std::string& value) {
@@ -331,6 +488,52 @@ public:
         SetHeader("Content-Type", mime_type);
         SetHeader("Content-Length", std::to_string(_body.size()));
     }
+    // 以共享只读数据作为正文(如缓存内容), 发送时只持有引用不拷贝
+    void SetContent(const std::shared_ptr<const std::string>& body, const std::string& mime_type = "text/plain") {
+        _body.clear();
+        _file.reset();
+        _shared_body = body;
+        SetHeader("Content-Type", mime_type);
+        SetHeader("Content-Length", std::to_string(_shared_body->size()));
+    }
+    // 以文件区段作为正文, 发送时由连接通过sendfile直接从文件描述符传输
+    void SetFile(const std::shared_ptr<FileHandle>& file, const std::string& mime_type, off_t offset = 0, size_t length = std::string::npos) {
+        _body.clear();
+        _shared_body.reset();
+        _file = file;
+        _file_offset = offset;
+        _file_length = std::min(length, file->GetSize() - static_cast<size_t>(offset));
+        SetHeader("Content-Type", mime_type);
+        SetHeader("Content-Length", std::to_string(_file_length));
+    }
+    // 以缓存的文件作为正文, 头部使用缓存中预先生成的内容
+    void SetCached(const std::shared_ptr<const CachedFile>& file) {
+        _body.clear();
+        _shared_body.reset();
+        _file.reset();
+        _cached = file;
+    }
+    // 以组装好的输出链作为正文(如Range请求的文件区段)
+    void SetContent(OutputChain&& chain, const std::string& mime_type) {
+        _body.clear();
+        _shared_body.reset();
+        _file.reset();
+        _cached.reset();
+        _chain = std::move(chain);
+        SetHeader("Content-Type", mime_type);
+        SetHeader("Content-Length", std::to_string(_chain.ReadableSize()));
+    }
+    // 流式响应: 先发送头部, 正文由生产者分块写入(见HttpStream)
+    void SetStream(const std::string& mime_type, StreamProducer producer) {
+        _body.clear();
+        _shared_body.reset();
+        _file.reset();
+        _cached.reset();
+        _chain.Clear();
+        _producer = std::move(producer);
+        SetHeader("Content-Type", mime_type);
+    }
+    bool IsStream() const { return static_cast<bool>(_producer); }
     void SetRedirect(const std::string& url, int status_code = 302) {
         _redirect = true;
         _redirect_url = url;
@@ -343,9 +546,161 @@ public:
     bool _redirect;
     std::string _redirect_url;
     std::string _body;
+    std::shared_ptr<const std::string> _shared_body; // 共享正文(与_body互斥)
+    std::shared_ptr<FileHandle> _file; // 文件正文(与_body互斥)
+    off_t _file_offset = 0;
+    size_t _file_length = 0;
+    std::shared_ptr<const CachedFile> _cached; // 缓存的文件(与_body互斥)
+    OutputChain _chain; // 组装好的正文(与_body互斥)
+    StreamProducer _producer; // 流式响应的生产者(与_body互斥)
     std::unordered_map<std::string, std::string> _headers; // 头部字段
 };
 
+// 流式响应的正文, HTTP/1.1使用分块编码, HTTP/1.0直接发送并以关闭连接表示结束
+// 生产者在事件循环线程中被反复调用, 每次写入一块或多块正文, 全部写完后调用End;
+// 连接的输出队列超过高水位时暂停调用, 回落到低水位以下后继续, 慢速的客户端不会让内存无限增长;
+// 一次调用没有写入任何数据时也暂停(如等待外部事件), 之后可以在任意线程中Write, 或者调用Resume继续调用生产者
+class HttpStream : public std::enable_shared_from_this<HttpStream> {
+public:
+    using EndCallback = std::function<void(const PtrConnection&)>;
+    static constexpr int kProduceBatch = 16; // 每轮最多调用生产者的次数, 之后让出事件循环
+
+    HttpStream(const PtrConnection& conn, StreamProducer producer, bool chunked, size_t high_water, size_t low_water)
+        : _conn(conn)
+        , _loop(conn->GetLoop())
+        , _producer(std::move(producer))
+        , _chunked(chunked)
+        , _high_water(high_water)
+        , _low_water(low_water) {}
+
+    // 写入一块正文, 可以在任意线程中调用, 连接已经关闭或者响应已经结束时返回false
+    // 超过高水位时数据仍然会被接受, 在其他线程中写入的一方应该检查IsWritable
+    bool Write(std::string data) {
+        if (IsClosed()) return false;
+        if (data.empty()) return true; // 空的分块表示结束, 不能发送
+        if (_loop->IsInLoopThread()) WriteInLoop(std::move(data));
+        else _loop->QueueInLoop([self = shared_from_this(), data = std::move(data)]() mutable { self->WriteInLoop(std::move(data)); });
+        return true;
+    }
+    // 按server-sent events的格式写入一个事件
+    bool WriteEvent(std::string_view data, std::string_view event = "") {
+        std::string frame;
+        if (!event.empty()) frame.append("event: ").append(event).append("\n");
+        while (true) {
+            size_t nl = data.find('\n');
+            frame.append("data: ").append(data.substr(0, nl)).append("\n");
+            if (nl == std::string_view::npos) break;
+            data.remove_prefix(nl + 1);
+        }
+        frame += '\n';
+        return Write(std::move(frame));
+    }
+    // 结束响应, 可以在任意线程中调用
+    void End() {
+        _loop->RunInLoop([self = shared_from_this()] { self->EndInLoop(); });
+    }
+    // 重新开始调用生产者, 可以在任意线程中调用
+    void Resume() {
+        _loop->RunInLoop([self = shared_from_this()] { self->Schedule(); });
+    }
+    // 连接已经关闭或者响应已经结束
+    bool IsClosed() const { return _ended || _closed || _conn.expired(); }
+    // 输出队列低于高水位, 可以继续写入
+    bool IsWritable() const { return _writable; }
+private:
+    friend class HttpServer;
+    // 响应头发送之后开始调用生产者, 响应结束时调用on_end
+    void Start(EndCallback on_end, bool head_only) {
+        _on_end = std::move(on_end);
+        auto conn = _conn.lock();
+        if (!conn) return;
+        // 回调持有流, 暂停期间没有其他引用时流也不会被释放, 响应结束时解除
+        conn->SetLowWaterCallback([self = shared_from_this()](const PtrConnection&) { self->OnLowWater(); }, _low_water);
+        if (head_only) {
+            // HEAD请求只有头部, 也不发送结束的分块
+            _chunked = false;
+            EndInLoop();
+        }
+        else {
+            Schedule();
+        }
+    }
+    void Schedule() {
+        if (_scheduled || IsClosed() || !_writable) return;
+        _scheduled = true;
+        _loop->QueueInLoop([self = shared_from_this()] { self->Produce(); });
+    }
+    void Produce() {
+        _scheduled = false;
+        _producing = true;
+        bool progress = true;
+        for (int i = 0; i < kProduceBatch && progress; i++) {
+            if (IsClosed() || !_writable) break;
+            size_t before = _written;
+            _producer(shared_from_this());
+            // 没有写入数据, 等待Write或者Resume
+            progress = _written != before;
+        }
+        _producing = false;
+        if (IsClosed()) _producer = nullptr;
+        else if (progress) Schedule();
+    }
+    void OnLowWater() {
+        _writable = true;
+        Schedule();
+    }
+    void WriteInLoop(std::string&& data) {
+        auto conn = _conn.lock();
+        if (_ended || !conn || conn->GetState() == ConnectionState::kDisconnected) {
+            _closed = true;
+            return;
+        }
+        _written += data.size();
+        if (!_chunked) {
+            conn->Send(std::move(data));
+        }
+        else {
+            // 长度\r\n 数据\r\n, 三个切片由writev一次发出
+            char size[32];
+            int n = snprintf(size, sizeof(size), "%zx\r\n", data.size());
+            OutputChain chain;
+            chain.Append(size, n);
+            chain.Append(std::move(data));
+            chain.Append("\r\n", 2);
+            conn->Send(std::move(chain));
+        }
+        if (conn->OutputSize() > _high_water) _writable = false;
+    }
+    void EndInLoop() {
+        if (_ended) return;
+        _ended = true;
+        // 生产者中调用End时, 由Produce在返回后释放
+        if (!_producing) _producer = nullptr;
+        auto conn = _conn.lock();
+        if (!conn) return;
+        if (_chunked) conn->Send("0\r\n\r\n", 5);
+        conn->SetLowWaterCallback(nullptr, 0);
+        if (_on_end) {
+            auto on_end = std::move(_on_end);
+            on_end(conn);
+        }
+    }
+private:
+    std::weak_ptr<Connection> _conn;
+    EventLoop* _loop;
+    StreamProducer _producer;
+    EndCallback _on_end;
+    bool _chunked;
+    size_t _high_water;
+    size_t _low_water;
+    size_t _written = 0; // 已经写入的正文长度
+    bool _scheduled = false; // 是否已经安排了调用生产者
+    bool _producing = false; // 是否正在调用生产者
+    std::atomic<bool> _ended{ false };
+    std::atomic<bool> _closed{ false };
+    std::atomic<bool> _writable{ true };
+};
+
 enum class HttpRecvState {
     kRECV_HTTP_LINE,
     kRECV_HTTP_HEAD,
@@ -354,9 +709,65 @@ enum class HttpRecvState {
     kRECV_HTTP_ERROR
 };
 
-class HttpContext {
+// 流式接收正文时的流控, 可以复制到其他线程中使用
+class BodyFlow {
+public:
+    BodyFlow() = default;
+    explicit BodyFlow(const PtrConnection& conn) : _conn(conn) {}
+    // 暂停接收正文, 停止处理输入缓冲区并停止读取套接字
+    inline void Pause() const;
+    // 恢复接收正文
+    inline void Resume() const;
+private:
+    std::weak_ptr<Connection> _conn;
+};
+
+// 流式接收请求正文, 每个请求一个
+struct BodyReader {
+    // 收到一段正文(已经去掉分块编码), 指向连接的输入缓冲区, 返回false时中止请求(500)
+    std::function<bool(const char* data, size_t len)> _on_data;
+    // 正文接收完毕, 生成响应
+    std::function<void(const HttpRequest& req, HttpResponse& resp)> _on_complete;
+    BodyFlow _flow;
+};
+
+// 异步处理函数的完成句柄, 可以复制到任意线程中使用, 只有第一次Send有效
+// 响应切换回连接所属的事件循环发送; 所有副本都销毁时还没有发送响应, 自动回复500
+class HttpResponder {
+public:
+    HttpResponder() = default;
+    // 请求的副本, 在所有句柄销毁之前一直有效
+    const HttpRequest& Request() const { return *_state->_request; }
+    void Send(HttpResponse&& resp) const {
+        if (_state->_done.exchange(true, std::memory_order_acq_rel)) return;
+        _state->_finish(&resp);
+    }
+    bool Done() const { return _state->_done.load(std::memory_order_acquire); }
+private:
+    friend class HttpServer;
+    struct State {
+        std::shared_ptr<const HttpRequest> _request;
+        std::function<void(HttpResponse*)> _finish; // 参数为空表示没有发送响应
+        std::atomic<bool> _done{ false };
+        ~State() {
+            if (!_done.load(std::memory_order_acquire)) _finish(nullptr);
+        }
+    };
+    std::shared_ptr<State> _state;
+};
+
+class HttpContext : public ConnectionContext {
 public:
     HttpContext() : _resp_state(200), _recv_state(HttpRecvState::kRECV_HTTP_LINE) {}
+    void Reset() override {
+        _drain_timer.reset();
+        Clear();
+    }
+    // 停止时空闲连接的宽限期定时器, 上下文回收时随之从时间轮中摘除
+    void StartDrainTimer(EventLoop* loop, uint64_t timeout_ms, TimerNode::TaskFunc task) {
+        _drain_timer = std::make_unique<TimerNode>(std::move(task));
+        loop->AddTimer(_drain_timer.get(), timeout_ms);
+    }
     int GetRespState() const { return _resp_state; }
     HttpRecvState GetRecvState() const { return _recv_state; }
     HttpRequest& GetRequest() { return _request; }
@@ -364,173 +775,418 @@ public:
     void RecvHttpRequest(Buffer* buf) {
         switch (_recv_state) {
         case HttpRecvState::kRECV_HTTP_LINE:
-            RecvHttpLine(buf);
         case HttpRecvState::kRECV_HTTP_HEAD:
+            // 请求头完整后先返回, 由使用者决定正文的接收方式(HeadReady)
             RecvHttpHead(buf);
+            break;
         case HttpRecvState::kRECV_HTTP_BODY:
             RecvHttpBody(buf);
+            break;
+        default:
+            break;
         }
     }
     void Clear() {
         _resp_state = 200;
         _recv_state = HttpRecvState::kRECV_HTTP_LINE;
+        _line_start = 0;
+        _scan = 0;
+        _busy = false;
+        _paused = false;
+        _body_started = false;
+        _chunked = false;
+        _chunk_state = kChunkSize;
+        _chunk_left = 0;
+        _body_received = 0;
+        _start_ns = 0;
+        _parse_ns = 0;
+        _reader = BodyReader();
         _request.Clear();
     }
+    // 收到请求的第一批数据的时间, 0表示还没有开始接收或者已经记录了响应
+    uint64_t GetStartNs() const { return _start_ns; }
+    void SetStartNs(uint64_t ns) { _start_ns = ns; }
+    // 解析请求头累计的耗时(请求头可能分多次到达)
+    uint64_t GetParseNs() const { return _parse_ns; }
+    void AddParseNs(uint64_t ns) { _parse_ns += ns; }
+    // 请求头已经解析完成, 还没有开始接收正文
+    bool HeadReady() const { return _recv_state == HttpRecvState::kRECV_HTTP_BODY && !_body_started; }
+    // 是否还有正文需要接收
+    bool HasBody() const { return _chunked || _request.GetContentLength() > 0; }
+    // 设置流式接收正文, 不再缓存到_body中
+    void SetReader(BodyReader&& reader) { _reader = std::move(reader); }
+    BodyReader& GetReader() { return _reader; }
+    // 暂停时不再处理输入缓冲区中的正文
+    bool IsPaused() const { return _paused; }
+    void SetPaused(bool paused) { _paused = paused; }
+    // 当前请求是否正在异步处理, 处理完之前不解析后续的请求
+    bool IsBusy() const { return _busy; }
+    void SetBusy(bool busy) { _busy = busy; }
 private:
-    bool RecvHttpLine(Buffer* buf) {
-        if (_recv_state != HttpRecvState::kRECV_HTTP_LINE) {
+    void SetError(int status) {
+        _recv_state = HttpRecvState::kRECV_HTTP_ERROR;
+        _resp_state = status;
+    }
+    // 在缓冲区中查找请求头的结尾, 已经扫描过的数据不会重复扫描
+    // 只记录相对读位置的偏移, 缓冲区扩容或者挪动数据都不影响
+    bool RecvHttpHead(Buffer* buf) {
+        if (_recv_state != HttpRecvState::kRECV_HTTP_LINE && _recv_state != HttpRecvState::kRECV_HTTP_HEAD) {
             return false;
         }
-        auto line = buf->ReadLine();
-        // 缓冲区中没有完整的一行
-        if (line.empty()) {
-            if (buf->ReadableSize() > kMaxHttpLineSize) {
-                _recv_state = HttpRecvState::kRECV_HTTP_ERROR;
-                _resp_state = 414; // URI Too Long
+        const char* base = buf->ReadPos();
+        size_t size = buf->ReadableSize();
+        while (_scan < size) {
+            auto p = static_cast<const char*>(memchr(base + _scan, '\n', size - _scan));
+            if (p == nullptr) {
+                _scan = size;
+                break;
+            }
+            size_t end = p - base + 1;
+            size_t len = end - _line_start;
+            if (len > kMaxHttpLineSize) {
+                SetError(414); // URI Too Long
                 return false;
             }
-            return true;
-        }
-        // 解析HTTP请求行
-        if (line.size() > kMaxHttpLineSize) {
-            _recv_state = HttpRecvState::kRECV_HTTP_ERROR;
-            _resp_state = 414;
-            return false;
-        }
-        if (parseHttpLine(line)) {
-            buf->MoveReadIdx(line.size());
-            _recv_state = HttpRecvState::kRECV_HTTP_HEAD;
-            return true;
+            bool empty = len == 1 || (len == 2 && base[_line_start] == '\r');
+            if (_recv_state == HttpRecvState::kRECV_HTTP_LINE) {
+                if (empty) {
+                    // 忽略请求行之前的空行
+                    buf->MoveReadIdx(end);
+                    base = buf->ReadPos();
+                    size = buf->ReadableSize();
+                    _line_start = _scan = 0;
+                    continue;
+                }
+                _recv_state = HttpRecvState::kRECV_HTTP_HEAD;
+            }
+            else if (empty) {
+                return ParseHead(buf, end);
+            }
+            _line_start = _scan = end;
         }
-        else {
+        // 缓冲区中没有完整的一行
+        if (size - _line_start > kMaxHttpLineSize) {
+            SetError(414); // URI Too Long
             return false;
         }
+        return true;
     }
-    bool RecvHttpHead(Buffer* buf) {
-        if (_recv_state != HttpRecvState::kRECV_HTTP_HEAD) {
+    // 请求头已经完整, 拷贝到请求自己的存储中一次解析完成
+    bool ParseHead(Buffer* buf, size_t end) {
+        _request._raw.assign(buf->ReadPos(), end);
+        buf->MoveReadIdx(end);
+        _line_start = _scan = 0;
+        char* p = _request._raw.data();
+        char* last = p + _request._raw.size();
+        bool first = true;
+        while (p < last) {
+            auto nl = static_cast<char*>(memchr(p, '\n', last - p));
+            size_t len = nl - p;
+            if (len > 0 && p[len - 1] == '\r') len--;
+            if (len == 0) break;
+            bool ok = first ? ParseRequestLine(p, len) : ParseHeaderLine(p, len);
+            if (!ok) {
+                SetError(400); // Bad Request
+                return false;
+            }
+            first = false;
+            p = nl + 1;
+        }
+        size_t content_length;
+        if (!_request.GetContentLength(content_length)) {
+            SetError(400); // Bad Request
             return false;
         }
-        // 一行一行读, 直到遇到空行
-        for (;;) {
-            auto line = buf->ReadLine();
-            // 缓冲区中没有完整的一行
-            if (line.empty()) {
-                if (buf->ReadableSize() > kMaxHttpLineSize) {
-                    _recv_state = HttpRecvState::kRECV_HTTP_ERROR;
-                    _resp_state = 414; // URI Too Long
-                    return false;
-                }
-                return true;
-            }
-            // 解析HTTP请求行
-            if (line.size() > kMaxHttpLineSize) {
-                _recv_state = HttpRecvState::kRECV_HTTP_ERROR;
-                _resp_state = 414;
+        if (_request.HasHeader("Transfer-Encoding")) {
+            // 同时带有Content-Length时长度有歧义(请求走私), 直接拒绝
+            if (_request.HasHeader("Content-Length")) {
+                SetError(400); // Bad Request
                 return false;
             }
-            if (line == "\n" || line == "\r\n") {
-                buf->MoveReadIdx(line.size());
-                break;
-            }
-            if (parseHttpHead(line)) {
-                buf->MoveReadIdx(line.size());
-            }
-            else {
+            if (!Util::EqualsIgnoreCase(_request.HeaderView("Transfer-Encoding"), "chunked")) {
+                SetError(501); // Not Implemented
                 return false;
             }
+            _chunked = true;
         }
         _recv_state = HttpRecvState::kRECV_HTTP_BODY;
         return true;
     }
+    // 把一段正文交给流式接收者, 没有设置时缓存到_body中
+    bool DeliverBody(const char* data, size_t len) {
+        _body_received += len;
+        if (!_reader._on_data) {
+            _request._body.append(data, len);
+            return true;
+        }
+        if (!_reader._on_data(data, len)) {
+            SetError(500); // Internal Server Error
+            return false;
+        }
+        return true;
+    }
     bool RecvHttpBody(Buffer* buf) {
         if (_recv_state != HttpRecvState::kRECV_HTTP_BODY) {
             return false;
         }
+        _body_started = true;
+        if (_chunked) return RecvChunkedBody(buf);
         // 读取Content-Length长度的数据
         size_t content_length = _request.GetContentLength();
-        if (content_length == 0) {
-            _recv_state = HttpRecvState::kRECV_HTTP_DONE;
-            return true;
+        if (_body_received < content_length && buf->ReadableSize() > 0 && !_paused) {
+            size_t len = std::min(content_length - _body_received, buf->ReadableSize());
+            if (!DeliverBody(buf->ReadPos(), len)) return false;
+            buf->MoveReadIdx(len);
         }
-        // 缓冲区中没有足够的数据
-        size_t need_size = content_length - _request._body.size();
-        if (buf->ReadableSize() < need_size) {
-            _request._body += buf->ReadAsString(buf->ReadableSize(), true);
-            return true;
-        }
-        else {
-            _request._body += buf->ReadAsString(need_size, true);
+        // 缓冲区中没有足够的数据时等待下一次读取
+        if (_body_received == content_length) {
             _recv_state = HttpRecvState::kRECV_HTTP_DONE;
-            return true;
         }
+        return true;
     }
-    bool parseHttpLine(const std::string& line) {
-        std::smatch matches;
-        std::regex e("(GET|POST|PUT|DELETE|HEAD|OPTIONS|TRACE|CONNECT) ([^?]*)(?:\\?(.*))? (HTTP/1\\.[01])(?:\n|\r\n)", std::regex::icase);
-        // GET www.baidu.com/login?username=123&password=456 HTTP/1.1
-        // 1 : GET
-        // 2 : www.baidu.com/login
-        // 3 : username=123&password=456
-        // 4 : HTTP/1.1
-        if (std::regex_match(line, matches, e)) {
-            _request._method = matches[1];
-            // 转换成大写
-            std::transform(_request._method.begin(), _request._method.end(), _request._method.begin(), ::toupper);
-            _request._path = Util::UrlDecode(matches[2], false);
-            _request._version = matches[4];
-            // key=value&key=value
-            auto queries = Util::Split(matches[3], "&");
-            for (const auto& query : queries) {
-                auto pos = query.find('=');
-                if (pos != std::string::npos) {
-                    std::string k = Util::UrlDecode(query.substr(0, pos), true);
-                    std::string v = Util::UrlDecode(query.substr(pos + 1), true);
-                    _request.SetParam(k, v);
+    // 在缓冲区中查找一行, 返回行的长度(含换行), 没有完整的一行时返回0
+    size_t FindLine(Buffer* buf) {
+        auto p = static_cast<const char*>(memchr(buf->ReadPos(), '\n', buf->ReadableSize()));
+        if (p == nullptr) {
+            if (buf->ReadableSize() > kMaxHttpLineSize) SetError(400); // Bad Request
+            return 0;
+        }
+        return p - buf->ReadPos() + 1;
+    }
+    // 分块编码: 十六进制长度[;扩展]\r\n 数据\r\n ... 0\r\n [尾部字段\r\n] \r\n
+    bool RecvChunkedBody(Buffer* buf) {
+        while (!_paused && buf->ReadableSize() > 0) {
+            switch (_chunk_state) {
+            case kChunkSize: {
+                size_t len = FindLine(buf);
+                if (len == 0) return _recv_state != HttpRecvState::kRECV_HTTP_ERROR;
+                const char* p = buf->ReadPos();
+                const char* end = p + len;
+                auto [ptr, ec] = std::from_chars(p, end, _chunk_left, 16);
+                if (ec != std::errc() || ptr == p || (*ptr != ';' && *ptr != '\r' && *ptr != '\n')) {
+                    SetError(400); // Bad Request
+                    return false;
                 }
-                else {
-                    _recv_state = HttpRecvState::kRECV_HTTP_ERROR;
-                    _resp_state = 400; // Bad Request
+                buf->MoveReadIdx(len);
+                _chunk_state = _chunk_left == 0 ? kChunkTrailer : kChunkData;
+                break;
+            }
+            case kChunkData: {
+                size_t len = std::min(_chunk_left, buf->ReadableSize());
+                if (!DeliverBody(buf->ReadPos(), len)) return false;
+                buf->MoveReadIdx(len);
+                _chunk_left -= len;
+                if (_chunk_left == 0) _chunk_state = kChunkDataEnd;
+                break;
+            }
+            case kChunkDataEnd: {
+                size_t len = FindLine(buf);
+                if (len == 0) return _recv_state != HttpRecvState::kRECV_HTTP_ERROR;
+                if (len > 2 || (len == 2 && buf->ReadPos()[0] != '\r')) {
+                    SetError(400); // Bad Request
                     return false;
                 }
+                buf->MoveReadIdx(len);
+                _chunk_state = kChunkSize;
+                break;
+            }
+            case kChunkTrailer: {
+                // 忽略尾部字段, 遇到空行时正文结束
+                size_t len = FindLine(buf);
+                if (len == 0) return _recv_state != HttpRecvState::kRECV_HTTP_ERROR;
+                bool empty = len == 1 || (len == 2 && buf->ReadPos()[0] == '\r');
+                buf->MoveReadIdx(len);
+                if (empty) {
+                    _recv_state = HttpRecvState::kRECV_HTTP_DONE;
+                    return true;
+                }
+                break;
+            }
             }
-            return true;
-        }
-        else {
-            _recv_state = HttpRecvState::kRECV_HTTP_ERROR;
-            _resp_state = 400; // Bad Request
-            return false;
         }
+        return true;
     }
-    bool parseHttpHead(const std::string& head) {
-        // key: value\r\n
-        auto pos = head.find(": ");
-        if (pos != std::string::npos) {
-            std::string k = head.substr(0, pos);
-            std::string v = head.substr(pos + 2);
-            if (v.back() == '\n') v.pop_back();
-            if (v.back() == '\r') v.pop_back();
-            _request.SetHeader(k, v);
-            return true;
+    // GET /login?username=123&password=456 HTTP/1.1
+    // 方法转换成大写, 路径和参数原地URL解码
+    bool ParseRequestLine(char* line, size_t len) {
+        static constexpr std::string_view kMethods[] = { "GET", "POST", "PUT", "DELETE", "HEAD", "OPTIONS", "TRACE", "CONNECT" };
+        char* end = line + len;
+        auto sp1 = static_cast<char*>(memchr(line, ' ', len));
+        auto sp2 = static_cast<char*>(memrchr(line, ' ', len));
+        if (sp1 == nullptr || sp2 == sp1) return false;
+        for (char* c = line; c < sp1; c++) *c = static_cast<char>(toupper(static_cast<unsigned char>(*c)));
+        std::string_view method(line, sp1 - line);
+        if (std::find(std::begin(kMethods), std::end(kMethods), method) == std::end(kMethods)) return false;
+        std::string_view version(sp2 + 1, end - sp2 - 1);
+        if (!Util::EqualsIgnoreCase(version, "HTTP/1.1") && !Util::EqualsIgnoreCase(version, "HTTP/1.0")) return false;
+        char* target = sp1 + 1;
+        auto query = static_cast<char*>(memchr(target, '?', sp2 - target));
+        size_t path_len = (query ? query : sp2) - target;
+        if (path_len == 0 || !Util::UrlDecodeInPlace(target, path_len, false)) return false;
+        _request._method = method;
+        _request._path = std::string_view(target, path_len);
+        _request._version = version;
+        if (query == nullptr) return true;
+        // key=value&key=value
+        char* p = query + 1;
+        while (p < sp2) {
+            auto amp = static_cast<char*>(memchr(p, '&', sp2 - p));
+            char* next = amp ? amp : sp2;
+            if (next != p) {
+                auto eq = static_cast<char*>(memchr(p, '=', next - p));
+                if (eq == nullptr) return false;
+                size_t klen = eq - p;
+                size_t vlen = next - eq - 1;
+                if (!Util::UrlDecodeInPlace(p, klen, true) || !Util::UrlDecodeInPlace(eq + 1, vlen, true)) return false;
+                _request._params.emplace_back(std::string_view(p, klen), std::string_view(eq + 1, vlen));
+            }
+            p = next + 1;
         }
-        else {
-            _recv_state = HttpRecvState::kRECV_HTTP_ERROR;
-            _resp_state = 400; // Bad Request
-            return false;
+        return true;
+    }
+    // key: value
+    bool ParseHeaderLine(const char* line, size_t len) {
+        auto colon = static_cast<const char*>(memchr(line, ':', len));
+        if (colon == nullptr || colon == line) return false;
+        for (const char* c = line; c < colon; c++) {
+            if (*c == ' ' || *c == '\t') return false;
         }
+        const char* v = colon + 1;
+        const char* end = line + len;
+        while (v < end && (*v == ' ' || *v == '\t')) v++;
+        while (end > v && (end[-1] == ' ' || end[-1] == '\t')) end--;
+        _request._headers.emplace_back(std::string_view(line, colon - line), std::string_view(v, end - v));
+        return true;
     }
 private:
     int _resp_state;
     HttpRecvState _recv_state;
+    size_t _line_start = 0; // 当前行相对读位置的偏移
+    size_t _scan = 0; // 已经扫描过的数据长度
+    bool _busy = false; // 是否正在异步处理
+    bool _paused = false; // 是否暂停接收正文
+    bool _body_started = false; // 是否已经开始接收正文
+    bool _chunked = false; // 正文是否使用分块编码
+    enum { kChunkSize, kChunkData, kChunkDataEnd, kChunkTrailer } _chunk_state = kChunkSize;
+    size_t _chunk_left = 0; // 当前分块剩余的长度
+    size_t _body_received = 0; // 已经接收的正文长度
+    uint64_t _start_ns = 0;
+    uint64_t _parse_ns = 0;
+    BodyReader _reader;
     HttpRequest _request;
+    std::unique_ptr<TimerNode> _drain_timer; // 停止时的空闲宽限期, 只在排空时创建
 };
 
+void BodyFlow::Pause() const {
+    auto conn = _conn.lock();
+    if (!conn) return;
+    conn->GetLoop()->RunInLoop([conn] {
+        auto context = conn->GetTypedContext<HttpContext>();
+        if (context == nullptr || context->IsPaused()) return;
+        context->SetPaused(true);
+        // 暂停期间对端半关闭也要等正文处理完再关闭连接
+        conn->Hold();
+        conn->PauseRead();
+        });
+}
+void BodyFlow::Resume() const {
+    auto conn = _conn.lock();
+    if (!conn) return;
+    conn->GetLoop()->RunInLoop([conn] {
+        auto context = conn->GetTypedContext<HttpContext>();
+        if (context == nullptr || !context->IsPaused()) return;
+        context->SetPaused(false);
+        conn->ResumeRead();
+        conn->ReprocessInput();
+        conn->Release();
+        });
+}
+
+// 把请求正文流式写入文件: 先写入同目录下的临时文件, 接收完整后再重命名, 中途失败或者断开时删除临时文件
+inline void StreamBodyToFile(const std::string& path, BodyReader& reader) {
+    struct Upload {
+        std::string _path;
+        std::string _tmp;
+        int _fd = -1;
+        off_t _offset = 0;
+        ~Upload() {
+            if (_fd == -1) return;
+            close(_fd);
+            unlink(_tmp.c_str());
+        }
+    };
+    auto upload = std::make_shared<Upload>();
+    upload->_path = path;
+    upload->_tmp = path + ".upload-" + std::to_string(getpid()) + "-" + std::to_string(reinterpret_cast<uintptr_t>(upload.get()));
+    reader._on_data = [upload](const char* data, size_t len) {
+        if (upload->_fd == -1) {
+            upload->_fd = open(upload->_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (upload->_fd == -1) {
+                lg(Error, "open file failed: %s, %s", upload->_tmp.c_str(), strerror(errno));
+                return false;
+            }
+        }
+        while (len > 0) {
+            ssize_t n = pwrite(upload->_fd, data, len, upload->_offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                lg(Error, "write file failed: %s, %s", upload->_tmp.c_str(), strerror(errno));
+                return false;
+            }
+            data += n;
+            len -= n;
+            upload->_offset += n;
+        }
+        return true;
+        };
+    reader._on_complete = [upload](const HttpRequest&, HttpResponse& resp) {
+        // 空正文时还没有创建临时文件
+        if (upload->_fd == -1) upload->_fd = open(upload->_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (upload->_fd == -1 || rename(upload->_tmp.c_str(), upload->_path.c_str()) == -1) {
+            lg(Error, "save file failed: %s, %s", upload->_path.c_str(), strerror(errno));
+            resp._status_code = 500; // Internal Server Error
+            return;
+        }
+        close(upload->_fd);
+        upload->_fd = -1;
+        };
+}
+
+// 小于该大小的动态正文不压缩
+const size_t kCompressMinSize = 1024;
+// 处理函数线程池的默认线程数和排队上限
+const int kHandlerThreads = 4;
+const size_t kHandlerMaxPending = 1024;
+// 流式响应的默认高低水位
+const size_t kStreamHighWater = 1024 * 1024;
+const size_t kStreamLowWater = 256 * 1024;
+// 停止时空闲的长连接再等待该时长(毫秒), 期间到达的请求仍然处理(响应后关闭), 避免关闭时重置对端已经发出的请求
+const uint64_t kDrainIdleGraceMs = 1000;
+
 class HttpServer {
 public:
     using Handler = std::function<void(const HttpRequest&, HttpResponse&)>;
-    using Handlers = std::vector<std::pair<std::regex, Handler>>;
-    HttpServer(int port, int _thread_num, int timeout = 30) : _server(port, _thread_num) {
+    // 异步处理函数, 在事件循环线程中调用, 不能阻塞; 稍后(可以在其他线程中)通过responder发送响应
+    // 响应发送之前暂停处理同一连接上后续的流水线请求, 保证响应的顺序
+    using AsyncHandler = std::function<void(const HttpRequest&, HttpResponder)>;
+    // 协程处理函数, 挂起期间(如co_await EventLoop::Current()->Sleep(ms))不阻塞事件循环, 返回后发送resp
+    using CoHandler = std::function<CoTask<void>(const HttpRequest&, HttpResponse&)>;
+    // 同一个方法的同一个模式只能有一个处理函数(同步或者异步), 重复注册时抛出异常
+    struct RouteHandler {
+        Handler _handler;
+        AsyncHandler _async;
+    };
+    using Handlers = Router<RouteHandler>;
+    // 流式处理函数, 请求头解析完成后调用, 设置reader接收正文;
+    // 返回false时拒绝请求, 立即发送resp(如403/413)并关闭连接, 不再接收正文
+    using StreamHandler = std::function<bool(const HttpRequest&, HttpResponse&, BodyReader&)>;
+    using StreamHandlers = Router<StreamHandler>;
+    using WebSocketHandlers = Ws::Handlers;
+    HttpServer(int port, int _thread_num, int timeout = 30, PollerBackend backend = PollerBackend::kEpoll)
+        : _server(port, _thread_num, backend) {
         _server.SetConnectedCallback([this](auto && PH1) { OnConnected(std::forward<decltype(PH1)>(PH1)); });
         _server.SetMessageCallback([this](auto && PH1, auto && PH2) { OnMessage(std::forward<decltype(PH1)>(PH1), std::forward<decltype(PH2)>(PH2)); });
+        _server.SetDrainCallback([](const PtrConnection& conn) { DrainConnection(conn); });
         _server.EnableInactivityRelease(timeout);
     }
     // 设置静态资源根目录
@@ -542,24 +1198,238 @@ public:
     }
     // 添加GET处理函数
     void Get(const std::string& pattern, const Handler& handler) {
-        _get_handlers.emplace_back(std::regex(pattern), handler);
+        AddRoute(_get_handlers, pattern, RouteHandler{ handler, nullptr });
     }
     // 添加POST处理函数
     void Post(const std::string& pattern, const Handler& handler) {
-        _post_handlers.emplace_back(std::regex(pattern), handler);
+        AddRoute(_post_handlers, pattern, RouteHandler{ handler, nullptr });
     }
     // 添加PUT处理函数
     void Put(const std::string& pattern, const Handler& handler) {
-        _put_handlers.emplace_back(std::regex(pattern), handler);
+        AddRoute(_put_handlers, pattern, RouteHandler{ handler, nullptr });
     }
     // 添加DELETE处理函数
     void Delete(const std::string& pattern, const Handler& handler) {
-        _delete_handlers.emplace_back(std::regex(pattern), handler);
+        AddRoute(_delete_handlers, pattern, RouteHandler{ handler, nullptr });
+    }
+    // 添加异步处理函数, 可阻塞的处理函数通过Blocking包装后注册
+    void GetAsync(const std::string& pattern, const AsyncHandler& handler) {
+        AddRoute(_get_handlers, pattern, RouteHandler{ nullptr, handler });
+    }
+    void PostAsync(const std::string& pattern, const AsyncHandler& handler) {
+        AddRoute(_post_handlers, pattern, RouteHandler{ nullptr, handler });
+    }
+    void PutAsync(const std::string& pattern, const AsyncHandler& handler) {
+        AddRoute(_put_handlers, pattern, RouteHandler{ nullptr, handler });
+    }
+    void DeleteAsync(const std::string& pattern, const AsyncHandler& handler) {
+        AddRoute(_delete_handlers, pattern, RouteHandler{ nullptr, handler });
+    }
+    // 开启处理函数线程池, 执行Blocking包装的处理函数(磁盘、数据库等阻塞调用)
+    // 等待执行的请求达到max_pending时直接回复503(0表示不限制)
+    void EnableHandlerPool(int threads = kHandlerThreads, size_t max_pending = kHandlerMaxPending) {
+        if (!_handler_pool) _handler_pool = std::make_unique<WorkerPool>(threads);
+        _handler_max_pending = max_pending;
+    }
+    // 把可能阻塞的处理函数包装成异步处理函数, 在处理函数线程池中执行(没有开启时按默认参数开启)
+    AsyncHandler Blocking(Handler handler) {
+        if (!_handler_pool) EnableHandlerPool();
+        auto shared = std::make_shared<Handler>(std::move(handler));
+        return [this, shared](const HttpRequest&, HttpResponder responder) {
+            bool queued = _handler_pool->TrySubmit([shared, responder] {
+                HttpResponse resp;
+                (*shared)(responder.Request(), resp);
+                responder.Send(std::move(resp));
+                }, _handler_max_pending);
+            if (!queued) {
+                // 过载时尽快拒绝, 让客户端稍后重试
+                HttpResponse resp(503); // Service Unavailable
+                resp.SetHeader("Retry-After", "1");
+                ErrorHandler(resp);
+                responder.Send(std::move(resp));
+            }
+            };
+    }
+    // 把协程处理函数包装成异步处理函数, 协程在连接所属的事件循环线程中运行
+    static AsyncHandler Coroutine(CoHandler handler) {
+        auto shared = std::make_shared<CoHandler>(std::move(handler));
+        return [shared](const HttpRequest&, HttpResponder responder) {
+            CoSpawn(RunCoroutine(shared, std::move(responder)));
+            };
+    }
+    // 添加流式接收正文的POST处理函数, 优先于Post注册的处理函数
+    void PostStream(const std::string& pattern, const StreamHandler& handler) {
+        AddRoute(_post_streams, pattern, handler);
+    }
+    // 添加流式接收正文的PUT处理函数, 优先于Put注册的处理函数
+    void PutStream(const std::string& pattern, const StreamHandler& handler) {
+        AddRoute(_put_streams, pattern, handler);
+    }
+    // 添加WebSocket处理函数, 匹配的GET请求携带Upgrade: websocket时完成握手并切换协议, 优先于静态文件和Get注册的处理函数
+    void WebSocket(const std::string& pattern, const WebSocketHandlers& handlers) {
+        AddRoute(_ws_handlers, pattern, std::make_shared<const WebSocketHandlers>(handlers));
+    }
+    // 连接使用边缘触发模式
+    void EnableEdgeTrigger() { _server.EnableEdgeTrigger(); }
+    // 每个从属事件循环各自监听端口(SO_REUSEPORT)
+    void EnableReusePort() { _server.EnableReusePort(); }
+    // 把事件循环线程依次绑定到cpus中的CPU上, numa_local为true时优先使用本地节点的内存
+    void SetCpuAffinity(const std::vector<int>& cpus, bool numa_local = true) { _server.SetCpuAffinity(cpus, numa_local); }
+    // 事件循环阻塞等待前先忙轮询us微秒, 降低唤醒延迟, 0表示关闭
+    void SetBusyPoll(uint64_t us) { _server.SetBusyPoll(us); }
+    // 新连接在事件循环之间的分配策略(默认轮流分配)
+    void SetDispatchPolicy(DispatchPolicy policy) { _server.SetDispatchPolicy(policy); }
+    // 设置静态文件缓存的总大小和单个文件的大小上限, 总大小为0时关闭缓存
+    void SetFileCache(size_t capacity, size_t max_file_size = FileCache::kDefaultMaxFileSize) {
+        _cache.SetCapacity(capacity, max_file_size);
+    }
+    // 开启响应压缩(gzip/brotli), 压缩在threads个工作线程中进行, 小于min_size的动态正文不压缩
+    // 静态文件优先使用同目录下预压缩的.br/.gz文件, 压缩后的版本和原文件一起缓存
+    void EnableCompression(int threads = 2, size_t min_size = kCompressMinSize) {
+        if (!_workers) _workers = std::make_unique<WorkerPool>(threads);
+        _compress_min_size = min_size;
+    }
+    // 限制每个连接未发送的输出, 超过limit时暂停读取和处理该连接的请求, 回落到一半以下时恢复, 0表示不限制
+    void SetOutputLimit(size_t limit) { _server.SetOutputLimit(limit); }
+    // 设置流式响应的高低水位: 连接的输出队列超过high时暂停生产者, 回落到low以下时恢复
+    void SetStreamWaterMarks(size_t high, size_t low) {
+        _stream_high_water = high;
+        _stream_low_water = std::min(low, high);
+    }
+    // 在path上导出Prometheus格式的统计数据(各个事件循环的计数器和耗时直方图)
+    void EnableMetrics(const std::string& path = "/metrics") {
+        Get(path, [this](const HttpRequest&, HttpResponse& resp) {
+            resp.SetContent(MetricsText(), "text/plain; version=0.0.4; charset=utf-8");
+            });
+    }
+    // 开始处理请求, Stop之后所有连接关闭时返回
+    void Start() {
+        _cache.Attach(_server.GetBaseLoop());
+        _server.Start();
+    }
+    // 优雅退出: 不再接收新连接, 空闲的长连接立即关闭, 处理中的请求发送完响应后关闭(响应带Connection: close),
+    // WebSocket连接发送关闭帧(1001), 超过timeout_ms后强制关闭剩余的连接; 可以在任意线程中调用
+    void Stop(uint64_t timeout_ms = TcpServer::kDefaultDrainTimeoutMs) { _server.Stop(timeout_ms); }
+    // 平滑重启: 新进程启动时通过path从旧进程接收监听套接字, 旧进程随后以timeout_ms为期限排空退出, 见TcpServer::EnableHandoff
+    void EnableHandoff(const std::string& path, uint64_t timeout_ms = TcpServer::kDefaultDrainTimeoutMs) {
+        _server.EnableHandoff(path, timeout_ms);
     }
-    void Start() { _server.Start(); }
 private:
+    // 同一个模式已经注册过时说明两个处理函数互相冲突(如Get和GetAsync), 不能让后注册的悄悄失效
+    template <class R, class H>
+    static void AddRoute(R& router, const std::string& pattern, H&& handler) {
+        if (!router.Add(pattern, std::forward<H>(handler))) {
+            lg(Fatal, "duplicate route: %s", pattern.c_str());
+            throw std::runtime_error("duplicate route: " + pattern);
+        }
+    }
+    // 记录响应的状态码和请求的总耗时, 在连接所属的事件循环线程中调用
+    static void RecordResponse(const PtrConnection& conn, int status) {
+        auto& metrics = conn->GetLoop()->GetMetrics();
+        int cls = status / 100;
+        metrics._responses[cls >= 1 && cls <= 5 ? cls : 0].Add();
+        auto context = conn->GetTypedContext<HttpContext>();
+        if (context != nullptr && context->GetStartNs() != 0) {
+            metrics._request_ns.Record(MonotonicNs() - context->GetStartNs());
+            context->SetStartNs(0);
+        }
+    }
+    // 读取所有事件循环的统计数据, 生成Prometheus文本格式, 可以在任意线程中调用
+    std::string MetricsText() const {
+        struct CounterDef {
+            const char* _name;
+            const char* _type;
+            const char* _help;
+            Counter LoopMetrics::* _counter;
+        };
+        static const CounterDef kCounters[] = {
+            { "reactor_read_bytes_total", "counter", "Bytes read from sockets.", &LoopMetrics::_bytes_read },
+            { "reactor_written_bytes_total", "counter", "Bytes written to sockets.", &LoopMetrics::_bytes_written },
+            { "reactor_connections_opened_total", "counter", "Connections accepted.", &LoopMetrics::_connections_opened },
+            { "reactor_connections_closed_total", "counter", "Connections closed.", &LoopMetrics::_connections_closed },
+        };
+        // 计数类的直方图导出分位数, 耗时类的直方图导出按2的幂划分的桶, 另外导出所有事件循环合并后的分位数
+        struct HistogramDef {
+            const char* _name;
+            const char* _help;
+            Histogram LoopMetrics::* _histogram;
+            bool _latency;
+        };
+        static const HistogramDef kHistograms[] = {
+            { "reactor_poll_ready_events", "Ready events returned by each epoll_wait.", &LoopMetrics::_poll_events, false },
+            { "reactor_task_batch_size", "Tasks run per round of pending tasks.", &LoopMetrics::_task_batch, false },
+            { "reactor_handle_event_seconds", "Time spent handling one ready channel.", &LoopMetrics::_handle_ns, true },
+            { "reactor_socket_write_seconds", "Time spent in one writev or sendfile call.", &LoopMetrics::_write_ns, true },
+            { "http_parse_seconds", "Time spent parsing request heads.", &LoopMetrics::_parse_ns, true },
+            { "http_handler_seconds", "Time spent in request handlers.", &LoopMetrics::_handler_ns, true },
+            { "http_request_seconds", "Time from the first request byte to the response being queued.", &LoopMetrics::_request_ns, true },
+        };
+        // 导出的桶从约1微秒到约17秒, 每个桶是上一个的4倍
+        static constexpr uint64_t kMinBoundNs = 1ULL << 10;
+        static constexpr uint64_t kMaxBoundNs = 1ULL << 34;
+        static constexpr int kBoundShift = 2;
+        static constexpr double kSeconds = 1e-9;
+
+        auto loops = _server.GetLoops();
+        auto label = [](size_t i) { return "loop=\"" + std::to_string(i) + "\""; };
+        PrometheusWriter writer;
+        for (auto& def : kCounters) {
+            writer.Family(def._name, def._type, def._help);
+            for (size_t i = 0; i < loops.size(); i++) {
+                writer.Sample(def._name, label(i), static_cast<double>((loops[i]->GetMetrics().*def._counter).Value()));
+            }
+        }
+        writer.Family("reactor_connections", "gauge", "Open connections.");
+        for (size_t i = 0; i < loops.size(); i++) {
+            auto& metrics = loops[i]->GetMetrics();
+            // 两个计数器不是同时读取的, 关闭数可能暂时超过打开数
+            uint64_t opened = metrics._connections_opened.Value(), closed = metrics._connections_closed.Value();
+            writer.Sample("reactor_connections", label(i), static_cast<double>(opened > closed ? opened - closed : 0));
+        }
+        writer.Family("reactor_pending_bytes", "gauge", "Bytes buffered in connection input and output queues.");
+        for (size_t i = 0; i < loops.size(); i++) {
+            writer.Sample("reactor_pending_bytes", label(i), static_cast<double>(loops[i]->GetLoad().PendingBytes()));
+        }
+        if (_handler_pool) {
+            writer.Family("http_handler_pool_pending", "gauge", "Blocking handler requests waiting for a worker thread.");
+            writer.Sample("http_handler_pool_pending", "", static_cast<double>(_handler_pool->Pending()));
+            writer.Family("http_handler_pool_rejected_total", "counter", "Blocking handler requests rejected with 503 because the queue was full.");
+            writer.Sample("http_handler_pool_rejected_total", "", static_cast<double>(_handler_pool->Rejected()));
+        }
+        writer.Family("http_responses_total", "counter", "Responses queued, by status class.");
+        static const char* kClasses[] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+        for (size_t i = 0; i < loops.size(); i++) {
+            for (int cls = 0; cls < 6; cls++) {
+                writer.Sample("http_responses_total", label(i) + ",code=\"" + kClasses[cls] + "\"",
+                    static_cast<double>(loops[i]->GetMetrics()._responses[cls].Value()));
+            }
+        }
+        for (auto& def : kHistograms) {
+            Histogram::Snapshot merged;
+            std::vector<Histogram::Snapshot> snapshots(loops.size());
+            for (size_t i = 0; i < loops.size(); i++) {
+                (loops[i]->GetMetrics().*def._histogram).AddTo(snapshots[i]);
+                merged.Merge(snapshots[i]);
+            }
+            if (!def._latency) {
+                writer.Family(def._name, "summary", def._help);
+                for (size_t i = 0; i < loops.size(); i++) writer.Quantiles(def._name, label(i), snapshots[i], 1);
+                continue;
+            }
+            writer.Family(def._name, "histogram", def._help);
+            for (size_t i = 0; i < loops.size(); i++) {
+                writer.Buckets(def._name, label(i), snapshots[i], kMinBoundNs, kMaxBoundNs, kBoundShift, kSeconds);
+            }
+            std::string quantiles = std::string(def._name) + "_quantiles";
+            writer.Family(quantiles.c_str(), "summary", def._help);
+            writer.Quantiles(quantiles.c_str(), "", merged, kSeconds);
+        }
+        return std::move(writer.Text());
+    }
     void WriteResponse(const PtrConnection& conn, const HttpRequest& req, HttpResponse& resp) {
-        if (req.IsKeepAlive()) {
+        RecordResponse(conn, resp._status_code);
+        // 处理函数可以通过Connection: close要求关闭连接, 停止期间不再保持长连接
+        if (req.IsKeepAlive() && resp.GetHeader("Connection") != "close" && !_server.IsStopping()) {
             resp.SetHeader("Connection", "keep-alive");
         }
         else {
@@ -574,41 +1444,336 @@ private:
         if (resp._redirect) {
             resp.SetHeader("Location", resp._redirect_url);
         }
-        std::string response = req._version + " " + std::to_string(resp._status_code) + " " + Util::StatusCodeDescription(resp._status_code) + "\r\n";
+        std::string head;
+        head.reserve(256);
+        head += req._version;
+        head += ' ';
+        head += std::to_string(resp._status_code);
+        head += ' ';
+        head += Util::StatusCodeDescription(resp._status_code);
+        head += "\r\n";
         for (auto& [key, value] : resp._headers) {
-            response += key;
-            response += ": ";
-            response += value;
-            response += "\r\n";
-        }
-        response += "\r\n";
-        response += resp._body;
-        conn->Send(response.c_str(), response.size());
-    }
-    bool IsFileRequest(const HttpRequest& req) {
-        if (_root.empty()) return false;
-        if (req._method != "GET" && req._method != "HEAD") return false;
-        if (!Util::ResourcePathValid(req._path)) return false;
-        // 如果请求的末尾是一个/, 则默认请求index.html
-        std::string path = _root + req._path;
-        if (req._path.back() == '/') {
-            path += "/index.html";
+            head += key;
+            head += ": ";
+            head += value;
+            head += "\r\n";
+        }
+        if (resp._cached) head += resp._cached->_headers;
+        head += "\r\n";
+        // 头部与正文作为独立切片挂到输出链上, 由writev一次发出, 不再拼接
+        OutputChain chain;
+        chain.Append(std::move(head));
+        if (req._method != "HEAD") {
+            if (resp._cached) chain.Append(resp._cached->_body);
+            else if (resp._file) chain.AppendFile(resp._file, resp._file_offset, resp._file_length);
+            else if (!resp._chain.Empty()) chain.Append(std::move(resp._chain));
+            else if (resp._shared_body) chain.Append(resp._shared_body);
+            else chain.Append(std::move(resp._body));
         }
+        conn->Send(std::move(chain));
+    }
+    bool IsFileRequest(const HttpRequest& req, const std::string& path) {
+        if (!Util::ResourcePathValid(std::string(req._path))) return false;
         if (!Util::IsRegularFile(path)) return false;
         return true;
     }
-    bool FileHandler(HttpRequest& req, HttpResponse& resp) {
-        req._path = _root + req._path + (req._path.back() == '/' ? "index.html" : "");
-        if (Util::ReadFile(req._path, resp._body)){
-            auto mime = Util::GetMimeType(req._path);
-            resp.SetHeader("Content-Type", mime);
-            resp.SetHeader("Content-Length", std::to_string(resp._body.size()));
-            return true;
+    // 请求对应的文件路径, 如果请求的末尾是一个/, 则默认请求index.html
+    std::string FilePath(const HttpRequest& req) const {
+        std::string path = _root;
+        path += req._path;
+        if (req._path.back() == '/') path += "index.html";
+        return path;
+    }
+    // 读取整个文件并生成缓存项, encoding不为空时表示文件内容是该编码的预压缩版本
+    static std::shared_ptr<CachedFile> LoadFile(const std::string& key, const std::string& path, const FileHandle& file,
+        const std::string& mime, const std::string& encoding = "") {
+        std::string body(file.GetSize(), '\0');
+        size_t done = 0;
+        while (done < body.size()) {
+            ssize_t n = pread(file.GetFd(), &body[done], body.size() - done, static_cast<off_t>(done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                lg(Error, "read file failed: %s", path.c_str());
+                return nullptr;
+            }
+            done += n;
+        }
+        auto cached = std::make_shared<CachedFile>();
+        cached->_key = key;
+        cached->_path = path;
+        cached->_file_size = file.GetSize();
+        cached->_mtime = file.GetMtime();
+        cached->_mime = mime;
+        SetCachedBody(*cached, std::move(body), encoding);
+        return cached;
+    }
+    // 设置缓存项的正文并生成头部
+    static void SetCachedBody(CachedFile& cached, std::string&& body, const std::string& encoding) {
+        cached._size = body.size();
+        cached._body = std::make_shared<const std::string>(std::move(body));
+        cached._encoding = encoding;
+        cached._etag = Util::MakeETag(cached._mtime, cached._size);
+        cached._last_modified = Util::HttpDate(cached._mtime.tv_sec);
+        cached._headers = "Content-Type: " + cached._mime + "\r\nContent-Length: " + std::to_string(cached._size)
+            + "\r\nETag: " + cached._etag + "\r\nLast-Modified: " + cached._last_modified
+            + "\r\nAccept-Ranges: bytes\r\n";
+        if (!encoding.empty()) cached._headers += "Content-Encoding: " + encoding + "\r\n";
+        if (Compress::Compressible(cached._mime)) cached._headers += "Vary: Accept-Encoding\r\n";
+    }
+    // 只有正文是编码后的内容(200/206)或者对应它的304时才加Content-Encoding, 416等错误页面是未压缩的HTML
+    static void SetEncodingHeaders(HttpResponse& resp, const std::string& mime, const std::string& encoding) {
+        int code = resp._status_code;
+        if (!encoding.empty() && (code == 200 || code == 206 || code == 304)) resp.SetHeader("Content-Encoding", encoding);
+        if (Compress::Compressible(mime)) resp.SetHeader("Vary", "Accept-Encoding");
+    }
+    // 客户端接受的编码, 没有开启压缩时为0
+    int AcceptedEncodings(const HttpRequest& req) const {
+        if (!_workers) return 0;
+        return Compress::Accepted(req.HeaderView("Accept-Encoding"));
+    }
+    // 静态文件请求, 文件不存在时返回false
+    bool StaticHandler(const HttpRequest& req, const std::string& path, HttpResponse& resp) {
+        int accepted = AcceptedEncodings(req);
+        int missing = 0;
+        // 优先使用缓存中的压缩版本
+        for (int encoding : { Compress::kBrotli, Compress::kGzip }) {
+            if (!(accepted & (1 << encoding))) continue;
+            auto variant = _cache.Get(FileCache::VariantKey(path, Compress::Name(encoding)));
+            if (variant && variant->_body) {
+                CachedFileHandler(req, variant, resp);
+                return true;
+            }
+            if (!variant) missing |= 1 << encoding;
+        }
+        // 缓存中只有通过了路径检查的文件, 命中时不需要再检查和stat
+        auto cached = _cache.Get(path);
+        if (!cached) {
+            if (!IsFileRequest(req, path)) return false;
+            if (!FileHandler(req, path, accepted, resp)) ErrorHandler(resp);
+            cached = resp._cached;
         }
         else {
+            CachedFileHandler(req, cached, resp);
+        }
+        // 在后台准备压缩版本, 这一次先返回原始内容
+        if (cached && missing && Compress::Compressible(cached->_mime)) {
+            for (int encoding : { Compress::kBrotli, Compress::kGzip }) {
+                if (missing & (1 << encoding)) PrepareVariant(cached, encoding);
+            }
+        }
+        return true;
+    }
+    // 在工作线程中生成压缩版本并放入缓存: 优先使用预压缩的.br/.gz文件, 否则现场压缩
+    void PrepareVariant(const std::shared_ptr<const CachedFile>& identity, int encoding) {
+        std::string key = FileCache::VariantKey(identity->_key, Compress::Name(encoding));
+        if (!_cache.MarkPending(key)) return;
+        _workers->Submit([this, identity, encoding, key] {
+            std::string name = Compress::Name(encoding);
+            std::string sibling = identity->_path + Compress::Suffix(encoding);
+            std::shared_ptr<CachedFile> variant;
+            if (Util::IsRegularFile(sibling)) {
+                auto file = FileHandle::Open(sibling);
+                if (file && _cache.Cacheable(file->GetSize())) variant = LoadFile(key, sibling, *file, identity->_mime, name);
+            }
+            if (!variant) {
+                variant = std::make_shared<CachedFile>();
+                variant->_key = key;
+                variant->_path = identity->_path;
+                variant->_file_size = identity->_file_size;
+                variant->_mtime = identity->_mtime;
+                variant->_mime = identity->_mime;
+                std::string out;
+                // 压缩失败或者没有变小时缓存一个空的版本, 之后直接使用原始内容
+                if (Compress::Encode(encoding, *identity->_body, out, StaticLevel(encoding)) && out.size() < identity->_size) {
+                    SetCachedBody(*variant, std::move(out), name);
+                }
+            }
+            _cache.Put(variant);
+            });
+    }
+    bool FileHandler(const HttpRequest& req, const std::string& path, int accepted, HttpResponse& resp) {
+        auto file = FileHandle::Open(path);
+        if (!file) {
             resp._status_code = 404; // Not Found
             return false;
         }
+        std::string mime = Util::GetMimeType(path);
+        // 小文件读入缓存, 之后的请求直接发送缓存的内容
+        if (_cache.Cacheable(file->GetSize())) {
+            if (auto cached = LoadFile(path, path, *file, mime)) {
+                _cache.Put(cached);
+                CachedFileHandler(req, cached, resp);
+                return true;
+            }
+        }
+        // 大文件直接使用存在的预压缩文件
+        std::string encoding;
+        if (Compress::Compressible(mime)) {
+            for (int enc : { Compress::kBrotli, Compress::kGzip }) {
+                if (!(accepted & (1 << enc))) continue;
+                std::string sibling = path + Compress::Suffix(enc);
+                if (!Util::IsRegularFile(sibling)) continue;
+                if (auto compressed = FileHandle::Open(sibling)) {
+                    file = compressed;
+                    encoding = Compress::Name(enc);
+                    break;
+                }
+            }
+        }
+        std::string etag = Util::MakeETag(file->GetMtime(), file->GetSize());
+        std::string last_modified = Util::HttpDate(file->GetMtime().tv_sec);
+        FileMeta meta{ mime, etag, last_modified, file->GetMtime().tv_sec, file->GetSize() };
+        auto append = [&file](OutputChain& chain, size_t offset, size_t len) {
+            chain.AppendFile(file, static_cast<off_t>(offset), len);
+            };
+        bool handled = ConditionalHandler(req, meta, append, resp);
+        SetEncodingHeaders(resp, mime, encoding);
+        if (handled) return true;
+        resp.SetFile(file, mime);
+        resp.SetHeader("ETag", etag);
+        resp.SetHeader("Last-Modified", last_modified);
+        resp.SetHeader("Accept-Ranges", "bytes");
+        return true;
+    }
+    void CachedFileHandler(const HttpRequest& req, const std::shared_ptr<const CachedFile>& cached, HttpResponse& resp) {
+        // 没有条件请求和Range时直接使用缓存中预先生成的头部
+        if (req.HasHeader("If-None-Match") || req.HasHeader("If-Modified-Since") || req.HasHeader("Range")) {
+            FileMeta meta{ cached->_mime, cached->_etag, cached->_last_modified, cached->_mtime.tv_sec, cached->_size };
+            auto append = [&cached](OutputChain& chain, size_t offset, size_t len) {
+                chain.Append(cached->_body, offset, len);
+                };
+            if (ConditionalHandler(req, meta, append, resp)) {
+                SetEncodingHeaders(resp, cached->_mime, cached->_encoding);
+                return;
+            }
+        }
+        resp.SetCached(cached);
+    }
+    // 静态文件的元数据
+    struct FileMeta {
+        const std::string& _mime;
+        const std::string& _etag;
+        const std::string& _last_modified;
+        time_t _mtime;
+        size_t _size;
+    };
+    static constexpr size_t kMaxRanges = 16; // 一个请求最多的区间数, 超过时忽略Range返回整个文件
+    // If-None-Match中是否有与etag匹配的值(弱比较)
+    static bool EtagMatch(std::string_view list, std::string_view etag) {
+        auto weak = [](std::string_view v) { return v.substr(0, 2) == "W/" ? v.substr(2) : v; };
+        etag = weak(etag);
+        while (!list.empty()) {
+            size_t comma = std::min(list.find(','), list.size());
+            auto item = list.substr(0, comma);
+            list.remove_prefix(std::min(comma + 1, list.size()));
+            while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+            while (!item.empty() && item.back() == ' ') item.remove_suffix(1);
+            if (item == "*" || weak(item) == etag) return true;
+        }
+        return false;
+    }
+    // 解析Range头部, 区间为[first, last], 格式错误返回-1, 否则返回可以满足的区间数量
+    static int ParseRange(std::string_view spec, size_t size, std::vector<std::pair<size_t, size_t>>& ranges) {
+        if (!Util::EqualsIgnoreCase(spec.substr(0, 6), "bytes=")) return -1;
+        spec.remove_prefix(6);
+        auto number = [](std::string_view v, size_t& n) {
+            auto [p, ec] = std::from_chars(v.data(), v.data() + v.size(), n);
+            return !v.empty() && ec == std::errc() && p == v.data() + v.size();
+            };
+        size_t count = 0;
+        while (!spec.empty()) {
+            size_t comma = std::min(spec.find(','), spec.size());
+            auto item = spec.substr(0, comma);
+            spec.remove_prefix(std::min(comma + 1, spec.size()));
+            while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+            while (!item.empty() && item.back() == ' ') item.remove_suffix(1);
+            if (item.empty()) continue;
+            if (++count > kMaxRanges) return -1;
+            size_t dash = item.find('-');
+            if (dash == std::string_view::npos) return -1;
+            size_t first, last;
+            if (dash == 0) {
+                // 最后n个字节
+                if (!number(item.substr(1), last)) return -1;
+                if (last == 0 || size == 0) continue;
+                ranges.emplace_back(size - std::min(last, size), size - 1);
+                continue;
+            }
+            if (!number(item.substr(0, dash), first)) return -1;
+            if (dash + 1 == item.size()) last = SIZE_MAX;
+            else if (!number(item.substr(dash + 1), last) || last < first) return -1;
+            if (first >= size) continue;
+            ranges.emplace_back(first, std::min(last, size - 1));
+        }
+        if (count == 0) return -1;
+        return static_cast<int>(ranges.size());
+    }
+    // 处理条件请求(304)和Range请求(206/416), 返回false表示应当返回整个文件
+    template <class Append>
+    bool ConditionalHandler(const HttpRequest& req, const FileMeta& meta, Append&& append, HttpResponse& resp) {
+        auto not_modified = [&] {
+            resp._status_code = 304; // Not Modified
+            resp.SetHeader("ETag", meta._etag);
+            resp.SetHeader("Last-Modified", meta._last_modified);
+            return true;
+            };
+        auto if_none_match = req.HeaderView("If-None-Match");
+        if (!if_none_match.empty()) {
+            if (EtagMatch(if_none_match, meta._etag)) return not_modified();
+        }
+        else if (auto since = req.HeaderView("If-Modified-Since"); !since.empty()) {
+            time_t t;
+            if (Util::ParseHttpDate(since, t) && meta._mtime <= t) return not_modified();
+        }
+        auto range = req.HeaderView("Range");
+        if (range.empty() || req._method != "GET") return false;
+        // If-Range不匹配时返回整个文件
+        if (auto if_range = req.HeaderView("If-Range"); !if_range.empty()) {
+            time_t t;
+            if (if_range.front() == '"' || if_range.substr(0, 2) == "W/") {
+                if (if_range != meta._etag) return false;
+            }
+            else if (!Util::ParseHttpDate(if_range, t) || t != meta._mtime) {
+                return false;
+            }
+        }
+        std::vector<std::pair<size_t, size_t>> ranges;
+        int n = ParseRange(range, meta._size, ranges);
+        if (n < 0) return false;
+        std::string total = "/" + std::to_string(meta._size);
+        if (n == 0) {
+            resp._status_code = 416; // Range Not Satisfiable
+            ErrorHandler(resp);
+            resp.SetHeader("Content-Range", "bytes *" + total);
+            return true;
+        }
+        resp._status_code = 206; // Partial Content
+        resp.SetHeader("ETag", meta._etag);
+        resp.SetHeader("Last-Modified", meta._last_modified);
+        resp.SetHeader("Accept-Ranges", "bytes");
+        OutputChain chain;
+        if (n == 1) {
+            auto [first, last] = ranges[0];
+            append(chain, first, last - first + 1);
+            resp.SetContent(std::move(chain), meta._mime);
+            resp.SetHeader("Content-Range", "bytes " + std::to_string(first) + "-" + std::to_string(last) + total);
+            return true;
+        }
+        // 多个区间使用multipart/byteranges, 每个区间的数据仍然是文件(或缓存)的切片
+        thread_local std::mt19937_64 rng(std::random_device{}());
+        char boundary[32];
+        snprintf(boundary, sizeof(boundary), "%016llx", static_cast<unsigned long long>(rng()));
+        for (auto [first, last] : ranges) {
+            std::string part = "\r\n--";
+            part += boundary;
+            part += "\r\nContent-Type: " + meta._mime;
+            part += "\r\nContent-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + total + "\r\n\r\n";
+            chain.Append(std::move(part));
+            append(chain, first, last - first + 1);
+        }
+        chain.Append("\r\n--" + std::string(boundary) + "--\r\n");
+        resp.SetContent(std::move(chain), std::string("multipart/byteranges; boundary=") + boundary);
+        return true;
     }
     void ErrorHandler(HttpResponse& resp) {
         std::string body = "<html><head><title>Error</title></head><body><h1>";
@@ -616,49 +1781,154 @@ private:
         body += "</h1></body></html>";
         resp.SetContent(body, "text/html");
     }
-    void Dispatch(HttpRequest& req, HttpResponse& resp, Handlers& handlers) {
-        for (auto& [key, func] : handlers) {
-            if (std::regex_match(req._path, req._matches, key)) {
-                func(req, resp);
-                return;
+    // 调用异步处理函数时返回true, 响应由HttpResponder发送
+    bool Dispatch(const PtrConnection& conn, HttpContext* context, HttpResponse& resp, Handlers& handlers) {
+        HttpRequest& req = context->GetRequest();
+        if (auto handler = handlers.Find(req._path, req._captures)) {
+            if (!handler->_async) {
+                handler->_handler(req, resp);
+                return false;
             }
+            DispatchAsync(conn, context, handler->_async);
+            return true;
         }
         resp._status_code = 404; // Not Found
+        return false;
     }
-    void Route(HttpRequest& req, HttpResponse& resp) {
-        if (IsFileRequest(req)) {
-            if (!FileHandler(req, resp)) {
-                ErrorHandler(resp);
-            }
-            return;
+    bool Route(const PtrConnection& conn, HttpContext* context, HttpResponse& resp) {
+        HttpRequest& req = context->GetRequest();
+        if (req.HasHeader("Upgrade")) {
+            if (auto handlers = _ws_handlers.Find(req._path, req._captures)) return UpgradeWebSocket(conn, context, resp, *handlers);
+        }
+        if (!_root.empty() && (req._method == "GET" || req._method == "HEAD")) {
+            if (StaticHandler(req, FilePath(req), resp)) return false;
         }
         if (req._method == "GET" || req._method == "HEAD") {
-            Dispatch(req, resp, _get_handlers);
+            return Dispatch(conn, context, resp, _get_handlers);
         }
         else if (req._method == "POST") {
-            Dispatch(req, resp, _post_handlers);
+            return Dispatch(conn, context, resp, _post_handlers);
         }
         else if (req._method == "PUT") {
-            Dispatch(req, resp, _put_handlers);
+            return Dispatch(conn, context, resp, _put_handlers);
         }
         else if (req._method == "DELETE") {
-            Dispatch(req, resp, _delete_handlers);
+            return Dispatch(conn, context, resp, _delete_handlers);
         }
-        else {
-            resp._status_code = 405; // Method Not Allowed
+        resp._status_code = 405; // Method Not Allowed
+        ErrorHandler(resp);
+        return false;
+    }
+    // 完成WebSocket握手并把连接切换为WebSocket, 握手请求不合法时生成错误响应并返回false
+    bool UpgradeWebSocket(const PtrConnection& conn, HttpContext* context, HttpResponse& resp,
+        const std::shared_ptr<const WebSocketHandlers>& handlers) {
+        HttpRequest& req = context->GetRequest();
+        auto key = req.HeaderView("Sec-WebSocket-Key");
+        if (req._method != "GET" || req._version != "HTTP/1.1" || !Ws::HasToken(req.HeaderView("Upgrade"), "websocket")
+            || !Ws::HasToken(req.HeaderView("Connection"), "upgrade") || key.empty()) {
+            resp._status_code = 400; // Bad Request
             ErrorHandler(resp);
+            return false;
         }
+        if (req.HeaderView("Sec-WebSocket-Version") != "13") {
+            resp._status_code = 426; // Upgrade Required
+            ErrorHandler(resp);
+            resp.SetHeader("Sec-WebSocket-Version", "13");
+            return false;
+        }
+        RecordResponse(conn, 101);
+        std::string head = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+        head += Ws::AcceptKey(key);
+        head += "\r\n\r\n";
+        conn->Send(std::move(head));
+        // 切换上下文后HTTP上下文被回收, 先复制握手请求
+        HttpRequest request = req;
+        Ws::Accept(conn, handlers);
+        if (handlers->_idle_timeout == 0) conn->DisableInactivityRelease();
+        else if (handlers->_idle_timeout > 0) conn->EnableInactivityRelease(handlers->_idle_timeout);
+        if (handlers->_on_open) handlers->_on_open(conn, request);
+        // 握手请求之后已经到达的帧
+        conn->GetLoop()->QueueInLoop([conn] { conn->ReprocessInput(); });
+        return true;
+    }
+    // 调用异步处理函数, 处理函数得到请求的副本(连接关闭时上下文中的请求会被清空)
+    // 响应通过QueueInLoop切换回连接所属的事件循环发送, 发送之前不处理后续的流水线请求
+    void DispatchAsync(const PtrConnection& conn, HttpContext* context, const AsyncHandler& handler) {
+        HttpRequest& req = context->GetRequest();
+        // 正文不被视图引用, 直接移动到副本中, 避免复制大的正文
+        std::string body;
+        body.swap(req._body);
+        auto copy = std::make_shared<HttpRequest>(req);
+        copy->_body.swap(body);
+        HttpResponder responder;
+        responder._state = std::make_shared<HttpResponder::State>();
+        responder._state->_request = std::move(copy);
+        responder._state->_finish = [this, conn](HttpResponse* result) {
+            HttpResponse resp(500); // Internal Server Error
+            if (result != nullptr) resp = std::move(*result);
+            else ErrorHandler(resp);
+            conn->GetLoop()->QueueInLoop([this, conn, resp = std::move(resp)]() mutable {
+                auto context = conn->GetTypedContext<HttpContext>();
+                if (context != nullptr && context->IsBusy()) {
+                    context->SetBusy(false);
+                    if (Respond(conn, context, resp)) conn->ReprocessInput();
+                }
+                conn->Release();
+                });
+            };
+        context->SetBusy(true);
+        conn->Hold();
+        const HttpRequest& request = responder.Request();
+        handler(request, std::move(responder));
+    }
+    // 停止时排空连接: 请求之间空闲的连接在宽限期后仍然空闲时关闭, 其余的在当前请求的响应发出后关闭
+    static void DrainConnection(const PtrConnection& conn) {
+        if (dynamic_cast<Ws::Context*>(conn->GetTypedContext<ConnectionContext>()) != nullptr) {
+            Ws::Close(conn, Ws::kGoingAway);
+            return;
+        }
+        if (!IsIdle(conn)) return;
+        // 定时器属于连接的上下文, 不持有连接: 连接提前关闭时一起销毁, 事件循环退出时也不会残留
+        uint64_t read = conn->BytesRead();
+        conn->GetTypedContext<HttpContext>()->StartDrainTimer(conn->GetLoop(), kDrainIdleGraceMs,
+            [weak = std::weak_ptr<Connection>(conn), read] {
+                auto conn = weak.lock();
+                if (conn && conn->BytesRead() == read && IsIdle(conn)) conn->Shutdown();
+            });
+    }
+    static bool IsIdle(const PtrConnection& conn) {
+        auto context = conn->GetTypedContext<HttpContext>();
+        return conn->IsConnected() && context != nullptr && !context->IsBusy()
+            && context->GetRecvState() == HttpRecvState::kRECV_HTTP_LINE && conn->InputSize() == 0;
     }
     void OnConnected(const PtrConnection& conn) {
-        conn->SetContext(HttpContext());
+        conn->SetTypedContext(ContextPool<HttpContext>::Acquire());
     }
     void OnMessage(const PtrConnection& conn, Buffer* buf) {
         while (buf->ReadableSize() > 0) {
-            auto context = std::any_cast<HttpContext>(conn->GetContext());
+            auto context = conn->GetTypedContext<HttpContext>();
+            // 对端没有及时读取响应时先不处理后续的流水线请求, 输出回落后由连接重新处理
+            if (context->IsBusy() || context->IsPaused() || conn->IsThrottled()) return;
+            auto& metrics = conn->GetLoop()->GetMetrics();
+            bool in_head = context->GetRecvState() == HttpRecvState::kRECV_HTTP_LINE
+                || context->GetRecvState() == HttpRecvState::kRECV_HTTP_HEAD;
+            uint64_t begin = in_head ? MonotonicNs() : 0;
+            if (in_head && context->GetStartNs() == 0) context->SetStartNs(begin);
             context->RecvHttpRequest(buf);
+            if (in_head) context->AddParseNs(MonotonicNs() - begin);
             HttpRequest &req = context->GetRequest();
             HttpResponse resp;
+            if (context->HeadReady()) {
+                metrics._parse_ns.Record(context->GetParseNs());
+                // 请求头完整, 确定正文的接收方式后继续接收正文
+                if (!BeginBody(conn, context, resp)) {
+                    buf->Clear();
+                    return;
+                }
+                context->RecvHttpRequest(buf);
+            }
             if (context->GetRespState() >= 400) {
+                resp._status_code = context->GetRespState();
                 ErrorHandler(resp);
                 WriteResponse(conn, req, resp);
                 context->Clear(); // 清空上下文, 否则会一直返回错误
@@ -670,16 +1940,132 @@ private:
                 // 当前请求还未接收完整, 继续等待
                 return;
             }
-            // 路由查找+处理
-            Route(req, resp);
-            WriteResponse(conn, req, resp);
-            context->Clear();
-            if (!resp.IsKeepAlive()) {
+            // 路由查找+处理, 流式接收的请求由接收者生成响应
+            auto& reader = context->GetReader();
+            if (reader._on_complete || !reader._on_data) {
+                uint64_t handler_begin = MonotonicNs();
+                bool async = false;
+                if (reader._on_complete) reader._on_complete(req, resp);
+                else async = Route(conn, context, resp);
+                metrics._handler_ns.Record(MonotonicNs() - handler_begin);
+                if (async) return;
+            }
+            if (!Respond(conn, context, resp)) return;
+        }
+    }
+    // 发送处理函数生成的响应, 可以继续处理同一连接上后续的请求时返回true
+    bool Respond(const PtrConnection& conn, HttpContext* context, HttpResponse& resp) {
+        if (resp.IsStream()) {
+            StartStream(conn, context, resp);
+            return false;
+        }
+        if (CompressAsync(conn, context, resp)) return false;
+        return FinishRequest(conn, context, resp);
+    }
+    // 查找流式处理函数并设置正文的接收者, 拒绝请求时返回false
+    bool BeginBody(const PtrConnection& conn, HttpContext* context, HttpResponse& resp) {
+        HttpRequest& req = context->GetRequest();
+        const StreamHandler* handler = nullptr;
+        if (req._method == "POST") handler = _post_streams.Find(req._path, req._captures);
+        else if (req._method == "PUT") handler = _put_streams.Find(req._path, req._captures);
+        if (handler != nullptr) {
+            BodyReader reader;
+            reader._flow = BodyFlow(conn);
+            if (!(*handler)(req, resp, reader)) {
+                // 正文没有读取, 连接无法继续使用
+                if (resp._status_code < 400) resp._status_code = 400;
+                if (resp._body.empty()) ErrorHandler(resp);
+                resp.SetHeader("Connection", "close");
+                WriteResponse(conn, req, resp);
+                context->Clear();
                 conn->Shutdown();
-                return;
+                return false;
+            }
+            context->SetReader(std::move(reader));
+        }
+        // 客户端在等待确认后才发送正文
+        if (context->HasBody() && req._version == "HTTP/1.1" && Util::EqualsIgnoreCase(req.HeaderView("Expect"), "100-continue")) {
+            static const char kContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            conn->Send(kContinue, sizeof(kContinue) - 1);
+        }
+        return true;
+    }
+    // 发送流式响应的头部并开始调用生产者, 响应结束前暂停处理同一连接上后续的请求
+    void StartStream(const PtrConnection& conn, HttpContext* context, HttpResponse& resp) {
+        HttpRequest& req = context->GetRequest();
+        bool chunked = req._version == "HTTP/1.1";
+        if (chunked) resp.SetHeader("Transfer-Encoding", "chunked");
+        else resp.SetHeader("Connection", "close");
+        auto stream = std::make_shared<HttpStream>(conn, std::move(resp._producer), chunked, _stream_high_water, _stream_low_water);
+        WriteResponse(conn, req, resp);
+        bool keep_alive = resp.IsKeepAlive();
+        context->SetBusy(true);
+        conn->Hold();
+        stream->Start([keep_alive](const PtrConnection& conn) {
+            auto context = conn->GetTypedContext<HttpContext>();
+            if (context != nullptr && context->IsBusy()) {
+                context->Clear();
+                if (keep_alive) conn->ReprocessInput();
+                else conn->Shutdown();
+            }
+            conn->Release();
+            }, req._method == "HEAD");
+    }
+    // 发送响应并重置上下文, 短连接返回false
+    bool FinishRequest(const PtrConnection& conn, HttpContext* context, HttpResponse& resp) {
+        WriteResponse(conn, context->GetRequest(), resp);
+        context->Clear();
+        if (!resp.IsKeepAlive()) {
+            conn->Shutdown();
+            return false;
+        }
+        return true;
+    }
+    // 动态生成的正文足够大且客户端接受压缩时, 交给工作线程压缩后再发送
+    // 压缩期间暂停处理同一连接上后续的流水线请求, 保证响应的顺序
+    bool CompressAsync(const PtrConnection& conn, HttpContext* context, HttpResponse& resp) {
+        if (resp._body.size() < _compress_min_size || resp.HasHeader("Content-Encoding")) return false;
+        if (context->GetRequest()._method == "HEAD") return false;
+        if (!Compress::Compressible(resp.GetHeader("Content-Type"))) return false;
+        int accepted = AcceptedEncodings(context->GetRequest());
+        int encoding = Compress::kIdentity;
+        for (int enc : { Compress::kBrotli, Compress::kGzip }) {
+            if ((accepted & (1 << enc)) && Compress::Supported(enc)) {
+                encoding = enc;
+                break;
             }
         }
+        if (encoding == Compress::kIdentity) return false;
+        context->SetBusy(true);
+        conn->Hold();
+        auto job = std::make_shared<HttpResponse>(std::move(resp));
+        _workers->Submit([this, conn, job, encoding] {
+            std::string out;
+            if (Compress::Encode(encoding, job->_body, out, DynamicLevel(encoding)) && out.size() < job->_body.size()) {
+                job->_body = std::move(out);
+                job->SetHeader("Content-Encoding", Compress::Name(encoding));
+                job->SetHeader("Content-Length", std::to_string(job->_body.size()));
+            }
+            job->SetHeader("Vary", "Accept-Encoding");
+            conn->GetLoop()->QueueInLoop([this, conn, job] {
+                auto context = conn->GetTypedContext<HttpContext>();
+                if (context != nullptr && context->IsBusy()) {
+                    context->SetBusy(false);
+                    if (FinishRequest(conn, context, *job)) conn->ReprocessInput();
+                }
+                conn->Release();
+                });
+            });
+        return true;
+    }
+    // 协程帧持有handler和responder, 请求在responder销毁之前一直有效
+    static CoTask<void> RunCoroutine(std::shared_ptr<CoHandler> handler, HttpResponder responder) {
+        HttpResponse resp;
+        co_await (*handler)(responder.Request(), resp);
+        responder.Send(std::move(resp));
     }
+    static int StaticLevel(int encoding) { return encoding == Compress::kBrotli ? 11 : 9; }
+    static int DynamicLevel(int encoding) { return encoding == Compress::kBrotli ? 4 : 6; }
 private:
     Handlers _get_handlers;
     Handlers _post_handlers;
@@ -687,4 +2073,14 @@ private:
     Handlers _delete_handlers;
     std::string _root; // 静态资源根目录
     TcpServer _server;
+    StreamHandlers _post_streams;
+    StreamHandlers _put_streams;
+    Router<std::shared_ptr<const WebSocketHandlers>> _ws_handlers;
+    FileCache _cache; // 静态文件缓存, 在主事件循环中处理inotify事件
+    std::unique_ptr<WorkerPool> _workers; // 压缩用的工作线程, 没有开启压缩时为空
+    std::unique_ptr<WorkerPool> _handler_pool; // 执行Blocking处理函数的线程, 没有开启时为空
+    size_t _handler_max_pending = kHandlerMaxPending;
+    size_t _compress_min_size = kCompressMinSize;
+    size_t _stream_high_water = kStreamHighWater;
+    size_t _stream_low_water = kStreamLowWater;
 };
\ No newline at end of file
@@ -0,0 +1,191 @@
+#pragma once
+#include "../server.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <regex>
+
+// 路由捕获的参数, 值是指向请求路径的视图
+using RouteParams = std::vector<std::pair<std::string_view, std::string_view>>;
+
+// 基数树路由
+// 支持的模式:
+//   /users/list        静态路径
+//   /users/:id         :name 捕获一个路径段(到下一个/为止)
+//   /static/*path      *name 捕获剩余的全部路径, 只能出现在末尾
+// 匹配优先级为 静态 > 参数 > 通配, 查找的代价只和路径长度有关, 与路由数量无关
+// 含有其他正则元字符的模式按正则表达式处理, 在基数树没有命中时按注册顺序逐个尝试('.'按普通字符处理)
+template <class Handler>
+class Router {
+private:
+    struct Route {
+        Handler _handler;
+        std::vector<std::string> _names; // 按出现顺序排列的参数名
+    };
+    struct Node {
+        std::string _prefix; // 静态部分
+        std::vector<std::unique_ptr<Node>> _children; // 静态子节点, 首字符互不相同
+        std::unique_ptr<Node> _param; // :name 子节点
+        std::unique_ptr<Route> _route; // 在此结束的路由
+        std::unique_ptr<Route> _wildcard; // 在此开始的 *name 路由
+    };
+    struct Token {
+        enum Kind { kStatic, kParam, kWildcard } _kind;
+        std::string _text;
+    };
+
+    // 把模式拆分成静态部分、参数和通配, 不能用基数树表示时返回false
+    static bool Tokenize(const std::string& pattern, std::vector<Token>& tokens) {
+        static const std::string kRegexChars = "()[]{}?+^$|\\";
+        if (pattern.empty() || pattern[0] != '/') return false;
+        size_t i = 0;
+        while (i < pattern.size()) {
+            bool seg_start = i > 0 && pattern[i - 1] == '/';
+            char c = pattern[i];
+            if (seg_start && (c == ':' || c == '*')) {
+                size_t end = pattern.find('/', i);
+                if (end == std::string::npos) end = pattern.size();
+                std::string name = pattern.substr(i + 1, end - i - 1);
+                if (name.find_first_of(kRegexChars + ":*") != std::string::npos) return false;
+                if (c == '*') {
+                    // 通配只能出现在末尾
+                    if (end != pattern.size()) return false;
+                    tokens.push_back({ Token::kWildcard, name });
+                }
+                else {
+                    if (name.empty()) return false;
+                    tokens.push_back({ Token::kParam, name });
+                }
+                i = end;
+                continue;
+            }
+            if (kRegexChars.find(c) != std::string::npos || c == '*' || c == ':') return false;
+            if (tokens.empty() || tokens.back()._kind != Token::kStatic) tokens.push_back({ Token::kStatic, "" });
+            tokens.back()._text += c;
+            i++;
+        }
+        return true;
+    }
+    // 插入静态路径, 必要时拆分已有节点的公共前缀
+    static Node* InsertStatic(Node* node, std::string_view s) {
+        while (!s.empty()) {
+            std::unique_ptr<Node>* slot = nullptr;
+            for (auto& child : node->_children) {
+                if (child->_prefix[0] == s[0]) {
+                    slot = &child;
+                    break;
+                }
+            }
+            if (slot == nullptr) {
+                node->_children.push_back(std::make_unique<Node>());
+                node->_children.back()->_prefix = std::string(s);
+                return node->_children.back().get();
+            }
+            Node* child = slot->get();
+            size_t common = 0;
+            while (common < child->_prefix.size() && common < s.size() && child->_prefix[common] == s[common]) common++;
+            if (common < child->_prefix.size()) {
+                auto mid = std::make_unique<Node>();
+                mid->_prefix = child->_prefix.substr(0, common);
+                child->_prefix.erase(0, common);
+                mid->_children.push_back(std::move(*slot));
+                *slot = std::move(mid);
+                child = slot->get();
+            }
+            node = child;
+            s.remove_prefix(common);
+        }
+        return node;
+    }
+    static const Route* Match(const Node* node, std::string_view path, RouteParams& values) {
+        if (path.empty() && node->_route) return node->_route.get();
+        // 静态子节点
+        if (!path.empty()) {
+            for (auto& child : node->_children) {
+                if (child->_prefix[0] != path[0]) continue;
+                if (path.substr(0, child->_prefix.size()) == child->_prefix) {
+                    auto route = Match(child.get(), path.substr(child->_prefix.size()), values);
+                    if (route) return route;
+                }
+                break;
+            }
+        }
+        // 参数子节点
+        if (node->_param && !path.empty() && path[0] != '/') {
+            size_t end = std::min(path.find('/'), path.size());
+            values.emplace_back(std::string_view(), path.substr(0, end));
+            auto route = Match(node->_param.get(), path.substr(end), values);
+            if (route) return route;
+            values.pop_back();
+        }
+        // 通配
+        if (node->_wildcard) {
+            values.emplace_back(std::string_view(), path);
+            return node->_wildcard.get();
+        }
+        return nullptr;
+    }
+public:
+    Router() : _root(std::make_unique<Node>()) {}
+
+    // 添加路由, 同一个模式重复添加时保留先添加的并返回false(正则路由不检查重复)
+    bool Add(const std::string& pattern, const Handler& handler) {
+        std::vector<Token> tokens;
+        if (!Tokenize(pattern, tokens)) {
+            std::regex e(pattern);
+            while (_group_names.size() < e.mark_count()) _group_names.push_back(std::to_string(_group_names.size() + 1));
+            _regex.emplace_back(std::move(e), handler);
+            return true;
+        }
+        auto route = std::make_unique<Route>();
+        route->_handler = handler;
+        Node* node = _root.get();
+        for (auto& token : tokens) {
+            switch (token._kind) {
+            case Token::kStatic:
+                node = InsertStatic(node, token._text);
+                break;
+            case Token::kParam:
+                if (!node->_param) node->_param = std::make_unique<Node>();
+                node = node->_param.get();
+                route->_names.push_back(token._text);
+                break;
+            case Token::kWildcard:
+                route->_names.push_back(token._text);
+                break;
+            }
+        }
+        auto& slot = tokens.back()._kind == Token::kWildcard ? node->_wildcard : node->_route;
+        if (slot) return false;
+        slot = std::move(route);
+        return true;
+    }
+    // 查找路径对应的处理函数, 捕获的参数追加到params中(正则捕获组以"1","2"...命名)
+    const Handler* Find(std::string_view path, RouteParams& params) const {
+        // 匹配时先只记录值, 命中后再按路由填入参数名
+        size_t base = params.size();
+        if (auto route = Match(_root.get(), path, params)) {
+            for (size_t i = 0; i < route->_names.size(); i++) {
+                params[base + i].first = route->_names[i];
+            }
+            return &route->_handler;
+        }
+        for (auto& [e, handler] : _regex) {
+            std::cmatch matches;
+            if (std::regex_match(path.data(), path.data() + path.size(), matches, e)) {
+                for (size_t i = 1; i < matches.size(); i++) {
+                    if (!matches[i].matched) continue;
+                    params.emplace_back(_group_names[i - 1], std::string_view(matches[i].first, matches[i].length()));
+                }
+                return &handler;
+            }
+        }
+        return nullptr;
+    }
+private:
+    std::unique_ptr<Node> _root;
+    std::vector<std::pair<std::regex, Handler>> _regex; // 只能用正则表达式表示的路由
+    std::deque<std::string> _group_names; // 正则捕获组的名字
+};
@@ -0,0 +1,509 @@
+#pragma once
+#include "../server.hpp"
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+class HttpRequest;
+
+// RFC 6455 WebSocket: 握手计算、帧的编解码以及升级后的连接处理, 不支持扩展(如permessage-deflate)
+namespace Ws {
+    enum Opcode : uint8_t { kContinuation = 0, kText = 1, kBinary = 2, kClose = 8, kPing = 9, kPong = 10 };
+    // 关闭码
+    enum CloseCode : uint16_t {
+        kNormalClosure = 1000,
+        kGoingAway = 1001,
+        kProtocolError = 1002,
+        kUnsupportedData = 1003,
+        kNoStatus = 1005, // 关闭帧中没有关闭码(不能发送)
+        kAbnormalClosure = 1006, // 没有收到关闭帧连接就断开了(不能发送)
+        kInvalidPayload = 1007,
+        kPolicyViolation = 1008,
+        kMessageTooBig = 1009,
+    };
+    constexpr size_t kMaxHeaderSize = 10; // 服务端发送的帧头最长10字节(不加掩码)
+    constexpr size_t kDefaultMaxMessageSize = 1024 * 1024; // 默认的单条消息上限(分片拼接后)
+
+    // SHA-1摘要(20字节), 只用于计算握手的Sec-WebSocket-Accept
+    inline std::string Sha1(std::string_view data) {
+        uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+        auto rol = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+        std::string msg(data);
+        uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+        msg += static_cast<char>(0x80);
+        while (msg.size() % 64 != 56) msg += '\0';
+        for (int i = 7; i >= 0; i--) msg += static_cast<char>(bits >> (i * 8));
+        for (size_t off = 0; off < msg.size(); off += 64) {
+            uint32_t w[80];
+            for (int i = 0; i < 16; i++) {
+                auto p = reinterpret_cast<const uint8_t*>(msg.data() + off + i * 4);
+                w[i] = static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+            }
+            for (int i = 16; i < 80; i++) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+            for (int i = 0; i < 80; i++) {
+                uint32_t f, k;
+                if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+                else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+                else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+                else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+                uint32_t t = rol(a, 5) + f + e + k + w[i];
+                e = d; d = c; c = rol(b, 30); b = a; a = t;
+            }
+            h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+        }
+        std::string digest(20, '\0');
+        for (int i = 0; i < 20; i++) digest[i] = static_cast<char>(h[i / 4] >> (24 - (i % 4) * 8));
+        return digest;
+    }
+    inline std::string Base64Encode(std::string_view data) {
+        static const char kTable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string out;
+        out.reserve((data.size() + 2) / 3 * 4);
+        size_t i = 0;
+        for (; i + 3 <= data.size(); i += 3) {
+            uint32_t v = static_cast<uint8_t>(data[i]) << 16 | static_cast<uint8_t>(data[i + 1]) << 8 | static_cast<uint8_t>(data[i + 2]);
+            out += kTable[v >> 18]; out += kTable[(v >> 12) & 63]; out += kTable[(v >> 6) & 63]; out += kTable[v & 63];
+        }
+        if (i < data.size()) {
+            uint32_t v = static_cast<uint8_t>(data[i]) << 16;
+            if (i + 1 < data.size()) v |= static_cast<uint8_t>(data[i + 1]) << 8;
+            out += kTable[v >> 18]; out += kTable[(v >> 12) & 63];
+            out += i + 1 < data.size() ? kTable[(v >> 6) & 63] : '=';
+            out += '=';
+        }
+        return out;
+    }
+    // 握手响应中的Sec-WebSocket-Accept
+    inline std::string AcceptKey(std::string_view key) {
+        std::string s(key);
+        s += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        return Base64Encode(Sha1(s));
+    }
+
+    // 逗号分隔的头部字段值(如Connection: keep-alive, Upgrade)中是否包含token, 不区分大小写
+    inline bool HasToken(std::string_view list, std::string_view token) {
+        while (!list.empty()) {
+            size_t comma = std::min(list.find(','), list.size());
+            auto item = list.substr(0, comma);
+            list.remove_prefix(std::min(comma + 1, list.size()));
+            while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+            while (!item.empty() && item.back() == ' ') item.remove_suffix(1);
+            if (item.size() == token.size() && std::equal(item.begin(), item.end(), token.begin(),
+                [](char a, char b) { return tolower(static_cast<unsigned char>(a)) == tolower(static_cast<unsigned char>(b)); })) return true;
+        }
+        return false;
+    }
+    // 原地去掩码, offset为data在整个负载中的偏移(决定从掩码的哪个字节开始)
+    // 掩码按4字节周期重复, 旋转对齐后整块异或: SSE2/AVX2每次16/32字节, 其余按8字节和单字节处理
+    inline void Unmask(char* data, size_t len, const uint8_t key[4], size_t offset) {
+        uint8_t k[4];
+        for (int i = 0; i < 4; i++) k[i] = key[(offset + i) & 3];
+        uint32_t k32;
+        memcpy(&k32, k, 4);
+        uint64_t k64 = static_cast<uint64_t>(k32) << 32 | k32;
+        size_t i = 0;
+#if defined(__AVX2__)
+        __m256i k256 = _mm256_set1_epi32(static_cast<int>(k32));
+        for (; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), _mm256_xor_si256(v, k256));
+        }
+#endif
+#if defined(__SSE2__)
+        __m128i k128 = _mm_set1_epi32(static_cast<int>(k32));
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(v, k128));
+        }
+#endif
+        for (; i + 8 <= len; i += 8) {
+            uint64_t v;
+            memcpy(&v, data + i, 8);
+            v ^= k64;
+            memcpy(data + i, &v, 8);
+        }
+        for (; i < len; i++) data[i] ^= k[i & 3];
+    }
+    // 文本消息和关闭原因必须是合法的UTF-8
+    inline bool ValidUtf8(std::string_view s) {
+        auto p = reinterpret_cast<const uint8_t*>(s.data());
+        size_t n = s.size(), i = 0;
+        while (i < n) {
+            // 连续的ASCII字符每次跳过8个
+            if (i + 8 <= n) {
+                uint64_t v;
+                memcpy(&v, p + i, 8);
+                if (!(v & 0x8080808080808080ULL)) {
+                    i += 8;
+                    continue;
+                }
+            }
+            uint8_t c = p[i];
+            if (c < 0x80) {
+                i++;
+                continue;
+            }
+            size_t len;
+            uint32_t cp;
+            if ((c & 0xE0) == 0xC0) { len = 2; cp = c & 0x1F; }
+            else if ((c & 0xF0) == 0xE0) { len = 3; cp = c & 0x0F; }
+            else if ((c & 0xF8) == 0xF0) { len = 4; cp = c & 0x07; }
+            else return false;
+            if (i + len > n) return false;
+            for (size_t j = 1; j < len; j++) {
+                if ((p[i + j] & 0xC0) != 0x80) return false;
+                cp = cp << 6 | (p[i + j] & 0x3F);
+            }
+            // 过长的编码、代理区和超出范围的码点
+            if ((len == 2 && cp < 0x80) || (len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000)) return false;
+            if (cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return false;
+            i += len;
+        }
+        return true;
+    }
+    // 关闭帧中可以出现的关闭码
+    inline bool ValidCloseCode(uint16_t code) {
+        return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+    }
+    // 编码帧头, 返回长度(不超过kMaxHeaderSize)
+    inline size_t EncodeHeader(char* out, Opcode opcode, size_t len, bool fin = true) {
+        out[0] = static_cast<char>((fin ? 0x80 : 0) | opcode);
+        if (len < 126) {
+            out[1] = static_cast<char>(len);
+            return 2;
+        }
+        if (len <= 0xFFFF) {
+            out[1] = 126;
+            out[2] = static_cast<char>(len >> 8);
+            out[3] = static_cast<char>(len);
+            return 4;
+        }
+        out[1] = 127;
+        for (int i = 0; i < 8; i++) out[2 + i] = static_cast<char>(static_cast<uint64_t>(len) >> (56 - i * 8));
+        return 10;
+    }
+    // 编码一个完整的帧, 用于广播: 只编码一次, 同一份数据挂到所有连接的输出队列上
+    inline std::shared_ptr<const std::string> MakeFrame(std::string_view payload, Opcode opcode = kText) {
+        char head[kMaxHeaderSize];
+        size_t n = EncodeHeader(head, opcode, payload.size());
+        auto frame = std::make_shared<std::string>();
+        frame->reserve(n + payload.size());
+        frame->append(head, n).append(payload);
+        return frame;
+    }
+
+    // 增量的帧解析器: 帧头完整后立即从缓冲区中取出, 负载随到达在输入缓冲区中原地去掩码(每个字节只处理一次);
+    // 单帧的消息直接以指向输入缓冲区的视图交给回调, 分片的消息拼接完整后再交给回调
+    class Parser {
+    public:
+        void SetMaxMessageSize(size_t size) { _max_message_size = size; }
+        void Reset() {
+            _in_frame = false;
+            _message_opcode = kContinuation;
+            // 保留不大的拼接空间
+            if (_fragments.capacity() > kKeepCapacity) std::string().swap(_fragments);
+            else _fragments.clear();
+        }
+        // 解析缓冲区中的帧, 收到完整的消息或者控制帧时调用on_frame(Opcode, std::string_view), 返回false时停止解析;
+        // 返回0表示数据不完整或者被回调停止, 否则为协议错误对应的关闭码
+        template <class F>
+        uint16_t Parse(Buffer* buf, F&& on_frame) {
+            for (;;) {
+                if (!_in_frame) {
+                    int ret = ParseHeader(buf);
+                    if (ret < 0) return 0;
+                    if (ret > 0) return static_cast<uint16_t>(ret);
+                }
+                size_t avail = static_cast<size_t>(std::min<uint64_t>(buf->ReadableSize(), _remaining));
+                if (avail > _unmasked) {
+                    Unmask(buf->ReadPos() + _unmasked, avail - _unmasked, _key, _unmasked);
+                    _unmasked = avail;
+                }
+                if (avail < _remaining) return 0;
+                _in_frame = false;
+                // 先从缓冲区中取出(不移动内存), 视图在回调期间仍然有效, 回调中关闭连接也不会重复处理
+                std::string_view payload(buf->ReadPos(), avail);
+                buf->MoveReadIdx(avail);
+                bool more;
+                if (_opcode >= kClose) {
+                    more = on_frame(_opcode, payload);
+                }
+                else if (_fin && _message_opcode == kContinuation) {
+                    if (_opcode == kText && !ValidUtf8(payload)) return kInvalidPayload;
+                    more = on_frame(_opcode, payload);
+                }
+                else {
+                    if (_opcode != kContinuation) _message_opcode = _opcode;
+                    _fragments.append(payload);
+                    if (!_fin) continue;
+                    Opcode opcode = _message_opcode;
+                    _message_opcode = kContinuation;
+                    if (opcode == kText && !ValidUtf8(_fragments)) return kInvalidPayload;
+                    more = on_frame(opcode, std::string_view(_fragments));
+                    Reset();
+                }
+                if (!more) return 0;
+            }
+        }
+    private:
+        static constexpr size_t kKeepCapacity = 64 * 1024;
+
+        // 解析并取出帧头, 数据不完整返回-1, 成功返回0, 否则返回关闭码
+        int ParseHeader(Buffer* buf) {
+            size_t n = buf->ReadableSize();
+            if (n < 2) return -1;
+            auto p = reinterpret_cast<const uint8_t*>(buf->ReadPos());
+            // 没有协商扩展, RSV位必须为0; 客户端发送的帧必须加掩码
+            if ((p[0] & 0x70) || !(p[1] & 0x80)) return kProtocolError;
+            uint64_t len = p[1] & 0x7F;
+            size_t head = 2 + 4;
+            if (len == 126) head += 2;
+            else if (len == 127) head += 8;
+            if (n < head) return -1;
+            if (len == 126) {
+                len = static_cast<uint64_t>(p[2]) << 8 | p[3];
+            }
+            else if (len == 127) {
+                len = 0;
+                for (int i = 0; i < 8; i++) len = len << 8 | p[2 + i];
+                if (len >> 63) return kProtocolError;
+            }
+            bool fin = p[0] & 0x80;
+            auto opcode = static_cast<Opcode>(p[0] & 0x0F);
+            if (opcode >= kClose) {
+                // 控制帧不能分片, 负载不超过125字节
+                if (opcode > kPong || !fin || len > 125) return kProtocolError;
+            }
+            else if (opcode == kContinuation) {
+                if (_message_opcode == kContinuation) return kProtocolError;
+            }
+            else if (opcode == kText || opcode == kBinary) {
+                if (_message_opcode != kContinuation) return kProtocolError;
+            }
+            else {
+                return kProtocolError;
+            }
+            if (opcode < kClose && len > _max_message_size - std::min(_fragments.size(), _max_message_size)) return kMessageTooBig;
+            memcpy(_key, p + head - 4, 4);
+            buf->MoveReadIdx(head);
+            _in_frame = true;
+            _fin = fin;
+            _opcode = opcode;
+            _remaining = len;
+            _unmasked = 0;
+            return 0;
+        }
+    private:
+        size_t _max_message_size = kDefaultMaxMessageSize;
+        bool _in_frame = false; // 帧头已经取出, 正在等待负载
+        bool _fin = false;
+        Opcode _opcode = kContinuation;
+        uint8_t _key[4]{};
+        uint64_t _remaining = 0; // 当前帧的负载长度
+        size_t _unmasked = 0; // 当前帧已经去掩码的字节数
+        Opcode _message_opcode = kContinuation; // 正在拼接的分片消息的类型, kContinuation表示没有
+        std::string _fragments; // 已经收到的分片
+    };
+
+    using OpenCallback = std::function<void(const PtrConnection&, const HttpRequest&)>;
+    // 数据只在回调期间有效
+    using MessageCallback = std::function<void(const PtrConnection&, std::string_view, Opcode)>;
+    using CloseCallback = std::function<void(const PtrConnection&, uint16_t)>;
+    // 一个WebSocket路由的处理函数和参数, 回调都在连接所属的事件循环线程中调用
+    struct Handlers {
+        OpenCallback _on_open; // 握手完成后调用, 参数为握手请求, 之后可以发送消息
+        MessageCallback _on_message; // 完整的文本或二进制消息(分片已经拼接)
+        CloseCallback _on_close; // 连接关闭时调用, 参数为对端的关闭码(没有收到关闭帧时为kAbnormalClosure)
+        size_t _max_message_size = kDefaultMaxMessageSize; // 超过时以kMessageTooBig关闭连接
+        int _idle_timeout = -1; // 升级后的非活跃超时(秒), 0表示不超时, 负数表示沿用HTTP的超时时间
+    };
+
+    struct GroupShard;
+    // 升级后连接的上下文
+    class Context : public ConnectionContext {
+    public:
+        void Reset() override {
+            _parser.Reset();
+            _handlers.reset();
+            _close_sent = false;
+            _close_code = kAbnormalClosure;
+            _groups.clear();
+        }
+        Parser _parser;
+        std::shared_ptr<const Handlers> _handlers;
+        bool _close_sent = false; // 已经发送关闭帧, 之后收到的数据直接丢弃
+        uint16_t _close_code = kAbnormalClosure; // 对端发送的关闭码
+        std::vector<std::shared_ptr<GroupShard>> _groups; // 加入的广播组, 关闭时退出
+    };
+
+    // 广播组在一个事件循环中的成员, 只在该事件循环线程中访问
+    struct GroupShard {
+        explicit GroupShard(EventLoop* loop) : _loop(loop) {}
+        EventLoop* _loop;
+        std::unordered_map<uint64_t, PtrConnection> _members;
+        std::atomic<size_t> _size{ 0 };
+
+        void Erase(uint64_t id) {
+            if (_members.erase(id) > 0) _size.fetch_sub(1, std::memory_order_relaxed);
+        }
+    };
+
+    // 发送一条消息(一个帧), 帧头和负载作为两个切片由writev一次发出, 可以在任意线程中调用
+    inline void Send(const PtrConnection& conn, std::string data, Opcode opcode = kText) {
+        char head[kMaxHeaderSize];
+        size_t n = EncodeHeader(head, opcode, data.size());
+        OutputChain chain;
+        chain.Append(head, n);
+        chain.Append(std::move(data));
+        conn->Send(std::move(chain));
+    }
+    // 发送MakeFrame编码好的帧, 只持有引用
+    inline void SendFrame(const PtrConnection& conn, const std::shared_ptr<const std::string>& frame) { conn->Send(frame); }
+    inline void Ping(const PtrConnection& conn, std::string payload = "") { Send(conn, std::move(payload), kPing); }
+    // 发送关闭帧并在输出发送完毕后关闭连接, 可以在任意线程中调用
+    inline void Close(const PtrConnection& conn, uint16_t code = kNormalClosure, std::string_view reason = {}) {
+        std::string payload;
+        payload += static_cast<char>(code >> 8);
+        payload += static_cast<char>(code & 0xFF);
+        payload.append(reason.substr(0, 123)); // 控制帧的负载不超过125字节
+        conn->GetLoop()->RunInLoop([conn, payload = std::move(payload)]() mutable {
+            auto context = conn->GetTypedContext<Context>();
+            if (context == nullptr || context->_close_sent) return;
+            context->_close_sent = true;
+            Send(conn, std::move(payload), kClose);
+            conn->Shutdown();
+            });
+    }
+
+    // 处理控制帧, 返回false表示连接正在关闭
+    inline bool OnControl(const PtrConnection& conn, Context* context, Opcode opcode, std::string_view payload) {
+        if (opcode == kPing) {
+            Send(conn, std::string(payload), kPong);
+            return true;
+        }
+        if (opcode == kPong) return true;
+        uint16_t code = kNoStatus;
+        if (payload.size() == 1) {
+            Close(conn, kProtocolError);
+            return false;
+        }
+        if (payload.size() >= 2) {
+            code = static_cast<uint16_t>(static_cast<uint8_t>(payload[0]) << 8 | static_cast<uint8_t>(payload[1]));
+            if (!ValidCloseCode(code)) {
+                Close(conn, kProtocolError);
+                return false;
+            }
+            if (!ValidUtf8(payload.substr(2))) {
+                Close(conn, kInvalidPayload);
+                return false;
+            }
+        }
+        // 回应关闭帧后关闭连接
+        context->_close_code = code;
+        Close(conn, code == kNoStatus ? static_cast<uint16_t>(kNormalClosure) : code);
+        return false;
+    }
+    inline void OnMessage(const PtrConnection& conn, Buffer* buf) {
+        auto context = conn->GetTypedContext<Context>();
+        if (context == nullptr) return;
+        if (context->_close_sent) {
+            buf->MoveReadIdx(buf->ReadableSize());
+            return;
+        }
+        uint16_t error = context->_parser.Parse(buf, [&](Opcode opcode, std::string_view payload) {
+            if (opcode >= kClose) return OnControl(conn, context, opcode, payload);
+            if (context->_handlers->_on_message) context->_handlers->_on_message(conn, payload, opcode);
+            // 对端没有及时读取时停止处理, 输出回落后由连接重新处理输入缓冲区
+            return !context->_close_sent && !conn->IsThrottled();
+            });
+        if (error != 0) {
+            Close(conn, error);
+            buf->MoveReadIdx(buf->ReadableSize());
+        }
+    }
+    inline void OnClose(const PtrConnection& conn) {
+        auto context = conn->GetTypedContext<Context>();
+        if (context == nullptr) return;
+        for (auto& shard : context->_groups) shard->Erase(conn->GetId());
+        context->_groups.clear();
+        if (context->_handlers->_on_close) context->_handlers->_on_close(conn, context->_close_code);
+    }
+    // 把已经完成握手的连接切换为WebSocket, 必须在连接所属的事件循环线程中调用
+    inline void Accept(const PtrConnection& conn, std::shared_ptr<const Handlers> handlers) {
+        ContextPtr ptr = ContextPool<Context>::Acquire();
+        auto context = static_cast<Context*>(ptr.get());
+        context->_parser.SetMaxMessageSize(handlers->_max_message_size);
+        context->_handlers = std::move(handlers);
+        conn->SetTypedContext(std::move(ptr));
+        conn->Upgrade(std::any(), nullptr, OnMessage, OnClose, nullptr);
+    }
+
+    // 广播组: 帧只编码一次, 同一份数据以共享切片挂到每个成员的输出队列上;
+    // 成员按事件循环分片, 每次广播每个事件循环只投递一个任务. Join/Leave必须在连接所属的事件循环线程中调用,
+    // Broadcast可以在任意线程中调用; 连接关闭时自动退出
+    class Group {
+    public:
+        void Join(const PtrConnection& conn) {
+            auto context = conn->GetTypedContext<Context>();
+            if (context == nullptr || !conn->IsConnected()) return;
+            auto shard = ShardOf(conn->GetLoop());
+            if (!shard->_members.emplace(conn->GetId(), conn).second) return;
+            shard->_size.fetch_add(1, std::memory_order_relaxed);
+            context->_groups.push_back(std::move(shard));
+        }
+        void Leave(const PtrConnection& conn) {
+            auto context = conn->GetTypedContext<Context>();
+            if (context == nullptr) return;
+            auto& groups = context->_groups;
+            for (auto it = groups.begin(); it != groups.end(); ++it) {
+                if ((*it)->_loop != conn->GetLoop() || !Owns(*it)) continue;
+                (*it)->Erase(conn->GetId());
+                groups.erase(it);
+                return;
+            }
+        }
+        void Broadcast(std::string_view data, Opcode opcode = kText) { BroadcastFrame(MakeFrame(data, opcode)); }
+        void BroadcastFrame(const std::shared_ptr<const std::string>& frame) {
+            std::vector<std::shared_ptr<GroupShard>> shards;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                shards = _shards;
+            }
+            for (auto& shard : shards) {
+                shard->_loop->RunInLoop([shard, frame] {
+                    // 发送失败的连接在任务队列中关闭, 不影响遍历
+                    for (auto& [id, conn] : shard->_members) conn->Send(frame);
+                    });
+            }
+        }
+        // 成员数量(各个分片的计数不是同一时刻的值)
+        size_t Size() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            size_t size = 0;
+            for (auto& shard : _shards) size += shard->_size.load(std::memory_order_relaxed);
+            return size;
+        }
+    private:
+        std::shared_ptr<GroupShard> ShardOf(EventLoop* loop) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto& shard : _shards) {
+                if (shard->_loop == loop) return shard;
+            }
+            _shards.push_back(std::make_shared<GroupShard>(loop));
+            return _shards.back();
+        }
+        bool Owns(const std::shared_ptr<GroupShard>& shard) const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return std::find(_shards.begin(), _shards.end(), shard) != _shards.end();
+        }
+    private:
+        mutable std::mutex _mutex; // 只保护分片列表, 分片的成员只在所属事件循环线程中访问
+        std::vector<std::shared_ptr<GroupShard>> _shards;
+    };
+}
@@ -3,8 +3,23 @@
 #include <iostream>
 #include <filesystem>
 #include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
 #include <cstdarg>
+#include <cstdio>
 #include <ctime>
+#include <climits>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 enum printMethod { Screen, Onefile, Classfile };
 enum level { Info, Debug, Warning, Error, Fatal };
@@ -14,15 +29,286 @@ printMethod DEFAULT_METHOD = Screen;
 std::string DEFAULT_PATH = "./log/";
 std::string DEFAULT_NAME = "log.txt";
 
+// 异步日志
+// 调用线程只把格式化好的日志追加到本线程的暂存区, 由后台线程批量取走并用writev写入文件
+// 同一线程的日志保持顺序, 不同线程的日志以批为单位交错
 class Log {
+private:
+    static constexpr int kTargets = Fatal + 1;
+    static constexpr size_t kStagingFlushSize = 64 * 1024; // 暂存区超过该大小时立即唤醒后台线程
+    static constexpr size_t kStagingMaxSize = 4 * 1024 * 1024; // 后台线程跟不上时丢弃新的日志
+    static constexpr size_t kDefaultRollSize = 64 * 1024 * 1024;
+    static constexpr int kDefaultRollInterval = 24 * 60 * 60;
+    static constexpr int kDefaultFlushInterval = 1000;
+
+    // 每个线程的暂存区, 锁只会和后台线程竞争
+    struct Staging {
+        std::mutex _mutex;
+        std::string _bufs[kTargets];
+        size_t _dropped = 0;
+    };
+    // 后台线程打开的日志文件
+    struct Sink {
+        int _fd = -1;
+        std::string _name;
+        size_t _written = 0;
+        time_t _period = 0;
+    };
+
+    static std::atomic<uint64_t>& NextId() {
+        static std::atomic<uint64_t> id{ 0 };
+        return id;
+    }
+    int TargetOf(int level) const { return _ptype == Classfile ? level : 0; }
+
+    // 获取当前线程在本日志对象中的暂存区, 第一次使用时注册并启动后台线程
+    Staging* GetStaging() {
+        thread_local std::vector<std::pair<uint64_t, std::shared_ptr<Staging>>> stagings;
+        for (auto& [id, st] : stagings) {
+            if (id == _id) return st.get();
+        }
+        std::call_once(_started, [this] {
+            _flusher = std::thread(&Log::FlushLoop, this);
+            _running = true;
+            });
+        auto st = std::make_shared<Staging>();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stagings.push_back(st);
+        }
+        stagings.emplace_back(_id, st);
+        return st.get();
+    }
+    void Append(int level, const char* line, size_t len) {
+        Staging* st = GetStaging();
+        bool wake = false;
+        {
+            std::lock_guard<std::mutex> lock(st->_mutex);
+            std::string& buf = st->_bufs[TargetOf(level)];
+            if (buf.size() + len > kStagingMaxSize) {
+                st->_dropped++;
+                return;
+            }
+            wake = buf.size() < kStagingFlushSize && buf.size() + len >= kStagingFlushSize;
+            buf.append(line, len);
+        }
+        if (wake) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _wake = true;
+            _cond.notify_one();
+        }
+    }
+
+    // 格式化"年-月-日 时:分:秒", 同一秒内复用上一次的结果
+    static const char* TimeString() {
+        thread_local time_t last = -1;
+        thread_local char buf[64];
+        time_t t = time(nullptr);
+        if (t != last) {
+            struct tm ctime {};
+            localtime_r(&t, &ctime);
+            snprintf(buf, sizeof(buf), "%d-%d-%d %d:%d:%d",
+                ctime.tm_year + 1900, ctime.tm_mon + 1, ctime.tm_mday,
+                ctime.tm_hour, ctime.tm_min, ctime.tm_sec);
+            last = t;
+        }
+        return buf;
+    }
+
+    std::string SinkName(int target) const {
+        switch (_ptype) {
+        case Onefile:
+            return _path + DEFAULT_NAME;
+        case Classfile:
+            return _path + DEFAULT_NAME + "." + levelToString(target);
+        default:
+            return "";
+        }
+    }
+    void OpenSink(Sink& sink, const std::string& name, time_t now) {
+        if (sink._fd > 2) close(sink._fd);
+        sink._fd = -1;
+        sink._name = name;
+        sink._written = 0;
+        sink._period = now / _roll_interval;
+        if (name.empty()) {
+            sink._fd = STDOUT_FILENO;
+            return;
+        }
+        // 判断目录是否存在
+        std::error_code ec;
+        std::filesystem::create_directories(_path, ec);
+        sink._fd = open(name.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (sink._fd == -1) return;
+        struct stat st {};
+        if (fstat(sink._fd, &st) == 0) sink._written = st.st_size;
+    }
+    // 按大小或时间滚动日志文件, 旧文件重命名为"文件名.年月日-时分秒"
+    void RollSink(Sink& sink, time_t now) {
+        if (sink._fd > 2) close(sink._fd);
+        sink._fd = -1;
+        struct tm ctime {};
+        localtime_r(&now, &ctime);
+        char suffix[64];
+        strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &ctime);
+        std::string rolled = sink._name + suffix;
+        for (int i = 1; access(rolled.c_str(), F_OK) == 0; i++) {
+            rolled = sink._name + suffix + "." + std::to_string(i);
+        }
+        rename(sink._name.c_str(), rolled.c_str());
+        OpenSink(sink, sink._name, now);
+    }
+    void WriteSink(Sink& sink, int target, std::vector<std::string>& batch) {
+        if (batch.empty()) return;
+        time_t now = time(nullptr);
+        std::string name = SinkName(target);
+        if (sink._fd == -1 || sink._name != name) OpenSink(sink, name, now);
+        else if (!name.empty() && (sink._written >= _roll_size || now / _roll_interval != sink._period)) {
+            RollSink(sink, now);
+        }
+        if (sink._fd == -1) return;
+        size_t i = 0;
+        while (i < batch.size()) {
+            struct iovec iov[IOV_MAX];
+            int cnt = 0;
+            for (; i < batch.size() && cnt < IOV_MAX; i++, cnt++) {
+                iov[cnt].iov_base = batch[i].data();
+                iov[cnt].iov_len = batch[i].size();
+            }
+            // 普通文件上的writev不会部分写入, 出错时直接放弃这一批
+            ssize_t n = writev(sink._fd, iov, cnt);
+            if (n > 0) sink._written += n;
+        }
+    }
+    // 取走所有暂存区中的日志, 按输出目标批量写入
+    void Drain(std::vector<std::shared_ptr<Staging>>& stagings) {
+        size_t dropped = 0;
+        for (int target = 0; target < kTargets; target++) {
+            std::vector<std::string> batch;
+            for (auto& st : stagings) {
+                std::string buf;
+                if (!_spare.empty()) {
+                    buf = std::move(_spare.back());
+                    _spare.pop_back();
+                }
+                {
+                    std::lock_guard<std::mutex> lock(st->_mutex);
+                    buf.swap(st->_bufs[target]);
+                    if (target == 0) {
+                        dropped += st->_dropped;
+                        st->_dropped = 0;
+                    }
+                }
+                if (buf.empty()) _spare.push_back(std::move(buf));
+                else batch.push_back(std::move(buf));
+            }
+            if (target == TargetOf(Warning) && dropped > 0) {
+                batch.push_back(std::string("[Warning][") + TimeString() + "] "
+                    + std::to_string(dropped) + " log lines dropped\n");
+            }
+            WriteSink(_sinks[target], target, batch);
+            for (auto& buf : batch) {
+                buf.clear();
+                _spare.push_back(std::move(buf));
+            }
+        }
+    }
+    void FlushLoop() {
+        std::vector<std::shared_ptr<Staging>> stagings;
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _cond.wait_for(lock, std::chrono::milliseconds(_flush_interval.load()), [this] {
+                return _stop || _wake || _flush_req != _flush_done;
+                });
+            bool stop = _stop;
+            uint64_t req = _flush_req;
+            _wake = false;
+            stagings = _stagings;
+            lock.unlock();
+            Drain(stagings);
+            stagings.clear();
+            lock.lock();
+            // 线程退出后只剩下这里的引用, 暂存区已经清空, 可以回收
+            _stagings.erase(std::remove_if(_stagings.begin(), _stagings.end(), [](const std::shared_ptr<Staging>& st) {
+                if (st.use_count() != 1) return false;
+                for (auto& buf : st->_bufs) {
+                    if (!buf.empty()) return false;
+                }
+                return true;
+                }), _stagings.end());
+            _flush_done = req;
+            _flushed.notify_all();
+            if (stop) break;
+        }
+        lock.unlock();
+        for (auto& sink : _sinks) {
+            if (sink._fd > 2) close(sink._fd);
+        }
+    }
 public:
-    Log(printMethod method = DEFAULT_METHOD) : _ptype(method), _path(DEFAULT_PATH) {}
+    Log(printMethod method = DEFAULT_METHOD)
+        : _ptype(method), _path(DEFAULT_PATH), _id(NextId()++) {}
+    ~Log() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+            _cond.notify_one();
+        }
+        if (_flusher.joinable()) _flusher.join();
+    }
+    Log(const Log&) = delete;
+    Log& operator=(const Log&) = delete;
 
     void changeMode(printMethod method) {
         _ptype = method;
     }
+    // 低于该级别的日志直接丢弃, 不进行格式化; 按严重程度Debug < Info < Warning < Error < Fatal比较
+    void setLevel(int level) {
+        _level = severity(level);
+    }
+    bool enabled(int level) const {
+        return severity(level) >= _level.load(std::memory_order_relaxed);
+    }
+    // 单个日志文件超过该大小时滚动
+    void setRollSize(size_t size) {
+        _roll_size = size;
+    }
+    // 每隔多少秒滚动一次日志文件
+    void setRollInterval(int seconds) {
+        _roll_interval = std::max(seconds, 1);
+    }
+    // 后台线程定期写入的间隔(毫秒)
+    void setFlushInterval(int ms) {
+        _flush_interval = std::max(ms, 1);
+    }
+    // 等待之前的日志全部写入
+    void flush() {
+        if (!_running) return;
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_stop) return;
+        uint64_t req = ++_flush_req;
+        _cond.notify_one();
+        _flushed.wait(lock, [this, req] { return _flush_done >= req; });
+    }
 
-    std::string levelToString(int level) {
+    // 级别的严重程度, 枚举的顺序(Info在Debug之前)不代表严重程度
+    static int severity(int level) {
+        switch (level) {
+        case Debug:
+            return 0;
+        case Info:
+            return 1;
+        case Warning:
+            return 2;
+        case Error:
+            return 3;
+        case Fatal:
+            return 4;
+        default:
+            return 4;
+        }
+    }
+    static std::string levelToString(int level) {
         switch (level) {
         case Info:
             return "Info";
@@ -39,64 +325,46 @@ public:
         }
     }
 
-    void printLog(int level, const std::string& logtxt) {
-        switch (_ptype) {
-        case Screen:
-            std::cout << logtxt << std::endl;
-            break;
-        case Onefile:
-            printOneFile(DEFAULT_NAME, logtxt);
-            break;
-        case Classfile:
-            printClassFile(DEFAULT_NAME, level, logtxt);
-            break;
-        default:
-            break;
-        }
-    }
-
-    void printOneFile(const std::string& logname, const std::string& logtxt) {
-        std::string _logname = _path + logname;
-
-        // 判断文件是否存在
-        std::filesystem::path dir(_path);
-        if (!std::filesystem::exists(dir)) {
-            std::filesystem::create_directories(dir);
-        }
-
-        FILE* fp = fopen(_logname.c_str(), "a");
-        if (fp == nullptr) return;
-        fwrite(logtxt.c_str(), logtxt.size(), 1, fp);
-        fclose(fp);
-    }
-
-    void printClassFile(const std::string& logname, int level, const std::string& logtxt) {
-        std::string filename = logname;
-        filename += ".";
-        filename += levelToString(level);
-        printOneFile(filename, logtxt);
-    }
-
     void operator()(int level, const char* format, ...) {
-        time_t t = time(nullptr);
-        struct tm* ctime = localtime(&t);
-        char leftbuffer[SIZE];
-        snprintf(leftbuffer, sizeof(leftbuffer), "[%s][%d-%d-%d %d:%d:%d]", levelToString(level).c_str(),
-            ctime->tm_year + 1900, ctime->tm_mon + 1, ctime->tm_mday,
-            ctime->tm_hour, ctime->tm_min, ctime->tm_sec);
+        if (!enabled(level)) return;
+        thread_local char logtxt[SIZE * 2 + 10];
+        int left = snprintf(logtxt, sizeof(logtxt), "[%s][%s] ", levelToString(level).c_str(), TimeString());
 
         va_list s;
         va_start(s, format);
-        char rightbuffer[SIZE];
-        vsnprintf(rightbuffer, sizeof(rightbuffer), format, s);
+        int right = vsnprintf(logtxt + left, sizeof(logtxt) - left - 1, format, s);
         va_end(s);
+        if (right < 0) right = 0;
 
-        // 格式：默认部分+自定义部分
-        char logtxt[SIZE * 2 + 10];
-        snprintf(logtxt, sizeof(logtxt), "%s %s\n", leftbuffer, rightbuffer);
-        printLog(level, logtxt);
+        // 格式：默认部分+自定义部分, 过长的内容被截断
+        size_t len = std::min<size_t>(left + right, sizeof(logtxt) - 2);
+        logtxt[len++] = '\n';
+        Append(level, logtxt, len);
+        // 致命错误之后进程通常会退出, 同步等待写入
+        if (level == Fatal) flush();
     }
 private:
-    printMethod _ptype;
+    std::atomic<printMethod> _ptype;
     std::string _path;
-};
\ No newline at end of file
+    const uint64_t _id;
+    std::atomic<int> _level{ 0 }; // 严重程度, 默认全部输出
+    std::atomic<size_t> _roll_size{ kDefaultRollSize };
+    std::atomic<int> _roll_interval{ kDefaultRollInterval };
+    std::atomic<int> _flush_interval{ kDefaultFlushInterval };
+
+    std::mutex _mutex; // 保护下面的成员
+    std::condition_variable _cond; // 唤醒后台线程
+    std::condition_variable _flushed; // 通知写入完成
+    std::vector<std::shared_ptr<Staging>> _stagings;
+    bool _stop = false;
+    bool _wake = false;
+    uint64_t _flush_req = 0;
+    uint64_t _flush_done = 0;
+
+    std::once_flag _started;
+    std::atomic<bool> _running{ false };
+    std::thread _flusher;
+    // 只由后台线程使用
+    Sink _sinks[kTargets];
+    std::vector<std::string> _spare;
+};
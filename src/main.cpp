@@ -2,9 +2,30 @@
 
 const std::string WWWROOT = "../wwwroot/";
 
-void PutFile(const HttpRequest& req, HttpResponse& resp) {
-    std::string pathname = WWWROOT + req._path;
-    Util::WriteFile(pathname, req._body);
+// 上传的文件保存在WWWROOT/upload/下, 单个文件不超过UPLOAD_MAX_SIZE; 默认不开启, 设置环境变量HTTP_ENABLE_UPLOAD后注册
+const std::string UPLOAD_DIR = WWWROOT + "upload/";
+const size_t UPLOAD_MAX_SIZE = 16 * 1024 * 1024;
+
+// 上传的文件边接收边写入磁盘, 不在内存中缓存整个正文
+bool PutFile(const HttpRequest& req, HttpResponse& resp, BodyReader& reader) {
+    // 只检查捕获的部分, 不能通过..离开上传目录
+    std::string path = req.GetCapture("path");
+    if (path.empty() || !Util::ResourcePathValid(path) || path.back() == '/') {
+        resp._status_code = 403; // Forbidden
+        return false;
+    }
+    if (req.GetContentLength() > UPLOAD_MAX_SIZE) {
+        resp._status_code = 413; // Payload Too Large
+        return false;
+    }
+    StreamBodyToFile(UPLOAD_DIR + path, reader);
+    // 分块编码的正文没有长度, 边接收边计数
+    auto write = std::move(reader._on_data);
+    reader._on_data = [write = std::move(write), received = size_t(0)](const char* data, size_t len) mutable {
+        received += len;
+        return received <= UPLOAD_MAX_SIZE && write(data, len);
+        };
+    return true;
 }
 
 int main() {
@@ -15,18 +36,35 @@ int main() {
     }
     auto echo = [](const HttpRequest& req, HttpResponse& resp) {
         std::string s;
-        s += req._method + " " + req._path + " " + req._version + "\r\n";
+        s.append(req._method).append(" ").append(req._path).append(" ").append(req._version).append("\r\n");
         for (auto& p : req._params) {
-            s += p.first + ": " + p.second + "\r\n";
+            s.append(p.first).append(": ").append(p.second).append("\r\n");
         }
         for (auto& p : req._headers) {
-            s += p.first + ": " + p.second + "\r\n";
+            s.append(p.first).append(": ").append(p.second).append("\r\n");
         }
         s += "\r\n";
         s += req._body;
         resp.SetContent(s, "text/plain");
         };
     server.Get("/hello", echo);
+    if (getenv("HTTP_ENABLE_UPLOAD") != nullptr) {
+        mkdir(UPLOAD_DIR.c_str(), 0755);
+        server.PutStream("/upload/*path", PutFile);
+    }
+    // 回显收到的消息, 同时广播给/chat上的所有连接
+    static Ws::Group chat;
+    HttpServer::WebSocketHandlers ws;
+    ws._on_open = [](const PtrConnection& conn, const HttpRequest&) { chat.Join(conn); };
+    ws._on_message = [](const PtrConnection& conn, std::string_view data, Ws::Opcode opcode) {
+        if (opcode == Ws::kBinary) Ws::Send(conn, std::string(data), opcode);
+        else chat.Broadcast(data);
+        };
+    server.WebSocket("/chat", ws);
+    server.EnableCompression();
+    server.EnableMetrics();
+    // 设置环境变量HTTP_HANDOFF_PATH(应当位于只有当前用户可写的目录)后开启: 同一端口上新启动的进程通过它接管监听套接字, 旧进程排空连接后退出
+    if (const char* path = getenv("HTTP_HANDOFF_PATH")) server.EnableHandoff(path, 10 * 1000);
     server.Start();
 
     return 0;
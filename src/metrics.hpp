@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+// 单调时钟(纳秒)
+inline uint64_t MonotonicNs() {
+    struct timespec ts {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// 计数器, 只由所属的事件循环线程写入(不需要原子的读-改-写), 其他线程可以随时读取
+class Counter {
+public:
+    void Add(uint64_t n = 1) { _value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t Value() const { return _value.load(std::memory_order_relaxed); }
+private:
+    std::atomic<uint64_t> _value{ 0 };
+};
+
+// HDR风格的直方图: 每个2的幂区间再等分成kSubCount个桶, 相对误差不超过1/kSubCount
+// 和计数器一样只能由一个线程写入, 读取时通过Snapshot合并多个直方图
+class Histogram {
+public:
+    static constexpr int kSubBits = 3;
+    static constexpr int kSubCount = 1 << kSubBits;
+    static constexpr int kMaxBits = 40; // 不小于2^40的值都记入最后一个桶(纳秒约18分钟)
+    static constexpr int kBuckets = (kMaxBits - kSubBits + 1) * kSubCount;
+
+    // 某一时刻的直方图数据, 可以合并
+    struct Snapshot {
+        std::array<uint64_t, kBuckets> _counts{};
+        uint64_t _count = 0;
+        uint64_t _sum = 0;
+
+        void Merge(const Snapshot& other) {
+            for (int i = 0; i < kBuckets; i++) _counts[i] += other._counts[i];
+            _count += other._count;
+            _sum += other._sum;
+        }
+        // 小于bound的值的数量, bound不小于kSubCount时必须是2的幂(与桶的边界对齐)
+        uint64_t CountBelow(uint64_t bound) const {
+            uint64_t count = 0;
+            for (int i = 0; i < kBuckets && UpperBound(i) <= bound; i++) count += _counts[i];
+            return count;
+        }
+        // 分位数的估计值(所在桶的中点)
+        uint64_t Quantile(double q) const {
+            if (_count == 0) return 0;
+            uint64_t rank = static_cast<uint64_t>(q * (_count - 1)) + 1;
+            uint64_t seen = 0;
+            for (int i = 0; i < kBuckets; i++) {
+                seen += _counts[i];
+                if (seen >= rank) return (LowerBound(i) + UpperBound(i) - 1) / 2;
+            }
+            return LowerBound(kBuckets - 1);
+        }
+    };
+
+    void Record(uint64_t value) {
+        auto& bucket = _counts[BucketOf(value)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _count.store(_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _sum.store(_sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    // 把当前数据累加到snapshot中, 可以在任意线程中调用(各个字段不是同一时刻的值)
+    void AddTo(Snapshot& snapshot) const {
+        for (int i = 0; i < kBuckets; i++) snapshot._counts[i] += _counts[i].load(std::memory_order_relaxed);
+        snapshot._count += _count.load(std::memory_order_relaxed);
+        snapshot._sum += _sum.load(std::memory_order_relaxed);
+    }
+
+    static int BucketOf(uint64_t value) {
+        if (value < static_cast<uint64_t>(kSubCount)) return static_cast<int>(value);
+        int exp = 63 - __builtin_clzll(value);
+        if (exp >= kMaxBits) return kBuckets - 1;
+        int sub = static_cast<int>(value >> (exp - kSubBits)) & (kSubCount - 1);
+        return (exp - kSubBits + 1) * kSubCount + sub;
+    }
+    // 桶的下界(包含)
+    static uint64_t LowerBound(int index) {
+        if (index < kSubCount) return index;
+        int exp = index / kSubCount + kSubBits - 1;
+        uint64_t sub = index % kSubCount;
+        return (kSubCount + sub) << (exp - kSubBits);
+    }
+    // 桶的上界(不包含)
+    static uint64_t UpperBound(int index) {
+        if (index == kBuckets - 1) return UINT64_MAX;
+        return LowerBound(index + 1);
+    }
+private:
+    std::array<std::atomic<uint64_t>, kBuckets> _counts{};
+    std::atomic<uint64_t> _count{ 0 };
+    std::atomic<uint64_t> _sum{ 0 };
+};
+
+// 每个事件循环的统计数据, 由事件循环线程写入, 导出时在其他线程中读取
+struct LoopMetrics {
+    Histogram _poll_events; // 每次epoll_wait返回的就绪事件数, 样本数就是唤醒次数
+    Histogram _task_batch; // 每轮执行的任务数(非空时)
+    Histogram _handle_ns; // 每个就绪Channel的事件处理耗时
+    Histogram _write_ns; // 每次writev/sendfile的耗时
+    Counter _bytes_read;
+    Counter _bytes_written;
+    Counter _connections_opened;
+    Counter _connections_closed;
+    // 以下由HTTP层记录
+    Histogram _parse_ns; // 解析请求头的耗时
+    Histogram _handler_ns; // 处理函数的耗时
+    Histogram _request_ns; // 从收到请求到响应进入输出队列的耗时
+    Counter _responses[6]; // 按状态码分类(1xx~5xx), 0为其他
+};
+
+// 事件循环对外公布的负载, 分配新连接时在其他线程中读取
+struct LoopLoad {
+    std::atomic<int64_t> _connections{ 0 }; // 分配给该事件循环的连接数(分配时增加, 关闭时减少, 会被多个线程修改)
+    std::atomic<int64_t> _pending_bytes{ 0 }; // 所有连接的输入输出缓冲区中积压的字节数(只由事件循环线程修改)
+
+    int64_t Connections() const { return _connections.load(std::memory_order_relaxed); }
+    int64_t PendingBytes() const { return _pending_bytes.load(std::memory_order_relaxed); }
+    void AddPendingBytes(int64_t delta) {
+        _pending_bytes.store(_pending_bytes.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+};
+
+// 生成Prometheus文本格式
+class PrometheusWriter {
+public:
+    // 指标族的说明, 同一指标族的样本必须紧跟在后面
+    void Family(const char* name, const char* type, const char* help) {
+        _text += "# HELP "; _text += name; _text += ' '; _text += help; _text += '\n';
+        _text += "# TYPE "; _text += name; _text += ' '; _text += type; _text += '\n';
+    }
+    // labels为"key=\"value\""形式, 可以为空
+    void Sample(const char* name, const std::string& labels, double value) {
+        _text += name;
+        if (!labels.empty()) {
+            _text += '{'; _text += labels; _text += '}';
+        }
+        char buf[32];
+        // 计数按整数输出, 耗时保留足够的有效数字
+        if (value == static_cast<double>(static_cast<uint64_t>(value)) && value < 9007199254740992.0) {
+            snprintf(buf, sizeof(buf), " %llu\n", static_cast<unsigned long long>(value));
+        }
+        else {
+            snprintf(buf, sizeof(buf), " %.9g\n", value);
+        }
+        _text += buf;
+    }
+    // 直方图导出累计的桶, 边界从min_bound开始每次乘以2^shift直到max_bound(都必须是2的幂),
+    // scale把原始值换算成导出的单位
+    void Buckets(const char* name, const std::string& labels, const Histogram::Snapshot& snapshot,
+        uint64_t min_bound, uint64_t max_bound, int shift, double scale) {
+        std::string bucket = std::string(name) + "_bucket";
+        std::string prefix = labels.empty() ? "" : labels + ",";
+        char le[32];
+        for (uint64_t bound = min_bound; bound <= max_bound; bound <<= shift) {
+            snprintf(le, sizeof(le), "le=\"%g\"", bound * scale);
+            Sample(bucket.c_str(), prefix + le, static_cast<double>(snapshot.CountBelow(bound)));
+        }
+        Sample(bucket.c_str(), prefix + "le=\"+Inf\"", static_cast<double>(snapshot._count));
+        Sample((std::string(name) + "_sum").c_str(), labels, snapshot._sum * scale);
+        Sample((std::string(name) + "_count").c_str(), labels, static_cast<double>(snapshot._count));
+    }
+    // 分位数(summary的形式)
+    void Quantiles(const char* name, const std::string& labels, const Histogram::Snapshot& snapshot, double scale) {
+        std::string prefix = labels.empty() ? "" : labels + ",";
+        for (const char* q : { "0.5", "0.9", "0.99", "0.999" }) {
+            Sample(name, prefix + "quantile=\"" + q + "\"", snapshot.Quantile(atof(q)) * scale);
+        }
+        Sample((std::string(name) + "_sum").c_str(), labels, snapshot._sum * scale);
+        Sample((std::string(name) + "_count").c_str(), labels, static_cast<double>(snapshot._count));
+    }
+    std::string& Text() { return _text; }
+private:
+    std::string _text;
+};
@@ -1,17 +1,26 @@
 #pragma once
 
 #include "log.hpp"
+#include "metrics.hpp"
 #include <utility>
 #include <vector>
 #include <stdexcept>
 #include <functional>
 #include <unordered_map>
 #include <cstring>
+#include <climits>
 #include <queue>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <type_traits>
+#include <cstddef>
+#include <new>
 #include <any>
 #include <condition_variable>
+#include <coroutine>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -22,30 +31,121 @@
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+// 内核头文件足够新时才编译io_uring后端(需要多次触发的poll和带超时参数的io_uring_enter)
+#if defined(IORING_POLL_ADD_MULTI) && defined(IORING_FEAT_EXT_ARG)
+#define REACTOR_HAVE_IO_URING 1
+#endif
+#include <random>
 
 Log lg(Onefile);
 
+// 缓冲区内存池, 按2的幂分级(4KiB~1MiB), 每个线程(即每个事件循环)一个, 分配和回收不加锁
+// 超过最大级别的内存直接分配; 每一级缓存的内存有上限, 多余的直接释放
+// 内存可以在其他线程中归还, 归还到当前线程的池中
+class BufferPool {
+public:
+    static constexpr std::size_t kMinChunkSize = 4096;
+    static constexpr std::size_t kMaxChunkSize = 1024 * 1024;
+    static constexpr std::size_t kMaxCachedBytes = 2 * 1024 * 1024; // 每一级最多缓存的字节数
+    static constexpr int kClasses = 9; // 4KiB, 8KiB, ..., 1MiB
+
+    // 分配至少size字节, 实际大小通过size返回, 内存不清零
+    static char* Allocate(std::size_t& size) {
+        int cls = ClassOf(size);
+        if (cls < 0) return new char[size];
+        size = kMinChunkSize << cls;
+        BufferPool* pool = Local();
+        if (pool != nullptr && !pool->_free[cls].empty()) {
+            char* chunk = pool->_free[cls].back();
+            pool->_free[cls].pop_back();
+            pool->_cached -= size;
+            return chunk;
+        }
+        return new char[size];
+    }
+    // 归还Allocate返回的内存, size为实际大小
+    static void Deallocate(char* chunk, std::size_t size) {
+        if (chunk == nullptr) return;
+        int cls = ClassOf(size);
+        BufferPool* pool = Local();
+        if (cls < 0 || pool == nullptr || pool->_free[cls].size() * size >= kMaxCachedBytes) {
+            delete[] chunk;
+            return;
+        }
+        pool->_free[cls].push_back(chunk);
+        pool->_cached += size;
+    }
+    // 当前线程缓存的空闲字节数
+    static std::size_t CachedBytes() {
+        BufferPool* pool = Local();
+        return pool ? pool->_cached : 0;
+    }
+private:
+    BufferPool() = default;
+    ~BufferPool() {
+        for (auto& list : _free) {
+            for (char* chunk : list) delete[] chunk;
+        }
+        Destroyed() = true;
+    }
+    // 线程退出时内存池已经析构, 之后归还的内存直接释放
+    static bool& Destroyed() {
+        thread_local bool destroyed = false;
+        return destroyed;
+    }
+    static BufferPool* Local() {
+        if (Destroyed()) return nullptr;
+        thread_local BufferPool pool;
+        return &pool;
+    }
+    // 不超过最大级别时返回级别, 否则返回-1
+    static int ClassOf(std::size_t size) {
+        if (size > kMaxChunkSize) return -1;
+        int cls = 0;
+        while ((kMinChunkSize << cls) < size) cls++;
+        return cls;
+    }
+private:
+    std::vector<char*> _free[kClasses];
+    std::size_t _cached = 0;
+};
+
+// 读写缓冲区, 内存从BufferPool中按需借用, 没有数据时可以通过Release归还
 class Buffer {
 private:
-    char* WritePos() { return &_buffer[_write_idx]; }
     std::size_t FrontSize() const { return _read_idx; }
-    std::size_t BackSize() const { return _buffer.size() - _write_idx; }
 
     void EnsureWritable(std::size_t len) {
-        if (len > BackSize()) {
-            if (len > WritableSize()) {
-                // 如果空间不够，那就直接扩容，不进行移动
-                // 尽量少地进行移动是为了减少内存拷贝的次数，提高性能
-                _buffer.resize(_buffer.size() + len);
-            }
-            else {
-                // 将数据移动到起始位置
-                std::copy(ReadPos(), static_cast<const char*>(WritePos()), &_buffer[0]);
-                _write_idx -= FrontSize();
-                _read_idx = 0;
-            }
+        if (len <= BackSize()) return;
+        std::size_t readable = ReadableSize();
+        if (len <= WritableSize() && readable <= _capacity / 2) {
+            // 将数据移动到起始位置(数据较少时, 移动比扩容便宜)
+            std::memmove(_data, ReadPos(), readable);
+        }
+        else {
+            // 按2倍扩容, 只拷贝可读数据, 新内存不清零
+            std::size_t size = std::max(_capacity * 2, readable + len);
+            char* data = BufferPool::Allocate(size);
+            if (readable > 0) std::memcpy(data, ReadPos(), readable);
+            BufferPool::Deallocate(_data, _capacity);
+            _data = data;
+            _capacity = size;
         }
+        _write_idx = readable;
+        _read_idx = 0;
     }
     char* FindCRLF() {
         for (auto p = ReadPos(); p < WritePos(); p++) {
@@ -54,12 +154,58 @@ private:
         return nullptr;
     }
 public:
-    explicit Buffer(std::size_t size = 1024) : _buffer(size), _read_idx(0), _write_idx(0) {}
+    // size为0时不分配内存, 第一次写入时再借用
+    explicit Buffer(std::size_t size = 0) : _data(nullptr), _capacity(0), _read_idx(0), _write_idx(0) {
+        if (size > 0) EnsureWritable(size);
+    }
     Buffer(const Buffer& buf) : Buffer() { Write(buf); } // 拷贝构造函数（委托构造）
+    Buffer(Buffer&& buf) noexcept
+        : _data(std::exchange(buf._data, nullptr))
+        , _capacity(std::exchange(buf._capacity, 0))
+        , _read_idx(std::exchange(buf._read_idx, 0))
+        , _write_idx(std::exchange(buf._write_idx, 0)) {}
+    Buffer& operator=(const Buffer& buf) {
+        if (this != &buf) {
+            Clear();
+            Write(buf);
+        }
+        return *this;
+    }
+    Buffer& operator=(Buffer&& buf) noexcept {
+        if (this != &buf) {
+            BufferPool::Deallocate(_data, _capacity);
+            _data = std::exchange(buf._data, nullptr);
+            _capacity = std::exchange(buf._capacity, 0);
+            _read_idx = std::exchange(buf._read_idx, 0);
+            _write_idx = std::exchange(buf._write_idx, 0);
+        }
+        return *this;
+    }
+    ~Buffer() { BufferPool::Deallocate(_data, _capacity); }
+
+    // readv时溢出部分使用的栈上空间大小
+    static constexpr std::size_t kReadFdExtraSize = 65536;
 
-    const char* ReadPos() const { return &_buffer[_read_idx]; }
+    const char* ReadPos() const { return _data + _read_idx; }
+    // 可读区域的起始位置, 允许原地修改未读的数据(如WebSocket去掩码)
+    char* ReadPos() { return _data + _read_idx; }
+    // 可写区域的起始位置, 写入后通过MoveWriteIdx提交
+    char* WritePos() { return _data + _write_idx; }
     std::size_t ReadableSize() const { return _write_idx - _read_idx; }
     std::size_t WritableSize() const { return BackSize() + FrontSize(); }
+    // 末尾可直接写入的空间大小
+    std::size_t BackSize() const { return _capacity - _write_idx; }
+    std::size_t Capacity() const { return _capacity; }
+    // 保证末尾至少有len字节可写
+    void Reserve(std::size_t len) { EnsureWritable(len); }
+    // 没有可读数据时把内存归还给内存池
+    void Release() {
+        if (ReadableSize() > 0) return;
+        BufferPool::Deallocate(_data, _capacity);
+        _data = nullptr;
+        _capacity = 0;
+        _read_idx = _write_idx = 0;
+    }
 
     void MoveReadIdx(std::size_t len) {
         if (_read_idx + len > _write_idx) throw std::out_of_range("move read idx out of range");
@@ -95,12 +241,70 @@ public:
     void Write(const std::string& str, bool push = true) { Write(str.data(), str.size(), push); }
     void Write(const Buffer& buf, bool push = true) { Write(buf.ReadPos(), buf.ReadableSize(), push); }
     void Clear() { _read_idx = _write_idx = 0; }
+    // 通过readv直接读到可写区域, 放不下的部分先读到栈上再追加(参考muduo的readFd)
+    // 返回值同readv, 出错时errno保存在saved_errno中
+    ssize_t ReadFd(int fd, int* saved_errno) {
+        char extra[kReadFdExtraSize];
+        std::size_t writable = BackSize();
+        struct iovec vec[2];
+        vec[0].iov_base = WritePos();
+        vec[0].iov_len = writable;
+        vec[1].iov_base = extra;
+        vec[1].iov_len = sizeof(extra);
+        // 可写空间已经足够大时不再使用栈上空间
+        int iovcnt = writable < sizeof(extra) ? 2 : 1;
+        ssize_t n = readv(fd, vec, iovcnt);
+        if (n < 0) {
+            *saved_errno = errno;
+        }
+        else if (static_cast<std::size_t>(n) <= writable) {
+            _write_idx += n;
+        }
+        else {
+            _write_idx = _capacity;
+            Write(extra, n - writable);
+        }
+        return n;
+    }
 private:
-    std::vector<char> _buffer;
+    char* _data; // 从内存池借用的内存, 没有借用时为空
+    std::size_t _capacity;
     std::size_t _read_idx;
     std::size_t _write_idx;
 };
 
+// 只读文件描述符, 可被多个待发送的文件区段共享
+class FileHandle {
+public:
+    FileHandle(int fd, std::size_t size, const struct timespec& mtime) : _fd(fd), _size(size), _mtime(mtime) {}
+    ~FileHandle() { if (_fd != -1) close(_fd); }
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+
+    // 打开普通文件, 失败返回nullptr
+    static std::shared_ptr<FileHandle> Open(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            lg(Error, "open file failed: %s", path.c_str());
+            return nullptr;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            lg(Error, "stat file failed: %s", path.c_str());
+            close(fd);
+            return nullptr;
+        }
+        return std::make_shared<FileHandle>(fd, static_cast<std::size_t>(st.st_size), st.st_mtim);
+    }
+    int GetFd() const { return _fd; }
+    std::size_t GetSize() const { return _size; }
+    const struct timespec& GetMtime() const { return _mtime; }
+private:
+    int _fd;
+    std::size_t _size; // 打开时的文件大小
+    struct timespec _mtime; // 打开时的修改时间
+};
+
 class Socket {
 public:
     Socket() : _sockfd(-1) {}
@@ -155,9 +359,12 @@ public:
         return true;
     }
     // 获取新连接
+    // 新连接直接设置为非阻塞和CLOEXEC, 没有新连接时返回-1且不记录错误
     int Accept() {
-        int newfd = accept(_sockfd, nullptr, nullptr);
-        if (newfd == -1) lg(Error, "accept failed");
+        int newfd = accept4(_sockfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newfd == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            lg(Error, "accept failed: %s", strerror(errno));
+        }
         return newfd;
     }
     // 接收数据
@@ -184,6 +391,31 @@ public:
         }
         return ret;
     }
+    // 零拷贝发送文件内容, offset会随发送的字节数前移
+    ssize_t SendFile(int in_fd, off_t* offset, std::size_t count) {
+        if (count == 0) return 0;
+        ssize_t ret = sendfile(_sockfd, in_fd, offset, count);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            else lg(Error, "sendfile failed");
+        }
+        else if (ret == 0) {
+            // 文件在发送过程中被截断
+            lg(Error, "sendfile reached end of file early");
+            return -1;
+        }
+        return ret;
+    }
+    // 聚集发送多段数据
+    ssize_t Writev(const struct iovec* iov, int iovcnt) {
+        if (iovcnt == 0) return 0;
+        ssize_t ret = writev(_sockfd, iov, iovcnt);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            else lg(Error, "writev failed");
+        }
+        return ret;
+    }
     // 关闭套接字
     void Close() {
         if (_sockfd != -1) {
@@ -194,10 +426,11 @@ public:
     // 创建服务端连接
     bool CreateServer(uint16_t port, bool block = true, const std::string& ip = "0.0.0.0", int backlog = 1024) {
         if (!Create()) return false;
+        // 地址、端口复用必须在绑定之前设置才会生效
+        ReuseAddr();
         if (!Bind(ip, port)) return false;
         if (!Listen(backlog)) return false;
         if (!block) NonBlock();
-        ReuseAddr();
         return true;
     }
     // 创建客户端连接
@@ -235,6 +468,149 @@ private:
     int _sockfd;
 };
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// 输出链, 由自有字符串、共享只读数据块、文件区段组成的切片队列
+// 内存切片通过writev一次聚集发送, 文件区段通过sendfile发送
+class OutputChain {
+private:
+    // 小于该大小的数据直接合并到末尾的自有切片中, 避免产生过多的iovec
+    static constexpr std::size_t kCoalesceSize = 1024;
+
+    struct Slice {
+        std::string _owned; // 自有数据
+        std::shared_ptr<const void> _hold; // 共享只读数据的所有者
+        const char* _base; // 共享只读数据的起始地址
+        std::shared_ptr<FileHandle> _file; // 文件区段
+        std::size_t _offset; // 数据偏移或文件偏移
+        std::size_t _length; // 剩余长度
+
+        const char* Data() const { return (_hold ? _base : _owned.data()) + _offset; }
+        bool IsOwned() const { return !_hold && !_file; }
+    };
+public:
+    std::size_t ReadableSize() const { return _size; }
+    bool Empty() const { return _size == 0; }
+    // 丢弃链首已经发送的len字节
+    void Consume(std::size_t len) {
+        _size -= len;
+        while (len > 0) {
+            auto& front = _slices.front();
+            std::size_t n = std::min(len, front._length);
+            front._offset += n;
+            front._length -= n;
+            len -= n;
+            if (front._length == 0) _slices.pop_front();
+        }
+    }
+    // 收集链首连续的内存切片用于异步发送, 总长度不小于min_size时返回总长度, 否则返回0且不修改输出链;
+    // 自有数据先转为共享(之后不再向其合并), 所有权通过holds共享, 发送完成之前数据保持不变
+    std::size_t ShareFront(std::size_t min_size, std::vector<struct iovec>& iov, std::vector<std::shared_ptr<const void>>& holds) {
+        std::size_t total = 0;
+        std::size_t cnt = 0;
+        for (auto it = _slices.begin(); it != _slices.end() && cnt < IOV_MAX && !it->_file; ++it, ++cnt) {
+            total += it->_length;
+        }
+        if (total == 0 || total < min_size) return 0;
+        for (std::size_t i = 0; i < cnt; i++) {
+            auto& slice = _slices[i];
+            if (slice.IsOwned()) {
+                auto owned = std::make_shared<const std::string>(std::move(slice._owned));
+                slice._base = owned->data();
+                slice._hold = std::move(owned);
+            }
+            iov.push_back({const_cast<char*>(slice.Data()), slice._length});
+            holds.push_back(slice._hold);
+        }
+        return total;
+    }
+
+    void Append(const char* data, std::size_t len) {
+        if (len == 0) return;
+        if (len < kCoalesceSize && !_slices.empty() && _slices.back().IsOwned()) {
+            auto& back = _slices.back();
+            back._owned.append(data, len);
+            back._length += len;
+        }
+        else {
+            _slices.push_back({std::string(data, len), nullptr, nullptr, nullptr, 0, len});
+        }
+        _size += len;
+    }
+    void Append(std::string&& str) {
+        if (str.size() < kCoalesceSize) {
+            Append(str.data(), str.size());
+            return;
+        }
+        std::size_t len = str.size();
+        _slices.push_back({std::move(str), nullptr, nullptr, nullptr, 0, len});
+        _size += len;
+    }
+    // 接管缓冲区中的可读数据, 不拷贝
+    void Append(Buffer&& buf) {
+        std::size_t len = buf.ReadableSize();
+        if (len < kCoalesceSize) {
+            Append(buf.ReadPos(), len);
+            return;
+        }
+        auto hold = std::make_shared<Buffer>(std::move(buf));
+        const char* base = hold->ReadPos();
+        _slices.push_back({std::string(), std::move(hold), base, nullptr, 0, len});
+        _size += len;
+    }
+    // 共享数据块在发送完成前保持引用, 不会被拷贝
+    void Append(const std::shared_ptr<const std::string>& blob, std::size_t offset = 0, std::size_t len = std::string::npos) {
+        if (!blob || offset >= blob->size()) return;
+        len = std::min(len, blob->size() - offset);
+        _slices.push_back({std::string(), blob, blob->data(), nullptr, offset, len});
+        _size += len;
+    }
+    void AppendFile(const std::shared_ptr<FileHandle>& file, off_t offset, std::size_t len) {
+        if (!file || len == 0) return;
+        _slices.push_back({std::string(), nullptr, nullptr, file, static_cast<std::size_t>(offset), len});
+        _size += len;
+    }
+    // 将另一条输出链的切片整体移动到末尾
+    void Append(OutputChain&& chain) {
+        for (auto& slice : chain._slices) {
+            _slices.push_back(std::move(slice));
+        }
+        _size += chain._size;
+        chain.Clear();
+    }
+    void Clear() {
+        _slices.clear();
+        _size = 0;
+    }
+    // 发送链首的数据, 返回发送的字节数, 0表示暂时不可写, -1表示出错
+    ssize_t WriteTo(Socket& sock) {
+        if (_slices.empty()) return 0;
+        auto& front = _slices.front();
+        if (front._file) {
+            off_t offset = static_cast<off_t>(front._offset);
+            ssize_t n = sock.SendFile(front._file->GetFd(), &offset, front._length);
+            if (n > 0) Consume(n);
+            return n;
+        }
+        // 收集连续的内存切片
+        struct iovec iov[IOV_MAX];
+        int cnt = 0;
+        for (auto it = _slices.begin(); it != _slices.end() && cnt < IOV_MAX && !it->_file; ++it) {
+            iov[cnt].iov_base = const_cast<char*>(it->Data());
+            iov[cnt].iov_len = it->_length;
+            cnt++;
+        }
+        ssize_t n = sock.Writev(iov, cnt);
+        if (n > 0) Consume(n);
+        return n;
+    }
+private:
+    std::deque<Slice> _slices;
+    std::size_t _size = 0; // 所有切片的总字节数
+};
+
 class EventLoop;
 // 事件循环，对fd进行监控
 class Channel {
@@ -248,38 +624,66 @@ public:
     void SetCloseCallback(callback_t cb) { _close_cb = std::move(cb); }
     void SetEventCallback(callback_t cb) { _event_cb = std::move(cb); }
     void SetRevents(int revents) { _revents = revents; }
+    int GetRevents() const { return _revents; }
 
     int GetFd() const { return _fd; }
     int GetEvents() const { return _events; }
+    bool IsEdgeTriggered() const { return _edge; }
     // 是否监控读事件
-    bool Readable() const { return _events & EPOLLIN; }
+    bool Readable() const { return _edge ? _want_read : (_events & EPOLLIN); }
     // 是否监控写事件
-    bool Writable() const { return _events & EPOLLOUT; }
+    bool Writable() const { return _edge ? _want_write : (_events & EPOLLOUT); }
     // 启动读事件监控
     void EnableRead() {
+        if (_edge) { _want_read = true; return; }
         _events |= EPOLLIN;
         Update();
     }
+    // 监控监听套接字的读事件; io_uring下改为提交多次触发的accept请求, 新连接随完成事件直接返回(见EventLoop::TakeAccepted)
+    void EnableAccept() {
+        _accept = true;
+        EnableRead();
+    }
+    bool IsAccept() const { return _accept; }
+    // 监控连接套接字的读事件; io_uring下改为提交多次触发的recv请求, 数据随完成事件直接追加到buf(见EventLoop::TakeReceived)
+    void EnableRecv(Buffer* buf) {
+        _recv_buf = buf;
+        EnableRead();
+    }
+    Buffer* RecvBuffer() const { return _recv_buf; }
     // 禁用读事件监控
     void DisableRead() {
+        if (_edge) { _want_read = false; return; }
         _events &= ~EPOLLIN;
         Update();
     }
     // 启动写事件监控
     void EnableWrite() {
+        if (_edge) { _want_write = true; return; }
         _events |= EPOLLOUT;
         Update();
     }
     // 禁用写事件监控
     void DisableWrite() {
+        if (_edge) { _want_write = false; return; }
         _events &= ~EPOLLOUT;
         Update();
     }
     // 禁用所有事件监控
     void DisableAll() {
+        _want_read = _want_write = false;
         _events = 0;
         Update();
     }
+    // 以边缘触发方式一次性注册读写事件, 之后读写监控的开关只修改标志, 不再调用epoll_ctl
+    // 注意: 边缘触发下重新打开读写监控时, 已经就绪的数据不会再次通知, 需要使用者自行处理
+    void EnableEdgeTrigger() {
+        _edge = true;
+        _want_read = true;
+        _want_write = false;
+        _events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        Update();
+    }
     // 更新监控
     void Update();
     // 移除监控
@@ -292,14 +696,15 @@ public:
         // EPOLLERR: 错误
         // EPOLLHUP: 对端关闭
         // EPOLLRDHUP: 对端关闭连接
+        // 边缘触发模式下读写事件总是被注册, 只处理使用者打开的那一部分
         if ((_revents & EPOLLIN) || (_revents & EPOLLPRI) || (_revents & EPOLLRDHUP)) {
-            if (_read_cb) _read_cb();
+            if (_read_cb && Readable()) _read_cb();
         }
 
         if (_revents & EPOLLERR) {
             if (_error_cb) _error_cb();
         }
-        else if (_revents & EPOLLOUT) {
+        else if ((_revents & EPOLLOUT) && Writable()) {
             if (_write_cb) _write_cb();
         }
         else if (_revents & EPOLLHUP) {
@@ -312,6 +717,11 @@ private:
     int _events; // 需要监控的事件
     int _revents; // 实际触发的事件
     EventLoop* _loop;
+    bool _edge = false; // 是否是边缘触发模式
+    bool _want_read = false; // 边缘触发模式下是否处理读事件
+    bool _want_write = false; // 边缘触发模式下是否处理写事件
+    bool _accept = false; // 是否是监听套接字
+    Buffer* _recv_buf = nullptr; // 完成方式接收时数据追加到的缓冲区
 
     callback_t _read_cb;
     callback_t _write_cb;
@@ -320,6 +730,632 @@ private:
     callback_t _event_cb; // 任意事件回调
 };
 
+// 事件监控的实现方式
+enum class PollerBackend {
+    kEpoll,
+    kIoUring, // 内核或头文件不支持时退回epoll
+};
+
+// 完成方式接收(Channel::EnableRecv)的结果, 上次取出之后的累计
+struct RecvResult {
+    size_t _bytes = 0; // 追加到缓冲区的字节数
+    bool _eof = false; // 对端关闭了连接
+    int _error = 0; // 接收失败的错误码
+};
+
+#ifdef REACTOR_HAVE_IO_URING
+// 基于io_uring的事件监控(直接使用系统调用, 不依赖liburing)
+// 每个Channel对应一个poll请求: 水平触发使用一次性的poll, 触发后在下一轮等待之前重新提交;
+// 边缘触发使用多次触发的poll, 注册后一直有效. 监控的增删改和等待合并成一次io_uring_enter,
+// 不再有epoll_ctl; 只检查一次(超时为0)且没有待提交的请求时直接读取完成队列, 不进入内核.
+// 监听套接字使用多次触发的accept(5.19+), 每个新连接一个完成事件, 不再需要就绪通知和accept4;
+// 内核不支持时退回poll. 连接套接字(Channel::EnableRecv)使用多次触发的recv(6.0+), 内核从注册的共享缓冲区环中
+// 取缓冲区接收, 完成事件中的数据拷贝到连接的输入缓冲区后立即归还, 不再需要就绪通知和recv;
+// 较大的输出通过SEND_ZC/SENDMSG_ZC零拷贝发送(见SendZeroCopy), 其余的发送仍然由Connection通过writev/sendfile完成
+class UringPoller {
+public:
+    static constexpr unsigned kSqEntries = 1024;
+    static constexpr unsigned kCqEntries = 16384;
+    static constexpr unsigned kRecvBuffers = 1024; // 共享接收缓冲区的数量(2的幂)
+    static constexpr unsigned kRecvBufferSize = 4096; // 每个共享接收缓冲区的大小
+
+    // 创建失败(内核不支持或者被禁用)时返回nullptr
+    static std::unique_ptr<UringPoller> Create() {
+        std::unique_ptr<UringPoller> poller(new UringPoller());
+        if (!poller->Setup()) return nullptr;
+        return poller;
+    }
+    ~UringPoller() {
+        if (_sqes != nullptr) munmap(_sqes, _sqes_size);
+        if (_cq_ptr != nullptr && _cq_ptr != _sq_ptr) munmap(_cq_ptr, _cq_size);
+        if (_sq_ptr != nullptr) munmap(_sq_ptr, _sq_size);
+        if (_ringfd != -1) close(_ringfd);
+        if (_buf_ring != nullptr) munmap(_buf_ring, kRecvBuffers * sizeof(struct io_uring_buf));
+        if (_recv_data != nullptr) munmap(_recv_data, static_cast<size_t>(kRecvBuffers) * kRecvBufferSize);
+        for (auto& [key, cancel] : _cancelling) {
+            for (int fd : cancel._accepted) close(fd);
+        }
+    }
+    UringPoller(const UringPoller&) = delete;
+    UringPoller& operator=(const UringPoller&) = delete;
+
+    void Update(Channel* ch) {
+        int fd = ch->GetFd();
+        auto it = _slots.find(fd);
+        if (it == _slots.end()) {
+            it = _slots.emplace(fd, Slot{ ch, ++_generation }).first;
+            it->second._id = it->second._generation;
+            it->second._accept = ch->IsAccept() && _multishot_accept;
+            it->second._recv = ch->RecvBuffer() != nullptr && _recv_ring;
+        }
+        Sync(it->second, fd);
+    }
+    void Remove(Channel* ch) {
+        auto it = _slots.find(ch->GetFd());
+        if (it == _slots.end()) return;
+        Slot& slot = it->second;
+        if (slot._armed) Disarm(slot, it->first);
+        // 撤销收发请求, 否则内核一直持有套接字, 关闭之后连接也不会断开
+        if (slot._recv_inflight) Cancel(Key(it->first, slot._id) | kRecvBit);
+        if (slot._send_inflight) Cancel(slot._send_key);
+        // 使用者没有取走的新连接(撤销accept时已经转交给撤销记录)
+        for (int fd : it->second._accepted) close(fd);
+        _slots.erase(it);
+    }
+    // 取出多次触发的accept已经接收的新连接, 返回false表示该Channel使用普通的就绪通知(需要自己accept);
+    // 正在撤销的accept请求接收的连接同样从这里取出, 撤销完成之前Channel不能销毁
+    bool TakeAccepted(Channel* ch, std::vector<int>& fds) {
+        bool multishot = false;
+        for (auto it = _cancelling.begin(); it != _cancelling.end();) {
+            CancelAccept& cancel = it->second;
+            if (cancel._ch != ch) {
+                ++it;
+                continue;
+            }
+            multishot = true;
+            fds.insert(fds.end(), cancel._accepted.begin(), cancel._accepted.end());
+            cancel._accepted.clear();
+            if (cancel._done) it = _cancelling.erase(it);
+            else ++it;
+        }
+        auto it = _slots.find(ch->GetFd());
+        if (it == _slots.end() || it->second._ch != ch) return multishot;
+        Slot& slot = it->second;
+        fds.insert(fds.end(), slot._accepted.begin(), slot._accepted.end());
+        slot._accepted.clear();
+        return multishot || slot._accept;
+    }
+    // 是否还有没有完成撤销的accept请求(之后可能还会接收新连接)
+    bool AcceptPending(Channel* ch) const {
+        for (auto& [key, cancel] : _cancelling) {
+            if (cancel._ch == ch) return true;
+        }
+        return false;
+    }
+    // 取出多次触发的recv追加到缓冲区的结果, 返回false表示该Channel使用普通的就绪通知(需要自己recv)
+    bool TakeReceived(Channel* ch, RecvResult& result) {
+        auto it = _slots.find(ch->GetFd());
+        if (it == _slots.end() || it->second._ch != ch || !it->second._recv) return false;
+        result = it->second._received;
+        it->second._received = {};
+        return true;
+    }
+    bool CanSendZeroCopy() const { return _zerocopy_send; }
+    // 提交零拷贝发送(一段数据使用SEND_ZC, 多段使用SENDMSG_ZC), 内核发出通知之前holds保持数据有效且不变;
+    // 同一个Channel同时只能有一个, 不能提交时返回false. 完成之前不再监控可写事件, 完成后通知可写事件, 结果通过TakeSent取出
+    bool SendZeroCopy(Channel* ch, std::vector<struct iovec>&& iov, std::vector<std::shared_ptr<const void>>&& holds) {
+        if (!_zerocopy_send || iov.empty()) return false;
+        int fd = ch->GetFd();
+        auto it = _slots.find(fd);
+        if (it == _slots.end() || it->second._ch != ch || it->second._send_inflight) return false;
+        Slot& slot = it->second;
+        // 每次发送使用新的标识, 上一次发送的通知事件可能在之后才到达
+        slot._send_key = Key(fd, ++_generation) | kSendBit;
+        ZeroCopySend& send = _zerocopy.emplace(slot._send_key, ZeroCopySend{ std::move(holds), std::move(iov) }).first->second;
+        struct io_uring_sqe* sqe = GetSqe();
+        sqe->fd = fd;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = slot._send_key;
+        if (send._iov.size() == 1) {
+            sqe->opcode = IORING_OP_SEND_ZC;
+            sqe->addr = reinterpret_cast<uint64_t>(send._iov[0].iov_base);
+            sqe->len = static_cast<uint32_t>(std::min<size_t>(send._iov[0].iov_len, kMaxSendSize));
+        }
+        else {
+            send._msg.msg_iov = send._iov.data();
+            send._msg.msg_iovlen = send._iov.size();
+            sqe->opcode = IORING_OP_SENDMSG_ZC;
+            sqe->addr = reinterpret_cast<uint64_t>(&send._msg);
+            sqe->len = 1;
+        }
+        slot._send_inflight = true;
+        Sync(slot, fd);
+        return true;
+    }
+    // 取出零拷贝发送的结果(发送的字节数或者-errno), 还没有完成时返回false
+    bool TakeSent(Channel* ch, ssize_t& result) {
+        result = 0;
+        auto it = _slots.find(ch->GetFd());
+        if (it == _slots.end() || it->second._ch != ch) return true;
+        if (it->second._send_inflight) return false;
+        result = std::exchange(it->second._sent, 0);
+        return true;
+    }
+    void Poll(std::vector<Channel*>& active, int timeout) {
+        // 上一轮触发的一次性请求以及结束的recv重新提交, 仍然就绪的描述符会立即完成(与水平触发一致)
+        for (int fd : _rearm) {
+            auto it = _slots.find(fd);
+            if (it != _slots.end()) Sync(it->second, fd);
+        }
+        _rearm.clear();
+        Enter(timeout);
+        Reap(active);
+    }
+private:
+    struct Slot {
+        Channel* _ch;
+        uint32_t _generation; // 每次提交新的poll请求时更新
+        uint32_t _armed_events = 0; // 已提交的请求监控的事件
+        bool _armed = false; // 是否有未完成的poll请求
+        uint64_t _round = 0; // 最近一次加入就绪列表的轮次, 同一轮的多个完成事件合并
+        bool _accept = false; // 是否使用多次触发的accept
+        std::vector<int> _accepted{}; // 已经接收但使用者还没有取走的新连接
+        uint32_t _id = 0; // 创建时的世代号, recv请求使用, 描述符复用后旧请求的完成事件通过它识别
+        bool _recv = false; // 是否使用多次触发的recv
+        bool _recv_inflight = false; // 是否有未结束的recv请求
+        bool _recv_cancelling = false; // 是否已经提交了撤销recv请求
+        RecvResult _received{}; // 使用者还没有取走的接收结果
+        bool _send_inflight = false; // 是否有未完成的零拷贝发送
+        uint64_t _send_key = 0; // 最近一次零拷贝发送的user_data
+        ssize_t _sent = 0; // 最近一次零拷贝发送的结果
+    };
+    static constexpr uint64_t kIgnored = UINT64_MAX; // 撤销请求本身的完成事件
+    // 请求类型的标记(描述符不会用到这些位), 没有标记的是poll请求
+    static constexpr uint64_t kAcceptBit = 1ULL << 62;
+    static constexpr uint64_t kRecvBit = 1ULL << 61;
+    static constexpr uint64_t kSendBit = 1ULL << 60;
+    static constexpr uint64_t kKindMask = kAcceptBit | kRecvBit | kSendBit;
+    static constexpr uint16_t kRecvGroup = 0; // 共享接收缓冲区环的组号
+    static constexpr size_t kMaxSendSize = 1U << 30; // SEND_ZC一次最多发送的字节数
+    // 内核还在引用的零拷贝发送: 数据的所有者以及sendmsg的参数(元素的地址在哈希表扩容时不变)
+    struct ZeroCopySend {
+        std::vector<std::shared_ptr<const void>> _holds;
+        std::vector<struct iovec> _iov;
+        struct msghdr _msg{};
+    };
+    // 已经提交撤销的多次触发的accept: 撤销生效之前内核仍然可能接收连接(已经从监听队列中取出),
+    // 这些连接照常交给Channel, 直到accept请求的最后一个完成事件(没有IORING_CQE_F_MORE)
+    struct CancelAccept {
+        Channel* _ch;
+        uint64_t _round = 0;
+        bool _done = false; // 已经收到最后一个完成事件
+        std::vector<int> _accepted{};
+    };
+
+    UringPoller() = default;
+    static uint64_t Key(int fd, uint32_t generation) { return (static_cast<uint64_t>(fd) << 32) | generation; }
+
+    bool Setup() {
+        struct io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER;
+        params.cq_entries = kCqEntries;
+        _ringfd = static_cast<int>(syscall(__NR_io_uring_setup, kSqEntries, &params));
+        if (_ringfd == -1 && errno == EINVAL) {
+            // 较老的内核不认识部分标志
+            params = {};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = kCqEntries;
+            _ringfd = static_cast<int>(syscall(__NR_io_uring_setup, kSqEntries, &params));
+        }
+        if (_ringfd == -1) {
+            lg(Warning, "io_uring setup failed: %s", strerror(errno));
+            return false;
+        }
+        if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+            lg(Warning, "io_uring lacks required features (0x%x)", params.features);
+            return false;
+        }
+        _sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+        void* sq = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED) return SetupFailed("mmap sq ring");
+        _sq_ptr = static_cast<char*>(sq);
+        if (single) {
+            _cq_ptr = _sq_ptr;
+        }
+        else {
+            void* cq = mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_CQ_RING);
+            if (cq == MAP_FAILED) return SetupFailed("mmap cq ring");
+            _cq_ptr = static_cast<char*>(cq);
+        }
+        _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return SetupFailed("mmap sqes");
+        _sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+        _sq_head = reinterpret_cast<unsigned*>(_sq_ptr + params.sq_off.head);
+        _sq_tail = reinterpret_cast<unsigned*>(_sq_ptr + params.sq_off.tail);
+        _sq_mask = *reinterpret_cast<unsigned*>(_sq_ptr + params.sq_off.ring_mask);
+        _sq_entries = params.sq_entries;
+        // 提交队列的下标数组固定为恒等映射, 之后只需要移动尾指针
+        unsigned* array = reinterpret_cast<unsigned*>(_sq_ptr + params.sq_off.array);
+        for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+        _cq_head = reinterpret_cast<unsigned*>(_cq_ptr + params.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned*>(_cq_ptr + params.cq_off.tail);
+        _cq_mask = *reinterpret_cast<unsigned*>(_cq_ptr + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<struct io_uring_cqe*>(_cq_ptr + params.cq_off.cqes);
+        _local_tail = *_sq_tail;
+        // 共享接收缓冲区环(5.19+)不可用时连接套接字仍然使用poll
+        _recv_ring = SetupRecvRing();
+        return true;
+    }
+    bool SetupRecvRing() {
+        size_t ring_size = kRecvBuffers * sizeof(struct io_uring_buf);
+        void* ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) return SetupFailed("mmap buffer ring");
+        // 头文件中的io_uring_buf_ring在C++下柔性数组之前多出一个空结构体, 布局与内核不同,
+        // 直接按io_uring_buf数组访问, 尾部与第一项的resv重叠
+        _buf_ring = static_cast<struct io_uring_buf*>(ring);
+        _buf_ring_tail = &_buf_ring[0].resv;
+        struct io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+        reg.ring_entries = kRecvBuffers;
+        reg.bgid = kRecvGroup;
+        if (syscall(__NR_io_uring_register, _ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+            return SetupFailed("register buffer ring");
+        }
+        void* data = mmap(nullptr, static_cast<size_t>(kRecvBuffers) * kRecvBufferSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) return SetupFailed("mmap recv buffers");
+        _recv_data = static_cast<char*>(data);
+        for (unsigned bid = 0; bid < kRecvBuffers; bid++) ProvideBuffer(bid);
+        return true;
+    }
+    // 把接收缓冲区放回共享环中, 内核之后可以再用它接收
+    void ProvideBuffer(unsigned bid) {
+        struct io_uring_buf& buf = _buf_ring[_buf_tail & (kRecvBuffers - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(_recv_data + static_cast<size_t>(bid) * kRecvBufferSize);
+        buf.len = kRecvBufferSize;
+        buf.bid = static_cast<uint16_t>(bid);
+        _buf_tail++;
+        __atomic_store_n(_buf_ring_tail, _buf_tail, __ATOMIC_RELEASE);
+    }
+    bool SetupFailed(const char* what) {
+        lg(Warning, "io_uring %s failed: %s", what, strerror(errno));
+        return false;
+    }
+    // 取一个空闲的提交项, 提交队列满时先提交
+    struct io_uring_sqe* GetSqe() {
+        while (_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+            Enter(0);
+        }
+        struct io_uring_sqe* sqe = &_sqes[_local_tail & _sq_mask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        _local_tail++;
+        return sqe;
+    }
+    // 需要poll请求监控的事件: 读取由recv请求完成, 零拷贝发送完成之前不监控可写
+    uint32_t PollEvents(const Slot& slot) const {
+        uint32_t events = static_cast<uint32_t>(slot._ch->GetEvents());
+        if (slot._recv) events &= ~static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP);
+        if (slot._send_inflight) events &= ~static_cast<uint32_t>(EPOLLOUT);
+        return events;
+    }
+    // 按Channel当前监控的事件提交或者撤销请求
+    void Sync(Slot& slot, int fd) {
+        if (slot._recv) SyncRecv(slot, fd);
+        if (slot._armed) {
+            if (slot._armed_events == PollEvents(slot)) return;
+            // 监控的事件变化时撤销原来的请求, 旧请求之后的完成事件通过世代号识别并丢弃
+            Disarm(slot, fd);
+        }
+        Arm(slot, fd);
+    }
+    // 需要读取时保持一个多次触发的recv请求, 不需要时撤销; 撤销生效之前接收的数据照常交给Channel,
+    // 请求结束(最后一个完成事件)之前不会提交新的请求, 数据不会乱序
+    void SyncRecv(Slot& slot, int fd) {
+        bool want = slot._ch->GetEvents() & EPOLLIN;
+        uint64_t key = Key(fd, slot._id) | kRecvBit;
+        if (want && !slot._recv_inflight) {
+            struct io_uring_sqe* sqe = GetSqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fd;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = kRecvGroup;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->user_data = key;
+            slot._recv_inflight = true;
+        }
+        else if (!want && slot._recv_inflight && !slot._recv_cancelling) {
+            Cancel(key);
+            slot._recv_cancelling = true;
+        }
+    }
+    void Cancel(uint64_t user_data) {
+        struct io_uring_sqe* sqe = GetSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data;
+        sqe->user_data = kIgnored;
+    }
+    void Arm(Slot& slot, int fd) {
+        uint32_t events = PollEvents(slot);
+        uint32_t mask = events & ~static_cast<uint32_t>(EPOLLET);
+        if (mask == 0) return;
+        slot._generation = ++_generation;
+        struct io_uring_sqe* sqe = GetSqe();
+        if (slot._accept) {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            sqe->user_data = Key(fd, slot._generation) | kAcceptBit;
+            slot._armed = true;
+            slot._armed_events = events;
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        // poll的事件位与epoll相同(EPOLLIN == POLLIN等)
+        sqe->poll32_events = mask;
+        if (events & EPOLLET) sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = Key(fd, slot._generation);
+        slot._armed = true;
+        slot._armed_events = events;
+    }
+    void Disarm(Slot& slot, int fd) {
+        struct io_uring_sqe* sqe = GetSqe();
+        sqe->user_data = kIgnored;
+        if (!slot._accept) {
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = Key(fd, slot._generation);
+            slot._armed = false;
+            slot._generation = ++_generation;
+            return;
+        }
+        uint64_t key = Key(fd, slot._generation) | kAcceptBit;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = key;
+        CancelAccept& cancel = _cancelling.emplace(key, CancelAccept{ slot._ch }).first->second;
+        cancel._accepted.swap(slot._accepted);
+        slot._armed = false;
+        slot._generation = ++_generation;
+        // 立即提交, 减少撤销生效之前接收的连接
+        Enter(0);
+    }
+    // 提交所有待提交的请求, timeout不为0且完成队列为空时等待(毫秒, -1表示一直等待)
+    void Enter(int timeout) {
+        __atomic_store_n(_sq_tail, _local_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = _local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+        bool wait = timeout != 0 && *_cq_head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        if (to_submit == 0 && !wait) return;
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        struct __kernel_timespec ts{};
+        struct io_uring_getevents_arg arg{};
+        void* argp = nullptr;
+        size_t argsz = 0;
+        if (wait && timeout > 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = static_cast<long long>(timeout % 1000) * 1000000;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+        long ret = syscall(__NR_io_uring_enter, _ringfd, to_submit, wait ? 1 : 0, flags, argp, argsz);
+        if (ret == -1) {
+            // 被信号中断、等待超时或者完成队列溢出时直接处理已有的完成事件
+            if (errno == EINTR || errno == ETIME || errno == EAGAIN || errno == EBUSY) return;
+            lg(Error, "io_uring enter failed: %s", strerror(errno));
+            throw std::runtime_error("io_uring enter failed");
+        }
+    }
+    // 取出完成事件, 设置就绪的Channel
+    void Reap(std::vector<Channel*>& active) {
+        _round++;
+        unsigned head = *_cq_head;
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe& cqe = _cqes[head & _cq_mask];
+            if (cqe.user_data == kIgnored) continue;
+            uint64_t kind = cqe.user_data & kKindMask;
+            uint64_t key = cqe.user_data & ~kKindMask;
+            int fd = static_cast<int>(key >> 32);
+            if (kind == kRecvBit) {
+                ReapRecv(fd, static_cast<uint32_t>(key), cqe, active);
+                continue;
+            }
+            if (kind == kSendBit) {
+                ReapSend(fd, cqe, active);
+                continue;
+            }
+            bool accept = kind == kAcceptBit;
+            if (accept) {
+                auto cit = _cancelling.find(cqe.user_data);
+                if (cit != _cancelling.end()) {
+                    ReapCancelled(cit, cqe, active);
+                    continue;
+                }
+            }
+            auto it = _slots.find(fd);
+            // 已经移除或者已经重新提交的请求
+            if (it == _slots.end() || it->second._generation != static_cast<uint32_t>(key)) {
+                if (accept && cqe.res >= 0) close(cqe.res);
+                continue;
+            }
+            Slot& slot = it->second;
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                slot._armed = false;
+                _rearm.push_back(fd);
+            }
+            if (cqe.res == -ECANCELED) continue;
+            int revents = cqe.res;
+            if (accept) {
+                if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+                    // 内核不支持多次触发的accept, 之后的监听套接字都使用poll
+                    lg(Warning, "io_uring multishot accept unsupported, falling back to poll");
+                    _multishot_accept = false;
+                    slot._accept = false;
+                    continue;
+                }
+                if (cqe.res < 0) {
+                    lg(Error, "io_uring accept failed: %s", strerror(-cqe.res));
+                    continue;
+                }
+                slot._accepted.push_back(cqe.res);
+                revents = EPOLLIN;
+            }
+            else if (revents < 0) {
+                lg(Error, "io_uring poll failed: %s", strerror(-revents));
+                revents = EPOLLERR;
+            }
+            Activate(slot, revents, active);
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    }
+    // 同一轮的多个完成事件合并成一次就绪通知
+    void Activate(Slot& slot, int revents, std::vector<Channel*>& active) {
+        if (slot._round == _round) {
+            slot._ch->SetRevents(slot._ch->GetRevents() | revents);
+            return;
+        }
+        slot._round = _round;
+        slot._ch->SetRevents(revents);
+        active.push_back(slot._ch);
+    }
+    // recv请求的完成事件: 数据拷贝到Channel的缓冲区, 共享接收缓冲区随即归还; 已经移除的连接的数据直接丢弃
+    void ReapRecv(int fd, uint32_t id, const struct io_uring_cqe& cqe, std::vector<Channel*>& active) {
+        bool buffered = cqe.flags & IORING_CQE_F_BUFFER;
+        unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        auto it = _slots.find(fd);
+        if (it != _slots.end() && it->second._recv && it->second._id == id) {
+            const char* data = buffered ? _recv_data + static_cast<size_t>(bid) * kRecvBufferSize : nullptr;
+            Received(it->second, fd, cqe, data, active);
+        }
+        if (buffered) ProvideBuffer(bid);
+    }
+    void Received(Slot& slot, int fd, const struct io_uring_cqe& cqe, const char* data, std::vector<Channel*>& active) {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            slot._recv_inflight = false;
+            slot._recv_cancelling = false;
+            // 内核提前结束、撤销或者共享缓冲区用完时, 仍然需要读取就在下一轮等待之前重新提交
+            if (cqe.res > 0 || cqe.res == -ECANCELED || cqe.res == -ENOBUFS) _rearm.push_back(fd);
+        }
+        if (cqe.res > 0) {
+            // 使用共享缓冲区接收时完成事件总是带有缓冲区编号
+            if (data != nullptr) slot._ch->RecvBuffer()->Write(data, cqe.res);
+            slot._received._bytes += cqe.res;
+        }
+        else if (cqe.res == 0) {
+            slot._received._eof = true;
+        }
+        else if (cqe.res == -ECANCELED || cqe.res == -ENOBUFS) {
+            return;
+        }
+        else if (cqe.res == -EINVAL && slot._received._bytes == 0) {
+            // 内核不支持多次触发的recv, 之后的连接套接字都使用poll
+            lg(Warning, "io_uring multishot recv unsupported, falling back to poll");
+            _recv_ring = false;
+            slot._recv = false;
+            _rearm.push_back(fd);
+            return;
+        }
+        else {
+            slot._received._error = -cqe.res;
+        }
+        Activate(slot, EPOLLIN, active);
+    }
+    // 零拷贝发送的完成事件: 第一个返回发送的字节数, 内核不再引用数据之后还有一个通知事件(IORING_CQE_F_NOTIF)
+    void ReapSend(int fd, const struct io_uring_cqe& cqe, std::vector<Channel*>& active) {
+        // 收到通知事件, 或者没有通知事件(失败)时释放数据
+        if ((cqe.flags & IORING_CQE_F_NOTIF) || !(cqe.flags & IORING_CQE_F_MORE)) _zerocopy.erase(cqe.user_data);
+        if (cqe.flags & IORING_CQE_F_NOTIF) return;
+        auto it = _slots.find(fd);
+        if (it == _slots.end() || !it->second._send_inflight || it->second._send_key != cqe.user_data) return;
+        Slot& slot = it->second;
+        slot._send_inflight = false;
+        slot._sent = cqe.res;
+        if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+            // 内核或者套接字不支持零拷贝发送, 使用者照常发送
+            lg(Warning, "io_uring zero-copy send unsupported, falling back to writev");
+            _zerocopy_send = false;
+            slot._sent = 0;
+        }
+        // 重新监控可写事件
+        _rearm.push_back(fd);
+        Activate(slot, EPOLLOUT, active);
+    }
+    // 正在撤销的accept请求的完成事件, 接收的连接交给原来的Channel
+    void ReapCancelled(std::unordered_map<uint64_t, CancelAccept>::iterator it, const struct io_uring_cqe& cqe,
+        std::vector<Channel*>& active) {
+        CancelAccept& cancel = it->second;
+        if (!(cqe.flags & IORING_CQE_F_MORE)) cancel._done = true;
+        if (cqe.res >= 0) cancel._accepted.push_back(cqe.res);
+        // 最后一个完成事件也通知Channel, 使用者据此知道撤销已经完成(见AcceptPending)
+        else if (!cancel._done) return;
+        if (cancel._round == _round) {
+            cancel._ch->SetRevents(cancel._ch->GetRevents() | EPOLLIN);
+            return;
+        }
+        cancel._round = _round;
+        cancel._ch->SetRevents(EPOLLIN);
+        active.push_back(cancel._ch);
+    }
+private:
+    int _ringfd = -1;
+    char* _sq_ptr = nullptr;
+    char* _cq_ptr = nullptr;
+    size_t _sq_size = 0;
+    size_t _cq_size = 0;
+    struct io_uring_sqe* _sqes = nullptr;
+    size_t _sqes_size = 0;
+    unsigned* _sq_head = nullptr;
+    unsigned* _sq_tail = nullptr;
+    unsigned _sq_mask = 0;
+    unsigned _sq_entries = 0;
+    unsigned _local_tail = 0; // 已经填写的提交项的尾部, 提交时才写回共享的尾指针
+    unsigned* _cq_head = nullptr;
+    unsigned* _cq_tail = nullptr;
+    unsigned _cq_mask = 0;
+    struct io_uring_cqe* _cqes = nullptr;
+    uint32_t _generation = 0;
+    uint64_t _round = 0;
+    bool _multishot_accept = true; // 第一次失败后不再使用多次触发的accept
+    bool _recv_ring = false; // 是否使用共享接收缓冲区环和多次触发的recv
+    bool _zerocopy_send = true; // 第一次失败后不再使用零拷贝发送
+    struct io_uring_buf* _buf_ring = nullptr; // 共享接收缓冲区环
+    uint16_t* _buf_ring_tail = nullptr;
+    char* _recv_data = nullptr; // 共享接收缓冲区, 按编号连续存放
+    uint16_t _buf_tail = 0; // 共享环的尾部
+    std::unordered_map<int, Slot> _slots;
+    std::unordered_map<uint64_t, CancelAccept> _cancelling; // 按accept请求的user_data索引
+    std::unordered_map<uint64_t, ZeroCopySend> _zerocopy; // 按user_data索引
+    std::vector<int> _rearm; // 一次性请求已经完成、需要重新提交的描述符
+};
+#else
+// 不支持io_uring时的占位, Create总是失败
+class UringPoller {
+public:
+    static std::unique_ptr<UringPoller> Create() {
+        lg(Warning, "io_uring is not available in this build");
+        return nullptr;
+    }
+    void Update(Channel*) {}
+    void Remove(Channel*) {}
+    bool TakeAccepted(Channel*, std::vector<int>&) { return false; }
+    bool AcceptPending(Channel*) const { return false; }
+    bool TakeReceived(Channel*, RecvResult&) { return false; }
+    bool CanSendZeroCopy() const { return false; }
+    bool SendZeroCopy(Channel*, std::vector<struct iovec>&&, std::vector<std::shared_ptr<const void>>&&) { return false; }
+    bool TakeSent(Channel*, ssize_t& result) {
+        result = 0;
+        return true;
+    }
+    void Poll(std::vector<Channel*>&, int) {}
+};
+#endif
+
 class Poller {
 private:
     void EpollOp(int op, Channel* ch) {
@@ -334,17 +1370,29 @@ private:
     }
     bool HasChannel(int fd) const { return _channels.find(fd) != _channels.end(); }
 public:
-    // 创建epoll
+    // 创建epoll, 选择io_uring但是不可用时同样使用epoll
     // EPOLL_CLOEXEC: 进程执行exec时关闭文件描述符
-    Poller() : _epollfd(epoll_create1(EPOLL_CLOEXEC)), _events(1024) {
+    explicit Poller(PollerBackend backend = PollerBackend::kEpoll) {
+        if (backend == PollerBackend::kIoUring) {
+            _uring = UringPoller::Create();
+            if (_uring) return;
+            lg(Warning, "io_uring unavailable, falling back to epoll");
+        }
+        _epollfd = epoll_create1(EPOLL_CLOEXEC);
+        _events.resize(1024);
         if (_epollfd == -1) {
             lg(Error, "create epoll failed");
             throw std::runtime_error("create epoll failed");
         }
     }
-    ~Poller() { close(_epollfd); }
+    ~Poller() {
+        if (_epollfd != -1) close(_epollfd);
+    }
+    // 实际使用的实现方式
+    PollerBackend Backend() const { return _uring ? PollerBackend::kIoUring : PollerBackend::kEpoll; }
 
     void Update(Channel* ch) {
+        if (_uring) return _uring->Update(ch);
         if (HasChannel(ch->GetFd())) {
             EpollOp(EPOLL_CTL_MOD, ch);
         }
@@ -355,6 +1403,7 @@ public:
     }
 
     void Remove(Channel* ch) {
+        if (_uring) return _uring->Remove(ch);
         auto it = _channels.find(ch->GetFd());
         if (it != _channels.end()) {
             EpollOp(EPOLL_CTL_DEL, ch);
@@ -362,8 +1411,27 @@ public:
         }
     }
 
+    // 取出io_uring多次触发的accept接收的新连接, epoll下总是返回false, 由使用者自己accept
+    bool TakeAccepted(Channel* ch, std::vector<int>& fds) {
+        if (_uring) return _uring->TakeAccepted(ch, fds);
+        return false;
+    }
+    bool AcceptPending(Channel* ch) const { return _uring && _uring->AcceptPending(ch); }
+    // 取出io_uring多次触发的recv的结果, epoll下总是返回false, 由使用者自己recv
+    bool TakeReceived(Channel* ch, RecvResult& result) { return _uring && _uring->TakeReceived(ch, result); }
+    // 零拷贝发送只在io_uring下可用
+    bool CanSendZeroCopy() const { return _uring && _uring->CanSendZeroCopy(); }
+    bool SendZeroCopy(Channel* ch, std::vector<struct iovec>&& iov, std::vector<std::shared_ptr<const void>>&& holds) {
+        return _uring && _uring->SendZeroCopy(ch, std::move(iov), std::move(holds));
+    }
+    bool TakeSent(Channel* ch, ssize_t& result) {
+        if (_uring) return _uring->TakeSent(ch, result);
+        result = 0;
+        return true;
+    }
     // 开始监控
     void Poll(std::vector<Channel*>& active, int timeout = -1) {
+        if (_uring) return _uring->Poll(active, timeout);
         int n = epoll_wait(_epollfd, _events.data(), _events.size(), timeout);
         if (n == -1) {
             if (errno == EINTR) {
@@ -386,38 +1454,189 @@ public:
         }
     }
 private:
-    int _epollfd;
+    int _epollfd = -1;
     std::vector<struct epoll_event> _events;
     std::unordered_map<int, Channel*> _channels;
+    std::unique_ptr<UringPoller> _uring; // 使用io_uring时不为空
 };
 
-class TimerTask {
+class TimerWheel;
+// 定时器链表节点
+struct TimerLink {
+    TimerLink* _prev = nullptr;
+    TimerLink* _next = nullptr;
+};
+// 侵入式定时器节点, 可以直接嵌入到使用者的对象中
+// 添加、刷新、删除都只是链表操作, 不分配内存, 所有操作必须在所属事件循环线程中进行
+class TimerNode : private TimerLink {
 public:
     using TaskFunc = std::function<void()>;
-    using ReleaseFunc = std::function<void()>;
 
-    TimerTask(uint64_t timeout, TaskFunc task) : _timeout(timeout), _task(std::move(task)) {}
-    void SetRelease(const ReleaseFunc& release) { _release = release; }
-    void Cancel() { _canceled = true; }
+    TimerNode() = default;
+    explicit TimerNode(TaskFunc task) : _task(std::move(task)) {}
+    ~TimerNode() { Unlink(); }
+    TimerNode(const TimerNode&) = delete;
+    TimerNode& operator=(const TimerNode&) = delete;
+
+    void SetTask(TaskFunc task) { _task = std::move(task); }
+    // 是否在时间轮中等待超时
+    bool IsLinked() const { return _wheel != nullptr; }
     uint64_t Timeout() const { return _timeout; }
-    ~TimerTask() { if (!_canceled) _task(); _release(); }
 private:
-    uint64_t _timeout; // 任务的超时时间
+    friend class TimerWheel;
+    inline void Unlink();
+
+    TimerWheel* _wheel = nullptr; // 所在的时间轮
+    uint64_t _expire = 0; // 到期的时间刻度(毫秒)
+    uint64_t _timeout = 0; // 超时时间(毫秒)
     TaskFunc _task; // 任务的回调函数
-    ReleaseFunc _release; // 任务的释放函数(释放TimerWheel中的任务对象)
-    bool _canceled = false; // 任务是否被取消
 };
 
+// 多级哈希时间轮, 刻度为1毫秒
+// 第0级256个槽, 每个槽1毫秒; 之上4级各64个槽, 每级的一个槽覆盖下一级的一整圈, 最大超时约49天
+// 只在最近的到期时刻(或者需要把上级的定时器下放时)唤醒, 空闲时不会产生定时器事件
 class TimerWheel {
 private:
-    using TaskPtr = std::shared_ptr<TimerTask>;
-    using TaskWeakPtr = std::weak_ptr<TimerTask>;
+    static constexpr int kNearBits = 8;
+    static constexpr int kLevelBits = 6;
+    static constexpr int kLevels = 4;
+    static constexpr uint64_t kNearSize = 1ULL << kNearBits;
+    static constexpr uint64_t kLevelSize = 1ULL << kLevelBits;
+    static constexpr uint64_t kNearMask = kNearSize - 1;
+    static constexpr uint64_t kLevelMask = kLevelSize - 1;
+    static constexpr uint64_t kMaxSpan = 1ULL << (kNearBits + kLevels * kLevelBits);
+    static constexpr uint64_t kNotArmed = UINT64_MAX;
+
+    // 按id管理的定时任务(由时间轮持有)
+    struct IdTask {
+        TimerNode _node;
+        TimerNode::TaskFunc _task;
+    };
 
-    void Tick() {
-        // 时间轮的指针向前移动
-        _tick = (_tick + 1) % _wheelSize;
-        // 执行当前时间轮上的任务
-        _wheel[_tick].clear();
+    static uint64_t MonotonicMs() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+    uint64_t NowTick() const { return MonotonicMs() - _base_ms; }
+
+    static void InitList(TimerLink* head) { head->_prev = head->_next = head; }
+    static bool ListEmpty(const TimerLink* head) { return head->_next == head; }
+    static void PushBack(TimerLink* head, TimerLink* link) {
+        link->_prev = head->_prev;
+        link->_next = head;
+        head->_prev->_next = link;
+        head->_prev = link;
+    }
+    // 把src链表整体移动到dst(dst必须为空)
+    static void Splice(TimerLink* src, TimerLink* dst) {
+        if (ListEmpty(src)) return;
+        dst->_next = src->_next;
+        dst->_prev = src->_prev;
+        dst->_next->_prev = dst;
+        dst->_prev->_next = dst;
+        InitList(src);
+    }
+
+    // 根据到期时刻把节点挂到对应的槽上
+    void Place(TimerNode* node) {
+        uint64_t expire = std::max(node->_expire, _current);
+        uint64_t delta = expire - _current;
+        if (delta >= kMaxSpan) {
+            // 超出最大范围的先挂在最高级, 下放时会按真实到期时刻重新计算
+            expire = _current + kMaxSpan - 1;
+            delta = kMaxSpan - 1;
+        }
+        TimerLink* head;
+        if (delta < kNearSize) {
+            head = &_near[expire & kNearMask];
+        }
+        else {
+            int level = 0;
+            while (delta >= (1ULL << (kNearBits + (level + 1) * kLevelBits))) level++;
+            head = &_levels[level][(expire >> (kNearBits + level * kLevelBits)) & kLevelMask];
+        }
+        PushBack(head, node);
+        node->_wheel = this;
+        _size++;
+        // 比当前设置的唤醒时刻更早, 提前唤醒
+        uint64_t wake = delta < kNearSize ? expire : NextCascadeTick();
+        if (wake < _armed_tick) Arm(wake);
+    }
+    // 下一次第0级转完一圈(需要下放上级定时器)的时刻
+    uint64_t NextCascadeTick() const { return (_current + kNearMask) & ~kNearMask; }
+    // 把上级某个槽中的定时器重新放置到更低的级别
+    void Cascade(int level, uint64_t index) {
+        TimerLink list;
+        InitList(&list);
+        Splice(&_levels[level][index], &list);
+        while (!ListEmpty(&list)) {
+            auto* node = static_cast<TimerNode*>(list._next);
+            node->Unlink();
+            Place(node);
+        }
+    }
+    // 处理到now为止的所有刻度
+    void Advance(uint64_t now) {
+        while (_current <= now) {
+            uint64_t index = _current & kNearMask;
+            if (index == 0) {
+                for (int level = 0; level < kLevels; level++) {
+                    uint64_t idx = (_current >> (kNearBits + level * kLevelBits)) & kLevelMask;
+                    Cascade(level, idx);
+                    if (idx != 0) break;
+                }
+            }
+            // 先移动刻度再执行任务, 任务中新增的定时器不会落到正在处理的槽中
+            _current++;
+            TimerLink expired;
+            InitList(&expired);
+            Splice(&_near[index], &expired);
+            while (!ListEmpty(&expired)) {
+                auto* node = static_cast<TimerNode*>(expired._next);
+                node->Unlink();
+                if (node->_task) node->_task();
+            }
+        }
+    }
+    // 设置timerfd在指定刻度到期, 使用绝对时间
+    void Arm(uint64_t tick) {
+        _armed_tick = tick;
+        struct itimerspec ts{};
+        uint64_t ms = _base_ms + tick;
+        ts.it_value.tv_sec = static_cast<time_t>(ms / 1000);
+        ts.it_value.tv_nsec = static_cast<long>(ms % 1000) * 1000000;
+        if (timerfd_settime(_timerfd, TFD_TIMER_ABSTIME, &ts, nullptr) == -1) {
+            lg(Error, "set timerfd failed: %s", strerror(errno));
+        }
+    }
+    // 根据时间轮中剩余的定时器重新设置唤醒时刻
+    void Rearm() {
+        _armed_tick = kNotArmed;
+        if (_size == 0) {
+            struct itimerspec ts{};
+            timerfd_settime(_timerfd, 0, &ts, nullptr);
+            return;
+        }
+        bool upper = false;
+        for (auto& level : _levels) {
+            for (auto& head : level) {
+                if (!ListEmpty(&head)) {
+                    upper = true;
+                    break;
+                }
+            }
+            if (upper) break;
+        }
+        uint64_t cascade = NextCascadeTick();
+        for (uint64_t tick = _current; tick < _current + kNearSize; tick++) {
+            if (upper && tick == cascade) break;
+            if (!ListEmpty(&_near[tick & kNearMask])) {
+                Arm(tick);
+                return;
+            }
+        }
+        Arm(upper ? cascade : _current + kNearSize);
     }
     void OnTime() {
         uint64_t res;
@@ -429,61 +1648,88 @@ private:
                 throw std::runtime_error("read timerfd failed");
             }
         }
-        while (res--) {
-            Tick();
+        uint64_t now = NowTick();
+        if (_size == 0) {
+            // 没有定时器时不需要逐个刻度追赶
+            _current = std::max(_current, now + 1);
+        }
+        else {
+            Advance(now);
         }
+        Rearm();
     }
-    void _addTask(uint64_t id, uint64_t timeout, const TimerTask::TaskFunc& task) {
-        TaskPtr pt(new TimerTask(timeout, task));
-        pt->SetRelease([this, id]() {
-            _taskMap.erase(id);
-            });
-        _taskMap[id] = TaskWeakPtr(pt);
-        _wheel[(_tick + timeout) % _wheelSize].push_back(pt);
+
+    void _addTask(uint64_t id, uint64_t timeout, const TimerNode::TaskFunc& task) {
+        _removeTask(id);
+        auto* pt = new IdTask;
+        pt->_task = task;
+        pt->_node.SetTask([this, id] { FireTask(id); });
+        _taskMap[id] = pt;
+        Add(&pt->_node, timeout * 1000);
     }
     void _refreshTask(uint64_t id) {
-        // 通过id找到任务对象, 构造一个新的任务对象, 添加到时间轮中
         auto it = _taskMap.find(id);
-        if (it != _taskMap.end()) {
-            TaskPtr pt = it->second.lock();
-            if (pt) _wheel[(_tick + pt->Timeout()) % _wheelSize].push_back(pt);
-        }
+        if (it != _taskMap.end()) Refresh(&it->second->_node);
     }
     void _removeTask(uint64_t id) {
         auto it = _taskMap.find(id);
         if (it != _taskMap.end()) {
-            TaskPtr pt = it->second.lock();
-            if (pt) pt->Cancel();
-            _taskMap.erase(id);
+            delete it->second;
+            _taskMap.erase(it);
         }
     }
+    void FireTask(uint64_t id) {
+        auto it = _taskMap.find(id);
+        if (it == _taskMap.end()) return;
+        IdTask* pt = it->second;
+        // 执行之前从映射中移除, 任务中删除或者重新添加同一个id都不会影响到它
+        _taskMap.erase(it);
+        pt->_task();
+        delete pt;
+    }
 public:
     explicit TimerWheel(EventLoop* loop)
-        : _tick(0)
-        , _wheelSize(60)
+        : _base_ms(MonotonicMs())
+        , _current(0)
+        , _armed_tick(kNotArmed)
         , _timerfd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
         , _loop(loop)
         , _timerch(new Channel(_timerfd, loop)) {
-        _wheel.resize(_wheelSize);
+        for (auto& head : _near) InitList(&head);
+        for (auto& level : _levels) {
+            for (auto& head : level) InitList(&head);
+        }
         // 创建定时器
         if (_timerfd == -1) {
             lg(Fatal, "create timerfd failed");
             throw std::runtime_error("create timerfd failed");
         }
-        struct itimerspec ts{};
-        ts.it_interval.tv_sec = 1;
-        ts.it_interval.tv_nsec = 0;
-        ts.it_value.tv_sec = 1;
-        ts.it_value.tv_nsec = 0;
-        timerfd_settime(_timerfd, 0, &ts, nullptr);
         // 创建定时器事件
         _timerch->SetReadCallback([this] { OnTime(); });
         _timerch->EnableRead();
     }
-    ~TimerWheel() { close(_timerfd); }
+    ~TimerWheel() {
+        for (auto& [id, pt] : _taskMap) delete pt;
+        close(_timerfd);
+    }
+
+    // 添加(或重新设置)侵入式定时器, 超时时间单位为毫秒, 必须在事件循环线程中调用
+    void Add(TimerNode* node, uint64_t timeout_ms) {
+        node->Unlink();
+        // 时间轮为空时刻度可能已经落后很久, 直接追到当前时刻
+        uint64_t now = NowTick();
+        if (_size == 0 && now > _current) _current = now;
+        node->_timeout = std::max<uint64_t>(timeout_ms, 1);
+        node->_expire = now + node->_timeout;
+        Place(node);
+    }
+    // 按原超时时间重新计时, O(1)重新链接
+    void Refresh(TimerNode* node) { Add(node, node->_timeout); }
+    // 取消定时器
+    void Cancel(TimerNode* node) { node->Unlink(); }
 
-    // 添加任务, 需要考虑线程安全
-    void AddTask(uint64_t id, uint64_t timeout, const TimerTask::TaskFunc& task);
+    // 添加任务(超时时间单位为秒), 需要考虑线程安全
+    void AddTask(uint64_t id, uint64_t timeout, const TimerNode::TaskFunc& task);
     // 刷新任务
     void RefreshTask(uint64_t id);
     // 删除任务
@@ -491,57 +1737,300 @@ public:
     // 是否有任务
     bool HasTask(uint64_t id) const { return _taskMap.find(id) != _taskMap.end(); }
 private:
-    std::vector<std::vector<TaskPtr>> _wheel; // 时间轮
-    std::unordered_map<uint64_t, TaskWeakPtr> _taskMap; // 任务对象的映射
-    size_t _tick; // 当前时间轮的索引
-    size_t _wheelSize; // 时间轮的大小(最大超时时间)
+    friend class TimerNode;
+
+    TimerLink _near[kNearSize]; // 第0级
+    TimerLink _levels[kLevels][kLevelSize]; // 上级
+    size_t _size = 0; // 定时器数量
+    uint64_t _base_ms; // 刻度0对应的单调时钟时间
+    uint64_t _current; // 下一个要处理的刻度
+    uint64_t _armed_tick; // timerfd设置的到期刻度
+    std::unordered_map<uint64_t, IdTask*> _taskMap; // 任务对象的映射
     int _timerfd; // 定时器fd
     EventLoop* _loop; // 事件循环
     std::unique_ptr<Channel> _timerch; // 定时器事件
 };
 
-class EventLoop {
+void TimerNode::Unlink() {
+    if (_wheel == nullptr) return;
+    _prev->_next = _next;
+    _next->_prev = _prev;
+    _prev = _next = nullptr;
+    _wheel->_size--;
+    _wheel = nullptr;
+}
+
+// 类型擦除的任务, 较小的可调用对象直接存放在内部空间中, 不需要堆分配
+class Task {
 public:
-    using callback_t = std::function<void()>;
+    static constexpr std::size_t kInlineSize = 64;
 
-    EventLoop()
-        : _eventfd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
-        , _tid(std::this_thread::get_id())
-        , _eventch(new Channel(_eventfd, this))
-        , _timerWheel(this) {
-        if (_eventfd == -1) {
-            lg(Fatal, "create eventfd failed");
-            throw std::runtime_error("create eventfd failed");
+    Task() = default;
+    template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f) { Init<std::decay_t<F>>(std::forward<F>(f)); }
+    Task(Task&& other) noexcept { MoveFrom(other); }
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
         }
-        _eventch->SetReadCallback([this] { ReadEventfd(); });
-        _eventch->EnableRead();
-    }
-    ~EventLoop() {
-        delete _eventch;
-        close(_eventfd);
+        return *this;
     }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { Reset(); }
 
-    // 判断将要执行的任务是否在当前线程中, 是则执行, 否则放入队列中
-    void RunInLoop(const callback_t& cb) {
-        if (IsInLoopThread()) cb();
-        else QueueInLoop(cb);
-    }
-    // 压入任务池
-    void QueueInLoop(const callback_t& cb) {
-        {
-            std::lock_guard<std::mutex> lock(_mutex);
-            _pending.push(cb);
+    void operator()() { _ops->_invoke(_storage); }
+    explicit operator bool() const { return _ops != nullptr; }
+private:
+    struct Ops {
+        void (*_invoke)(void*);
+        void (*_move)(void* dst, void* src); // 移动构造到dst并析构src
+        void (*_destroy)(void*);
+    };
+    template <class F>
+    static constexpr bool kInline = sizeof(F) <= kInlineSize && alignof(F) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible_v<F>;
+
+    template <class F>
+    static const Ops* InlineOps() {
+        static const Ops ops = {
+            [](void* p) { (*static_cast<F*>(p))(); },
+            [](void* dst, void* src) {
+                new (dst) F(std::move(*static_cast<F*>(src)));
+                static_cast<F*>(src)->~F();
+            },
+            [](void* p) { static_cast<F*>(p)->~F(); },
+        };
+        return &ops;
+    }
+    template <class F>
+    static const Ops* HeapOps() {
+        static const Ops ops = {
+            [](void* p) { (**static_cast<F**>(p))(); },
+            [](void* dst, void* src) { *static_cast<F**>(dst) = *static_cast<F**>(src); },
+            [](void* p) { delete *static_cast<F**>(p); },
+        };
+        return &ops;
+    }
+    template <class F, class Arg>
+    void Init(Arg&& f) {
+        if constexpr (kInline<F>) {
+            new (_storage) F(std::forward<Arg>(f));
+            _ops = InlineOps<F>();
         }
-        Wakeup();
-    }
+        else {
+            *reinterpret_cast<F**>(_storage) = new F(std::forward<Arg>(f));
+            _ops = HeapOps<F>();
+        }
+    }
+    void MoveFrom(Task& other) {
+        if (other._ops) {
+            other._ops->_move(_storage, other._storage);
+            _ops = other._ops;
+            other._ops = nullptr;
+        }
+    }
+    void Reset() {
+        if (_ops) {
+            _ops->_destroy(_storage);
+            _ops = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char _storage[kInlineSize];
+    const Ops* _ops = nullptr;
+};
+
+// 无锁多生产者单消费者任务队列(Vyukov侵入式MPSC队列)
+// 任意线程都可以Push, 只有事件循环线程Pop
+// 节点循环使用: 消费者取出任务后把节点压入队列的归还栈, 生产者把归还栈整个取到线程本地的缓存中再逐个使用,
+// 稳定状态下Push不分配内存(任务本身不超过Task的内部空间时)
+class TaskQueue {
+private:
+    struct Node {
+        std::atomic<Node*> _next{nullptr};
+        Task _task;
+    };
+    // 生产者线程本地的空闲节点, 节点与队列无关, 可以用于任意队列; 线程退出时释放
+    class NodeCache {
+    public:
+        static NodeCache* Local() {
+            if (Destroyed()) return nullptr;
+            thread_local NodeCache cache;
+            return &cache;
+        }
+        Node* _nodes = nullptr; // 通过_next链接
+    private:
+        NodeCache() = default;
+        ~NodeCache() {
+            DeleteList(_nodes);
+            Destroyed() = true;
+        }
+        static bool& Destroyed() {
+            thread_local bool destroyed = false;
+            return destroyed;
+        }
+    };
+    static void DeleteList(Node* node) {
+        while (node != nullptr) {
+            Node* next = node->_next.load(std::memory_order_relaxed);
+            delete node;
+            node = next;
+        }
+    }
+    Node* AllocNode() {
+        NodeCache* cache = NodeCache::Local();
+        if (cache == nullptr) return new Node;
+        // 本地缓存用完时取走消费者归还的所有节点
+        if (cache->_nodes == nullptr) cache->_nodes = _free.exchange(nullptr, std::memory_order_acquire);
+        Node* node = cache->_nodes;
+        if (node == nullptr) return new Node;
+        cache->_nodes = node->_next.load(std::memory_order_relaxed);
+        return node;
+    }
+    // 只有消费者入栈, 生产者只能整个取走, 不会出现ABA问题
+    void FreeNode(Node* node) {
+        Node* head = _free.load(std::memory_order_relaxed);
+        do {
+            node->_next.store(head, std::memory_order_relaxed);
+        } while (!_free.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+    }
+    void PushNode(Node* node) {
+        node->_next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = _head.exchange(node, std::memory_order_acq_rel);
+        prev->_next.store(node, std::memory_order_release);
+    }
+    // 取出节点中的任务并归还节点
+    bool Take(Node* node, Task& out) {
+        out = std::move(node->_task);
+        FreeNode(node);
+        return true;
+    }
+public:
+    TaskQueue() : _head(&_stub), _tail(&_stub) {}
+    ~TaskQueue() {
+        Task task;
+        while (Pop(task)) {}
+        DeleteList(_free.load(std::memory_order_acquire));
+    }
+    TaskQueue(const TaskQueue&) = delete;
+    TaskQueue& operator=(const TaskQueue&) = delete;
+
+    void Push(Task&& task) {
+        Node* node = AllocNode();
+        node->_task = std::move(task);
+        PushNode(node);
+    }
+    // 取出一个任务, 队列为空或者生产者还未完成链接时返回false
+    bool Pop(Task& out) {
+        Node* tail = _tail;
+        Node* next = tail->_next.load(std::memory_order_acquire);
+        if (tail == &_stub) {
+            if (next == nullptr) return false;
+            _tail = next;
+            tail = next;
+            next = next->_next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            _tail = next;
+            return Take(tail, out);
+        }
+        if (tail != _head.load(std::memory_order_acquire)) return false;
+        // 队列中只剩最后一个节点, 放回哨兵节点后才能取出它
+        PushNode(&_stub);
+        next = tail->_next.load(std::memory_order_acquire);
+        if (next) {
+            _tail = next;
+            return Take(tail, out);
+        }
+        return false;
+    }
+private:
+    alignas(64) std::atomic<Node*> _head; // 生产者端
+    alignas(64) Node* _tail; // 消费者端
+    std::atomic<Node*> _free{ nullptr }; // 消费者归还的节点, 与_tail在同一缓存行, 生产者只在本地缓存用完时访问
+    Node _stub; // 哨兵节点
+};
+
+// co_await loop->Sleep(ms)的等待体, 定时器节点就在协程帧中, 不分配内存
+class SleepAwaiter {
+public:
+    SleepAwaiter(EventLoop* loop, uint64_t ms) : _loop(loop), _ms(ms) {}
+    bool await_ready() const noexcept { return false; }
+    inline void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const noexcept {}
+private:
+    EventLoop* _loop;
+    uint64_t _ms;
+    TimerNode _node; // 协程帧销毁时随之从时间轮中摘除
+};
+
+class EventLoop {
+public:
+    using callback_t = std::function<void()>;
+
+    explicit EventLoop(PollerBackend backend = PollerBackend::kEpoll)
+        : _eventfd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+        , _tid(std::this_thread::get_id())
+        , _eventch(new Channel(_eventfd, this))
+        , _poller(backend)
+        , _timerWheel(this) {
+        if (_eventfd == -1) {
+            lg(Fatal, "create eventfd failed");
+            throw std::runtime_error("create eventfd failed");
+        }
+        _eventch->SetReadCallback([this] { ReadEventfd(); });
+        _eventch->EnableRead();
+        CurrentSlot() = this;
+    }
+    ~EventLoop() {
+        if (CurrentSlot() == this) CurrentSlot() = nullptr;
+        delete _eventch;
+        close(_eventfd);
+    }
+    // 当前线程的事件循环, 不在事件循环线程中时返回nullptr
+    static EventLoop* Current() { return CurrentSlot(); }
+
+    // 判断将要执行的任务是否在当前线程中, 是则执行, 否则放入队列中
+    template <class F>
+    void RunInLoop(F&& cb) {
+        if (IsInLoopThread()) cb();
+        else QueueInLoop(std::forward<F>(cb));
+    }
+    // 压入任务池, 任务在本轮事件处理完毕后执行
+    template <class F>
+    void QueueInLoop(F&& cb) {
+        if (IsInLoopThread()) {
+            // 本线程压入的任务不需要唤醒, 下一轮事件监控不会阻塞
+            _local_pending.emplace_back(std::forward<F>(cb));
+            return;
+        }
+        _pending.Push(Task(std::forward<F>(cb)));
+        // 已经有唤醒在途时不再重复写eventfd
+        if (!_wakeup_pending.exchange(true, std::memory_order_acq_rel)) Wakeup();
+    }
     // 判断当前线程是否是事件循环所在的线程
     bool IsInLoopThread() const { return std::this_thread::get_id() == _tid; }
     // 添加事件监控
     void UpdateEvent(Channel* ch) { _poller.Update(ch); }
     // 移除事件监控
     void RemoveEvent(Channel* ch) { _poller.Remove(ch); }
-    // 添加定时任务
-    void RunAfter(uint64_t id, uint64_t timeout, const TimerTask::TaskFunc& task) {
+    // 监听套接字(Channel::EnableAccept)已经接收的新连接追加到fds, 返回false时需要使用者自己accept
+    bool TakeAccepted(Channel* ch, std::vector<int>& fds) { return _poller.TakeAccepted(ch, fds); }
+    // 移除事件监控之后, io_uring的accept请求是否还没有撤销完成(仍然可能通过TakeAccepted取到新连接)
+    bool AcceptPending(Channel* ch) const { return _poller.AcceptPending(ch); }
+    // 连接套接字(Channel::EnableRecv)已经追加到缓冲区的数据, 返回false时需要使用者自己recv
+    bool TakeReceived(Channel* ch, RecvResult& result) { return _poller.TakeReceived(ch, result); }
+    // io_uring下提交零拷贝发送, 内核不再引用数据之前holds保持数据有效; 不支持时返回false, 需要使用者自己发送
+    bool CanSendZeroCopy() const { return _poller.CanSendZeroCopy(); }
+    bool SendZeroCopy(Channel* ch, std::vector<struct iovec>&& iov, std::vector<std::shared_ptr<const void>>&& holds) {
+        return _poller.SendZeroCopy(ch, std::move(iov), std::move(holds));
+    }
+    // 取出零拷贝发送的结果(发送的字节数或者-errno), 还没有完成时返回false
+    bool TakeSent(Channel* ch, ssize_t& result) { return _poller.TakeSent(ch, result); }
+    // 添加定时任务(超时时间单位为秒)
+    void RunAfter(uint64_t id, uint64_t timeout, const TimerNode::TaskFunc& task) {
         _timerWheel.AddTask(id, timeout, task);
     }
     // 刷新定时任务
@@ -550,21 +2039,70 @@ public:
     void RemoveAfter(uint64_t id) { _timerWheel.RemoveTask(id); }
     // 是否有定时任务
     bool HasAfter(uint64_t id) const { return _timerWheel.HasTask(id); }
+    // 添加侵入式定时器(超时时间单位为毫秒), 以下三个接口必须在事件循环线程中调用
+    void AddTimer(TimerNode* node, uint64_t timeout_ms) { _timerWheel.Add(node, timeout_ms); }
+    // 按原超时时间重新计时
+    void RefreshTimer(TimerNode* node) { _timerWheel.Refresh(node); }
+    // 取消侵入式定时器
+    void CancelTimer(TimerNode* node) { _timerWheel.Cancel(node); }
+    // 在协程中等待ms毫秒(co_await loop->Sleep(ms)), 必须在事件循环线程中使用
+    SleepAwaiter Sleep(uint64_t ms) { return SleepAwaiter(this, ms); }
+    // 没有就绪事件时先用0超时的epoll_wait忙轮询最多us微秒再阻塞等待, 以CPU换取唤醒延迟, 0表示不轮询
+    void SetBusyPoll(uint64_t us) {
+        RunInLoop([this, us] { _busy_poll_ns = us * 1000; });
+    }
+    // 事件监控实际使用的实现方式
+    PollerBackend GetBackend() const { return _poller.Backend(); }
+    // 本事件循环的统计数据, 只能在事件循环线程中修改, 可以在任意线程中读取
+    LoopMetrics& GetMetrics() { return _metrics; }
+    const LoopMetrics& GetMetrics() const { return _metrics; }
+    // 本事件循环的负载, 用于分配新连接
+    LoopLoad& GetLoad() { return _load; }
+    const LoopLoad& GetLoad() const { return _load; }
 
+    // 退出事件循环, Start在本轮的事件和任务处理完毕后返回, 可以在任意线程中调用
+    void Quit() {
+        _quit.store(true, std::memory_order_release);
+        if (!IsInLoopThread()) Wakeup();
+    }
     void Start() {
-        for (;;) {
+        while (!_quit.load(std::memory_order_acquire)) {
             // 事件监控
             std::vector<Channel*> _active;
-            _poller.Poll(_active);
-            // 事件处理
+            // 还有未执行的任务时不能阻塞等待
+            Wait(_active, _local_pending.empty() && !_more_pending);
+            _metrics._poll_events.Record(_active.size());
+            // 事件处理, 上一个事件的结束时间就是下一个事件的开始时间
+            uint64_t begin = _active.empty() ? 0 : MonotonicNs();
             for (auto& ch : _active) {
                 ch->HandleEvent();
+                uint64_t end = MonotonicNs();
+                _metrics._handle_ns.Record(end - begin);
+                begin = end;
             }
             // 执行任务
             RunPendingTasks();
         }
     }
 private:
+    static EventLoop*& CurrentSlot() {
+        thread_local EventLoop* loop = nullptr;
+        return loop;
+    }
+    // 等待就绪事件, block为false时只检查一次
+    void Wait(std::vector<Channel*>& active, bool block) {
+        if (!block || _busy_poll_ns == 0) {
+            _poller.Poll(active, block ? -1 : 0);
+            return;
+        }
+        // 其他线程投递的任务和定时器都通过描述符通知, 轮询期间同样能及时发现
+        uint64_t deadline = MonotonicNs() + _busy_poll_ns;
+        do {
+            _poller.Poll(active, 0);
+            if (!active.empty()) return;
+        } while (MonotonicNs() < deadline);
+        _poller.Poll(active, -1);
+    }
     void ReadEventfd() {
         uint64_t res;
         ssize_t n = read(_eventfd, &res, sizeof(res));
@@ -589,15 +2127,22 @@ private:
 
     // 执行任务
     void RunPendingTasks() {
-        std::queue<callback_t> tasks;
-        {
-            std::lock_guard<std::mutex> lock(_mutex);
-            tasks.swap(_pending);
+        // 先清除唤醒标志再取任务, 之后压入的任务会重新唤醒
+        _wakeup_pending.exchange(false, std::memory_order_acq_rel);
+        // 执行过程中本线程新压入的任务留到下一轮执行, 避免自我续期的任务饿死事件处理
+        std::vector<Task> local;
+        local.swap(_local_pending);
+        for (auto& task : local) {
+            task();
         }
-        while (!tasks.empty()) {
-            tasks.front()();
-            tasks.pop();
+        Task task;
+        size_t n = 0;
+        while (n < kMaxTasksPerRound && _pending.Pop(task)) {
+            task();
+            n++;
         }
+        _more_pending = (n == kMaxTasksPerRound);
+        if (n + local.size() > 0) _metrics._task_batch.Record(n + local.size());
     }
 private:
     int _eventfd;
@@ -605,14 +2150,27 @@ private:
     Channel* _eventch;
     Poller _poller; // 一一对应
     TimerWheel _timerWheel;
-    std::queue<callback_t> _pending;
-    std::mutex _mutex;
+    // 每轮最多执行的跨线程任务数
+    static constexpr size_t kMaxTasksPerRound = 4096;
+    TaskQueue _pending; // 其他线程压入的任务
+    std::vector<Task> _local_pending; // 本线程压入的任务
+    std::atomic<bool> _wakeup_pending{false}; // 是否已经写过eventfd且尚未处理
+    bool _more_pending = false; // 上一轮是否还有没执行完的跨线程任务
+    std::atomic<bool> _quit{ false }; // 是否退出事件循环
+    uint64_t _busy_poll_ns = 0; // 阻塞等待之前忙轮询的时长
+    LoopMetrics _metrics;
+    LoopLoad _load;
 };
 
+void SleepAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    _node.SetTask([handle] { handle.resume(); });
+    _loop->AddTimer(&_node, _ms);
+}
+
 void Channel::Update() { _loop->UpdateEvent(this); }
 void Channel::Remove() { _loop->RemoveEvent(this); }
 
-void TimerWheel::AddTask(uint64_t id, uint64_t timeout, const TimerTask::TaskFunc& task) {
+void TimerWheel::AddTask(uint64_t id, uint64_t timeout, const TimerNode::TaskFunc& task) {
     _loop->RunInLoop([this, id, timeout, task] { _addTask(id, timeout, task); });
 }
 void TimerWheel::RefreshTask(uint64_t id) {
@@ -624,7 +2182,15 @@ void TimerWheel::RemoveTask(uint64_t id) {
 
 class LoopThread {
 public:
-    LoopThread() : _thread(std::thread([this] { ThreadEntry(); })), _loop(nullptr) {}
+    // 线程必须在其他成员初始化完成后再启动
+    explicit LoopThread(PollerBackend backend = PollerBackend::kEpoll) : _loop(nullptr), _backend(backend) {
+        _thread = std::thread([this] { ThreadEntry(); });
+    }
+    // 退出事件循环并等待线程结束
+    ~LoopThread() {
+        GetLoop()->Quit();
+        _thread.join();
+    }
     // 返回当前线程关联的Loop指针
     EventLoop* GetLoop() {
         EventLoop* loop = nullptr;
@@ -637,7 +2203,7 @@ public:
     }
 private:
     void ThreadEntry() {
-        EventLoop loop;
+        EventLoop loop(_backend);
         {
             std::lock_guard<std::mutex> lock(_mutex);
             _loop = &loop;
@@ -648,34 +2214,129 @@ private:
 
     std::thread _thread; // EventLoop所在的线程
     EventLoop* _loop; // 事件循环(线程内实例化)
+    PollerBackend _backend;
     std::mutex _mutex; // 保证线程安全
     std::condition_variable _cond; // 保证线程安全
 };
 
+// 新连接分配到哪个从属事件循环
+enum class DispatchPolicy {
+    kRoundRobin, // 轮流分配
+    kLeastConnections, // 连接数最少的
+    kLeastPendingBytes, // 缓冲区中积压的数据最少的
+    kPowerOfTwoChoices, // 随机选两个, 取负载(连接数和积压数据)较低的
+};
+
 class LoopThreadPool {
 public:
+    // 自定义分配函数, 参数是所有从属事件循环, 返回选中的下标
+    using Dispatcher = std::function<size_t(const std::vector<EventLoop*>&)>;
+    // 负载比较时积压的数据按每64KiB相当于一个连接计算
+    static constexpr int64_t kPendingBytesPerConnection = 64 * 1024;
+
     explicit LoopThreadPool(EventLoop* baseLoop, int num = 0) : _threadNum(num), _next(0), _baseLoop(baseLoop) {}
+    ~LoopThreadPool() {
+        for (auto* thread : _threads) delete thread;
+    }
+    LoopThreadPool(const LoopThreadPool&) = delete;
+    LoopThreadPool& operator=(const LoopThreadPool&) = delete;
 
+    // 从属事件循环与主事件循环使用相同的事件监控方式
     void Create() {
         for (int i = 0; i < _threadNum; i++) {
-            auto* loopThread = new LoopThread;
+            auto* loopThread = new LoopThread(_baseLoop->GetBackend());
             _threads.push_back(loopThread);
             _loops.push_back(loopThread->GetLoop());
         }
     }
 
-    EventLoop* GetNextLoop() {
-        if (_threadNum == 0) {
-            return _baseLoop;
+    // 所有从属事件循环, 没有从属线程时只有主事件循环
+    std::vector<EventLoop*> GetLoops() const {
+        if (_threadNum == 0) return {_baseLoop};
+        return _loops;
+    }
+    // 把第i个事件循环线程绑定到cpus[i % cpus.size()]上, 可以在事件循环运行后调用(绑定在各自的线程中完成)
+    // numa_local为true时线程之后分配的内存优先使用所在节点(缓冲区和对象池都是线程局部、按需分配的,
+    // 在开始处理连接之前绑定时基本都落在本地节点上)
+    void SetAffinity(const std::vector<int>& cpus, bool numa_local = true) {
+        if (cpus.empty()) return;
+        auto loops = GetLoops();
+        for (size_t i = 0; i < loops.size(); i++) {
+            int cpu = cpus[i % cpus.size()];
+            loops[i]->RunInLoop([cpu, numa_local] {
+                if (!PinCurrentThread(cpu)) return;
+                if (numa_local) PreferLocalMemory();
+                });
         }
-        else {
+    }
+    // 设置分配策略, 需要在开始接收连接之前设置
+    void SetDispatchPolicy(DispatchPolicy policy) { _policy = policy; }
+    void SetDispatcher(const Dispatcher& dispatcher) { _dispatcher = dispatcher; }
+    // 按分配策略选择下一个事件循环, 返回在GetLoops()中的下标, 只能在一个线程(接收连接的线程)中调用
+    size_t NextIndex() {
+        if (_threadNum <= 1) return 0;
+        if (_dispatcher) return _dispatcher(_loops) % _loops.size();
+        switch (_policy) {
+        case DispatchPolicy::kLeastConnections:
+            return MinBy([](const LoopLoad& load) { return load.Connections(); });
+        case DispatchPolicy::kLeastPendingBytes:
+            return MinBy([](const LoopLoad& load) { return load.PendingBytes(); });
+        case DispatchPolicy::kPowerOfTwoChoices: {
+            size_t a = _rng() % _loops.size();
+            size_t b = _rng() % (_loops.size() - 1);
+            if (b >= a) b++;
+            return Score(_loops[b]->GetLoad()) < Score(_loops[a]->GetLoad()) ? b : a;
+        }
+        default:
             _next = (_next + 1) % _threadNum;
-            return _loops[_next];
+            return _next;
         }
     }
+    EventLoop* GetNextLoop() { return GetLoops()[NextIndex()]; }
 private:
+    static bool PinCurrentThread(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            lg(Warning, "bind loop thread to cpu %d failed: %s", cpu, strerror(err));
+            return false;
+        }
+        return true;
+    }
+    // 内存分配策略改为优先使用当前CPU所在的节点(覆盖交错分配等系统默认策略)
+    static void PreferLocalMemory() {
+        if (syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) == -1 && errno != ENOSYS) {
+            lg(Warning, "set local memory policy failed: %s", strerror(errno));
+        }
+    }
+
+    static int64_t Score(const LoopLoad& load) {
+        return load.Connections() + load.PendingBytes() / kPendingBytesPerConnection;
+    }
+    // 负载最低的事件循环, 从轮转位置开始比较, 负载相同时依次分配
+    template <class F>
+    size_t MinBy(F&& value) {
+        _next = (_next + 1) % _threadNum;
+        size_t best = _next;
+        int64_t best_value = value(_loops[best]->GetLoad());
+        for (int i = 1; i < _threadNum; i++) {
+            size_t idx = (_next + i) % _threadNum;
+            int64_t v = value(_loops[idx]->GetLoad());
+            if (v < best_value) {
+                best = idx;
+                best_value = v;
+            }
+        }
+        return best;
+    }
+
     int _threadNum; // 线程数量
     int _next; // 下一个线程
+    DispatchPolicy _policy = DispatchPolicy::kRoundRobin;
+    Dispatcher _dispatcher;
+    std::minstd_rand _rng{ std::random_device{}() };
     EventLoop* _baseLoop; // 主事件循环
     std::vector<LoopThread*> _threads; // 线程池
     std::vector<EventLoop*> _loops; // 事件循环池
@@ -688,14 +2349,140 @@ enum class ConnectionState {
     kConnected,
     kDisconnecting,
 };
+// 固定大小内存块的线程本地空闲链表, 每个事件循环线程各自一份, 分配和回收不加锁
+template <std::size_t Size, std::size_t Align>
+class FreeList {
+public:
+    static constexpr std::size_t kMaxCached = 1024; // 每个线程最多缓存的块数
+
+    static void* Allocate() {
+        FreeList* list = Local();
+        if (list != nullptr && !list->_blocks.empty()) {
+            void* block = list->_blocks.back();
+            list->_blocks.pop_back();
+            return block;
+        }
+        return ::operator new(Size, std::align_val_t(Align));
+    }
+    static void Deallocate(void* block) {
+        FreeList* list = Local();
+        if (list == nullptr || list->_blocks.size() >= kMaxCached) {
+            ::operator delete(block, std::align_val_t(Align));
+            return;
+        }
+        list->_blocks.push_back(block);
+    }
+private:
+    FreeList() = default;
+    ~FreeList() {
+        for (void* block : _blocks) ::operator delete(block, std::align_val_t(Align));
+        Destroyed() = true;
+    }
+    static bool& Destroyed() {
+        thread_local bool destroyed = false;
+        return destroyed;
+    }
+    static FreeList* Local() {
+        if (Destroyed()) return nullptr;
+        thread_local FreeList list;
+        return &list;
+    }
+private:
+    std::vector<void*> _blocks;
+};
+
+// 从FreeList分配单个对象的分配器, 用于allocate_shared, 对象和控制块在同一块内存中
+template <class T>
+class PoolAllocator {
+public:
+    using value_type = T;
+    PoolAllocator() = default;
+    template <class U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        if (n != 1) return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+        return static_cast<T*>(FreeList<sizeof(T), alignof(T)>::Allocate());
+    }
+    void deallocate(T* p, std::size_t n) noexcept {
+        if (n != 1) ::operator delete(p, std::align_val_t(alignof(T)));
+        else FreeList<sizeof(T), alignof(T)>::Deallocate(p);
+    }
+    template <class U>
+    bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+    template <class U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+};
+
+// 类型化的连接上下文, 取出时不需要std::any的类型检查
+class ConnectionContext {
+public:
+    virtual ~ConnectionContext() = default;
+    // 回收复用之前调用, 清空状态但保留已经分配的内存
+    virtual void Reset() {}
+};
+using ContextPtr = std::unique_ptr<ConnectionContext, void (*)(ConnectionContext*)>;
+
+// 连接上下文的对象池, 连接关闭时上下文被重置后放回当前线程的空闲列表, 由下一个连接复用
+template <class T>
+class ContextPool {
+public:
+    static constexpr std::size_t kMaxCached = 1024; // 每个线程最多缓存的对象数
+
+    static ContextPtr Acquire() {
+        Pool* pool = Local();
+        if (pool != nullptr && !pool->_free.empty()) {
+            T* context = pool->_free.back();
+            pool->_free.pop_back();
+            return ContextPtr(context, &Recycle);
+        }
+        return ContextPtr(new T(), &Recycle);
+    }
+private:
+    struct Pool {
+        std::vector<T*> _free;
+        ~Pool() {
+            for (T* context : _free) delete context;
+            Destroyed() = true;
+        }
+    };
+    static void Recycle(ConnectionContext* context) {
+        Pool* pool = Local();
+        if (pool == nullptr || pool->_free.size() >= kMaxCached) {
+            delete context;
+            return;
+        }
+        context->Reset();
+        pool->_free.push_back(static_cast<T*>(context));
+    }
+    static bool& Destroyed() {
+        thread_local bool destroyed = false;
+        return destroyed;
+    }
+    static Pool* Local() {
+        if (Destroyed()) return nullptr;
+        thread_local Pool pool;
+        return &pool;
+    }
+};
+
 class Connection;
 using PtrConnection = std::shared_ptr<Connection>;
+// 每次读事件默认最多读取的字节数
+const size_t kDefaultReadBudget = 256 * 1024;
+// 每次写事件默认最多发送的字节数
+const size_t kDefaultWriteBudget = 1024 * 1024;
+// io_uring下输出链首连续的内存切片不小于该大小时默认使用零拷贝发送
+const size_t kDefaultZeroCopySize = 64 * 1024;
 class Connection : public std::enable_shared_from_this<Connection> {
 public:
     using ConnectedCallback = std::function<void(const PtrConnection&)>;
     using MessageCallback = std::function<void(const PtrConnection&, Buffer*)>;
     using CloseCallback = std::function<void(const PtrConnection&)>;
     using EventCallback = std::function<void(const PtrConnection&)>;
+    using LowWaterCallback = std::function<void(const PtrConnection&)>;
+    using HighWaterCallback = std::function<void(const PtrConnection&, size_t)>;
+    using WriteCompleteCallback = std::function<void(const PtrConnection&)>;
 
     Connection(EventLoop* loop, uint64_t conn_id, int sock_fd)
         : _id(conn_id)
@@ -705,6 +2492,8 @@ public:
         , _state(ConnectionState::kConnecting)
         , _sock(sock_fd)
         , _channel(sock_fd, loop) {
+        // sock_fd必须是非阻塞的(Accepter通过accept4直接创建非阻塞套接字)
+        _inactive_timer.SetTask([this] { Close(); });
         _channel.SetReadCallback([this] { HandleRead(); });
         _channel.SetWriteCallback([this] { HandleWrite(); });
         _channel.SetCloseCallback([this] { HandleClose(); });
@@ -716,28 +2505,89 @@ public:
     int GetFd() const { return _fd; }
     bool IsConnected() const { return _state == ConnectionState::kConnected; }
     ConnectionState GetState() const { return _state; }
+    // 累计收发的字节数, 必须在事件循环线程中调用
+    uint64_t BytesRead() const { return _bytes_read; }
+    uint64_t BytesWritten() const { return _bytes_written; }
     std::any* GetContext() { return &_context; }
+    // 类型化的上下文, T必须是设置时的类型(不做检查), 没有设置或者连接已经关闭时返回nullptr
+    template <class T>
+    T* GetTypedContext() const { return static_cast<T*>(_typed_context.get()); }
 
     void SetConnectedCallback(const ConnectedCallback& cb) { _connected_cb = cb; }
     void SetMessageCallback(const MessageCallback& cb) { _message_cb = cb; }
     void SetCloseCallback(const CloseCallback& cb) { _close_cb = cb; }
     void SetEventCallback(const EventCallback& cb) { _event_cb = cb; }
     void SetServerCloseCallback(const CloseCallback& cb) { _server_close_cb = cb; }
+    // 设置每次读事件最多读取的字节数, 防止单个连接长时间占用事件循环
+    void SetReadBudget(size_t budget) { _read_budget = budget; }
+    // 设置每次写事件最多发送的字节数
+    void SetWriteBudget(size_t budget) { _write_budget = budget; }
+    // 设置使用零拷贝发送的最小数据量(只在io_uring下生效), 0表示不使用
+    void SetZeroCopySize(size_t size) { _zero_copy_size = size; }
+    // 使用边缘触发模式, 需要在Establish之前设置
+    void EnableEdgeTrigger() { _edge_trigger = true; }
+    // 输出队列从高于mark回落到mark以下时调用, 用于恢复暂停的生产者; 必须在事件循环线程中调用
+    void SetLowWaterCallback(const LowWaterCallback& cb, size_t mark) {
+        _low_water_cb = cb;
+        _low_water_mark = mark;
+        _above_low_water = _output.ReadableSize() > mark;
+    }
+    // 输出队列从mark以下增长到超过mark时调用(参数为当前的大小), mark为0时不检查; 需要在Establish之前或者事件循环线程中调用
+    void SetHighWaterCallback(const HighWaterCallback& cb, size_t mark) {
+        _high_water_cb = cb;
+        _high_water_mark = mark;
+    }
+    // 输出队列中的数据全部发送完毕时调用(在任务队列中执行, 回调中可以继续发送)
+    void SetWriteCompleteCallback(const WriteCompleteCallback& cb) { _write_complete_cb = cb; }
+    // 输出队列超过高水位时自动暂停读取, 回落到高水位的一半以下时恢复并继续处理输入缓冲区,
+    // 对端不读取响应时不会再读入新的请求, 单个连接的内存有上限
+    void SetPauseReadOnHighWater(bool on) { _pause_read_on_high_water = on; }
+    // 是否因为输出超过高水位而暂停了读取, 上层处理流水线请求时应该停止处理输入缓冲区
+    bool IsThrottled() const { return _throttled; }
+    // 输出队列中还没有发送的字节数, 必须在事件循环线程中调用
+    size_t OutputSize() const { return _output.ReadableSize(); }
+    // 输入缓冲区中还没有处理的字节数, 必须在事件循环线程中调用
+    size_t InputSize() const { return _input.ReadableSize(); }
 
     // 启动连接
     void Establish() {
         _loop->RunInLoop([this] { _establish(); });
     }
-    // 发送数据
+    // 发送数据, 在事件循环线程中直接拷贝到输出队列, 否则只拷贝一次后移交给事件循环
     void Send(const char* data, size_t len) {
-        Buffer buf;
-        buf.Write(data, len);
-        _loop->RunInLoop([this, buf] { _send(std::move(buf)); });
+        if (_loop->IsInLoopThread()) _send(data, len);
+        else _loop->QueueInLoop([this, str = std::string(data, len)]() mutable { _send(std::move(str)); });
+    }
+    // 发送数据(移动语义, 不拷贝)
+    void Send(std::string&& data) {
+        if (_loop->IsInLoopThread()) _send(std::move(data));
+        else _loop->QueueInLoop([this, data = std::move(data)]() mutable { _send(std::move(data)); });
+    }
+    void Send(Buffer&& buf) {
+        if (_loop->IsInLoopThread()) _send(std::move(buf));
+        else _loop->QueueInLoop([this, buf = std::move(buf)]() mutable { _send(std::move(buf)); });
+    }
+    // 发送共享只读数据, 只持有引用, 可同时发送给多个连接
+    void Send(const std::shared_ptr<const std::string>& blob) {
+        if (_loop->IsInLoopThread()) _send(blob);
+        else _loop->QueueInLoop([this, blob] { _send(blob); });
+    }
+    // 零拷贝发送文件的[offset, offset + len)区段, 在此之前发送的数据会先发出
+    void SendFile(const std::shared_ptr<FileHandle>& file, off_t offset, size_t len) {
+        if (_loop->IsInLoopThread()) _sendFile(file, offset, len);
+        else _loop->QueueInLoop([this, file, offset, len] { _sendFile(file, offset, len); });
+    }
+    // 发送一整条输出链, 切片直接挂到输出队列上, 不再拼接
+    void Send(OutputChain&& chain) {
+        if (_loop->IsInLoopThread()) _send(std::move(chain));
+        else _loop->QueueInLoop([this, chain = std::move(chain)]() mutable { _send(std::move(chain)); });
     }
     // 关闭连接
     void Shutdown() {
         _loop->RunInLoop([this] { ShutdownInLoop(); });
     }
+    // 立即关闭连接, 丢弃没有发送的输出, 不等待异步处理中的请求
+    void ForceClose() { Close(); }
     // 启动非活跃连接超时销毁
     void EnableInactivityRelease(int timeout) {
         _loop->RunInLoop([this, timeout] { _enableInactivityRelease(timeout); });
@@ -754,48 +2604,217 @@ public:
     }
     // 重置上下文
     void SetContext(const std::any& context) { _context = context; }
+    // 设置类型化的上下文(通常来自ContextPool), 连接关闭时释放
+    void SetTypedContext(ContextPtr context) { _typed_context = std::move(context); }
+    EventLoop* GetLoop() const { return _loop; }
+    // 开始异步处理一个请求, 对端半关闭后连接也要保持到Release, 必须在事件循环线程中调用
+    void Hold() { _holds++; }
+    // 异步处理完成(响应已经发送), 必须在事件循环线程中调用
+    void Release() {
+        if (_holds > 0) _holds--;
+        if (_holds == 0 && _state == ConnectionState::kDisconnecting && _output.Empty()) Close();
+    }
+    // 暂停读取套接字, 内核接收缓冲区满后由TCP流控阻塞对端(背压), 已经读入输入缓冲区的数据不受影响
+    void PauseRead() {
+        _loop->RunInLoop([this] {
+            _read_paused = true;
+            UpdateReading();
+            });
+    }
+    // 恢复读取套接字
+    void ResumeRead() {
+        _loop->RunInLoop([self = shared_from_this()] { self->_resumeRead(); });
+    }
+    // 重新处理输入缓冲区中还没有处理的数据(如异步处理完成后继续处理流水线中的请求), 必须在事件循环线程中调用
+    void ReprocessInput() {
+        if (_state == ConnectionState::kDisconnected || _input.ReadableSize() == 0) return;
+        if (_message_cb) _message_cb(shared_from_this(), &_input);
+        _input.Release();
+        PublishLoad();
+    }
 private:
+    // 把缓冲区中积压的数据量同步到事件循环的负载中, 供分配新连接时参考
+    void PublishLoad() {
+        size_t bytes = _state == ConnectionState::kDisconnected ? 0 : _input.ReadableSize() + _output.ReadableSize();
+        if (bytes == _published_bytes) return;
+        _loop->GetLoad().AddPendingBytes(static_cast<int64_t>(bytes) - static_cast<int64_t>(_published_bytes));
+        _published_bytes = bytes;
+    }
     void HandleRead() {
-        char buf[65536];
-        // MSG_DONTWAIT: 非阻塞
-        ssize_t n = _sock.Recv(buf, sizeof(buf), MSG_DONTWAIT);
-        if (n > 0) {
-            _input.Write(buf, n);
-            if (_input.ReadableSize() > 0) {
-                // 调用消息处理函数
-                if (_message_cb) _message_cb(shared_from_this(), &_input);
+        size_t total = 0;
+        bool drained = false;
+        bool peer_closed = false;
+        bool failed = false;
+        RecvResult received;
+        if (_loop->TakeReceived(&_channel, received)) {
+            // io_uring下数据已经随完成事件追加到输入缓冲区, 不需要再recv
+            total = received._bytes;
+            _bytes_read += total;
+            _loop->GetMetrics()._bytes_read.Add(total);
+            peer_closed = received._eof;
+            if (received._error != 0) {
+                lg(Error, "recv failed: %s", strerror(received._error));
+                failed = true;
             }
-        }
-        else if (n == 0) {
-            // 表示的是没有读取到数据, 而不是连接断开
-            return;
+            drained = true;
         }
         else {
+            drained = ReadSocket(total, peer_closed, failed);
+        }
+        if (total > 0 && _input.ReadableSize() > 0) {
+            // 调用消息处理函数, 期间追加的输出在处理完毕后统一发送
+            _in_read = true;
+            if (_message_cb) _message_cb(shared_from_this(), &_input);
+            _in_read = false;
+        }
+        // 输入处理完毕后把内存还给内存池, 空闲的长连接不占用缓冲区
+        _input.Release();
+        PublishLoad();
+        if (peer_closed || failed) {
+            // 不再监控读事件, 否则对端关闭后会一直触发
+            if (_channel.Readable()) _channel.DisableRead();
             ShutdownInLoop();
+            return;
+        }
+        StartWriting();
+        // 边缘触发模式下, 预算用完时剩余的数据不会再有读事件通知, 放到任务队列中继续读
+        if (!drained && _channel.IsEdgeTriggered()) {
+            _loop->QueueInLoop([self = shared_from_this()] {
+                if (self->_state != ConnectionState::kDisconnected && self->_channel.Readable()) self->HandleRead();
+            });
         }
     }
-    void HandleWrite() {
-        ssize_t n = _sock.Send(_output.ReadPos(), _output.ReadableSize(), MSG_DONTWAIT);
-        if (n > 0) {
-            _output.MoveReadIdx(n);
-            if (_output.ReadableSize() == 0) {
-                _channel.DisableWrite();
-                if (_state == ConnectionState::kDisconnecting) {
-                    Close();
+    // 一直读到内核缓冲区清空或者达到本次读事件的预算, 返回内核缓冲区是否已经读空
+    bool ReadSocket(size_t& total, bool& peer_closed, bool& failed) {
+        bool drained = false;
+        while (total < _read_budget) {
+            // 空闲时输入缓冲区不占用内存, 读之前先借用一块
+            if (_input.BackSize() == 0) _input.Reserve(BufferPool::kMinChunkSize);
+            size_t capacity = _input.BackSize();
+            if (capacity < Buffer::kReadFdExtraSize) capacity += Buffer::kReadFdExtraSize;
+            int err = 0;
+            ssize_t n = _input.ReadFd(_sock.GetFd(), &err);
+            if (n > 0) {
+                total += n;
+                _bytes_read += n;
+                _loop->GetMetrics()._bytes_read.Add(n);
+                // 没有读满说明内核缓冲区已经读空, 省去一次返回EAGAIN的系统调用
+                // 边缘触发模式下对端关闭可能和数据在同一次通知中到达, 必须读到EAGAIN
+                if (!_channel.IsEdgeTriggered() && static_cast<size_t>(n) < capacity) {
+                    drained = true;
+                    break;
                 }
             }
+            else if (n == 0) {
+                // 对端关闭了连接
+                peer_closed = true;
+                break;
+            }
+            else if (err == EINTR) {
+                continue;
+            }
+            else {
+                // EAGAIN: 没有数据可读
+                if (err != EAGAIN && err != EWOULDBLOCK) {
+                    lg(Error, "recv failed: %s", strerror(err));
+                    failed = true;
+                }
+                drained = true;
+                break;
+            }
         }
-        else if (n == 0) {
-            // 表示的是没有写入数据, 而不是连接断开
-            return;
-        }
-        else {
+        return drained;
+    }
+    void HandleWrite() {
+        if (FlushOutput() < 0) {
             if (_input.ReadableSize() > 0) {
                 if (_message_cb) _message_cb(shared_from_this(), &_input);
             }
             Close();
         }
     }
+    // 在预算内尽量发送输出队列中的数据, 并根据剩余数据调整写事件监控, 返回-1表示出错
+    int FlushOutput() {
+        size_t total = 0;
+        bool blocked = false;
+        if (_zero_copy) {
+            // 零拷贝发送完成之前不能发送后面的数据, 完成后通过写事件回到这里
+            ssize_t sent = 0;
+            if (!_loop->TakeSent(&_channel, sent)) return 0;
+            _zero_copy = false;
+            if (sent < 0) {
+                lg(Error, "send failed: %s", strerror(static_cast<int>(-sent)));
+                return -1;
+            }
+            _output.Consume(sent);
+            total += sent;
+        }
+        while (!_output.Empty() && total < _write_budget) {
+            if (ZeroCopyFront()) {
+                blocked = true;
+                break;
+            }
+            uint64_t begin = MonotonicNs();
+            ssize_t n = _output.WriteTo(_sock);
+            _loop->GetMetrics()._write_ns.Record(MonotonicNs() - begin);
+            if (n < 0) return -1;
+            if (n == 0) {
+                // 表示的是没有写入数据, 而不是连接断开
+                blocked = true;
+                break;
+            }
+            total += n;
+        }
+        _bytes_written += total;
+        _loop->GetMetrics()._bytes_written.Add(total);
+        PublishLoad();
+        if (_above_low_water && _output.ReadableSize() <= _low_water_mark) {
+            _above_low_water = false;
+            if (_low_water_cb) _low_water_cb(shared_from_this());
+        }
+        if (_above_high_water && _output.ReadableSize() <= _high_water_mark / 2) {
+            _above_high_water = false;
+            if (_throttled) {
+                _throttled = false;
+                UpdateReading();
+                // 暂停期间留在输入缓冲区中的请求
+                _loop->QueueInLoop([self = shared_from_this()] { self->ReprocessInput(); });
+            }
+        }
+        if (_output.Empty()) {
+            if (total > 0 && _write_complete_cb) {
+                _loop->QueueInLoop([self = shared_from_this()] {
+                    if (self->_write_complete_cb) self->_write_complete_cb(self);
+                });
+            }
+            if (_channel.Writable()) _channel.DisableWrite();
+            if (_state == ConnectionState::kDisconnecting && _holds == 0) Close();
+            return 0;
+        }
+        if (!_channel.Writable()) _channel.EnableWrite();
+        // 边缘触发模式下, 预算用完但套接字仍可写时不会再有写事件通知, 放到任务队列中继续写
+        if (!blocked && _channel.IsEdgeTriggered()) {
+            _loop->QueueInLoop([self = shared_from_this()] {
+                if (self->_state != ConnectionState::kDisconnected && self->_channel.Writable()) self->HandleWrite();
+            });
+        }
+        return 0;
+    }
+    // io_uring下链首连续的内存切片足够大时提交零拷贝发送, 内核直接从切片读取数据, 返回是否已经提交
+    bool ZeroCopyFront() {
+        if (_zero_copy_size == 0 || _channel.IsEdgeTriggered() || !_loop->CanSendZeroCopy()) return false;
+        std::vector<struct iovec> iov;
+        std::vector<std::shared_ptr<const void>> holds;
+        if (_output.ShareFront(_zero_copy_size, iov, holds) == 0) return false;
+        if (!_loop->SendZeroCopy(&_channel, std::move(iov), std::move(holds))) return false;
+        _zero_copy = true;
+        return true;
+    }
+    // 有新的输出时, 如果没有在等待写事件就直接尝试发送, 省去打开/关闭写事件监控的系统调用
+    void StartWriting() {
+        if (_in_read || _output.Empty() || _channel.Writable()) return;
+        if (FlushOutput() < 0) Close();
+    }
     void HandleClose() {
         // 一旦关闭连接, 那么socket就不能再读写了
         if (_input.ReadableSize() > 0) {
@@ -806,33 +2825,77 @@ private:
     void HandleEvent() {
         // 刷新连接的活跃度
         if (_inactive_release) {
-            _loop->RefreshAfter(_id);
+            _loop->RefreshTimer(&_inactive_timer);
         }
         if (_event_cb) _event_cb(shared_from_this());
     }
 
-    void _send(const Buffer& buf) {
-        if (_state == ConnectionState::kConnected) {
-            _output.Write(buf);
-            if (!_channel.Writable()) {
-                _channel.EnableWrite();
+    // 追加数据到输出队列, 并启动写事件监控
+    template <class... Args>
+    void _send(Args&&... args) {
+        if (CanSend()) {
+            _output.Append(std::forward<Args>(args)...);
+            OnAppend();
+        }
+    }
+    void _sendFile(const std::shared_ptr<FileHandle>& file, off_t offset, size_t len) {
+        if (CanSend() && len > 0) {
+            _output.AppendFile(file, offset, len);
+            OnAppend();
+        }
+    }
+    void OnAppend() {
+        size_t size = _output.ReadableSize();
+        if (_low_water_cb && size > _low_water_mark) _above_low_water = true;
+        if (_high_water_mark > 0 && !_above_high_water && size > _high_water_mark) {
+            _above_high_water = true;
+            if (_high_water_cb) _high_water_cb(shared_from_this(), size);
+            if (_pause_read_on_high_water) {
+                _throttled = true;
+                UpdateReading();
             }
         }
+        // 读事件之外的发送(如流式响应、异步处理的结果)也算作连接的活跃
+        if (!_in_read && _inactive_release) _loop->RefreshTimer(&_inactive_timer);
+        StartWriting();
+        PublishLoad();
+    }
+    void _resumeRead() {
+        if (!_read_paused) return;
+        _read_paused = false;
+        UpdateReading();
+    }
+    // 根据暂停状态打开或者关闭读事件监控
+    void UpdateReading() {
+        if (_state != ConnectionState::kConnected) return;
+        bool want = !_read_paused && !_throttled;
+        if (!want) {
+            if (_channel.Readable()) _channel.DisableRead();
+            return;
+        }
+        if (_channel.Readable()) return;
+        _channel.EnableRead();
+        // 边缘触发模式下暂停期间到达的数据不会再有通知; io_uring下撤销recv之前接收的数据同样已经在输入缓冲区中
+        if (_channel.IsEdgeTriggered() || _loop->GetBackend() == PollerBackend::kIoUring) {
+            _loop->QueueInLoop([self = shared_from_this()] {
+                if (self->_state == ConnectionState::kConnected && self->_channel.Readable()) self->HandleRead();
+            });
+        }
     }
     void _enableInactivityRelease(int timeout) {
         _inactive_release = true;
-        _loop->HasAfter(_id) ?
-            _loop->RefreshAfter(_id) :
-            _loop->RunAfter(_id, timeout, [this] { Close(); });
+        _loop->AddTimer(&_inactive_timer, static_cast<uint64_t>(timeout) * 1000);
     }
     void _disableInactivityRelease() {
         _inactive_release = false;
-        _loop->RemoveAfter(_id);
+        _loop->CancelTimer(&_inactive_timer);
     }
     void _upgrade(const std::any& context, const ConnectedCallback& conn_cb, const MessageCallback& msg_cb
         , const CloseCallback& close_cb, const EventCallback& event_cb) {
         _context = context;
         _connected_cb = conn_cb;
+        // 通常在消息处理函数中切换协议, 正在执行的处理函数延后到任务队列中销毁
+        _loop->QueueInLoop([old = std::move(_message_cb)] {});
         _message_cb = msg_cb;
         _close_cb = close_cb;
         _event_cb = event_cb;
@@ -842,27 +2905,35 @@ private:
     void _establish() {
         if (_state != ConnectionState::kConnecting) throw std::runtime_error("establish connection in wrong state");
         _state = ConnectionState::kConnected;
-        _channel.EnableRead();
+        if (_edge_trigger) _channel.EnableEdgeTrigger();
+        // io_uring下由内核接收后直接追加到输入缓冲区, epoll下与EnableRead相同
+        else _channel.EnableRecv(&_input);
         if (_connected_cb) _connected_cb(shared_from_this());
     }
     // 检测缓冲区是否还有数据
     void ShutdownInLoop() {
+        // 已经关闭的连接不能再回到关闭中的状态, 否则会重复关闭
+        if (_state == ConnectionState::kDisconnected) return;
         _state = ConnectionState::kDisconnecting;
         if (_input.ReadableSize() > 0) {
             if (_message_cb) _message_cb(shared_from_this(), &_input);
         }
-        if (_output.ReadableSize() > 0) {
-            if (!_channel.Writable()) {
-                _channel.EnableWrite();
-            }
+        if (!_output.Empty()) {
+            StartWriting();
         }
-        else { // 如果没有数据可写, 那么直接关闭连接
+        else if (_holds == 0) { // 如果没有数据可写, 那么直接关闭连接
             Close();
         }
     }
+    // 已连接, 或者正在关闭但还有异步处理中的响应没有发出
+    bool CanSend() const {
+        return _state == ConnectionState::kConnected
+            || (_state == ConnectionState::kDisconnecting && _holds > 0);
+    }
     void Close() {
         // 必须等待事件循环中的任务执行完毕, 才能关闭连接, 否则会出现段错误
-        _loop->QueueInLoop([this]{ CloseInLoop(); });
+        // 任务持有连接的引用, 保证关闭过程中连接不会被析构
+        _loop->QueueInLoop([self = shared_from_this()] { self->CloseInLoop(); });
     }
     // 真正的关闭连接
     void CloseInLoop() {
@@ -870,44 +2941,90 @@ private:
         _state = ConnectionState::kDisconnected;
         _channel.Remove();
         _sock.Close();
-        _loop->RemoveAfter(_id);
+        _loop->CancelTimer(&_inactive_timer);
+        PublishLoad();
         if (_close_cb) _close_cb(shared_from_this());
         // 移除服务器内部的连接信息
         if (_server_close_cb) _server_close_cb(shared_from_this());
+        // 在所属的事件循环线程中归还上下文, 之后的任务通过GetTypedContext得到nullptr
+        _typed_context.reset();
     }
 private:
     uint64_t _id; // 连接, 定时器的唯一标识
     int _fd; // 连接的套接字
     bool _inactive_release; // 是否是因为超时而关闭
+    TimerNode _inactive_timer; // 非活跃超时定时器
+    size_t _read_budget = kDefaultReadBudget; // 每次读事件最多读取的字节数
+    size_t _write_budget = kDefaultWriteBudget; // 每次写事件最多发送的字节数
+    size_t _zero_copy_size = kDefaultZeroCopySize; // 使用零拷贝发送的最小数据量
+    bool _zero_copy = false; // 是否有未完成的零拷贝发送
+    bool _edge_trigger = false; // 是否使用边缘触发模式
+    bool _in_read = false; // 是否正在处理读事件
+    bool _read_paused = false; // 是否暂停了读取
+    bool _pause_read_on_high_water = false; // 超过高水位时是否自动暂停读取
+    bool _throttled = false; // 是否因为超过高水位暂停了读取
+    size_t _high_water_mark = 0; // 高水位, 0表示不检查
+    bool _above_high_water = false; // 输出队列是否高于高水位
+    size_t _low_water_mark = 0; // 低水位
+    bool _above_low_water = false; // 输出队列是否高于低水位
+    int _holds = 0; // 异步处理中的请求数量, 大于0时半关闭的连接要等响应发出再关闭
+    uint64_t _bytes_read = 0; // 累计读取的字节数
+    uint64_t _bytes_written = 0; // 累计发送的字节数
+    size_t _published_bytes = 0; // 已经计入事件循环负载的积压字节数
     EventLoop* _loop; // 事件循环
     ConnectionState _state; // 连接的状态
     Socket _sock; // 套接字
     Channel _channel; // 事件通道
     Buffer _input; // 输入缓冲区
-    Buffer _output; // 输出缓冲区
+    OutputChain _output; // 输出队列
     std::any _context; // 上下文
+    ContextPtr _typed_context{ nullptr, [](ConnectionContext* context) { delete context; } }; // 类型化的上下文
 
     ConnectedCallback _connected_cb;
     MessageCallback _message_cb;
     CloseCallback _close_cb;
     CloseCallback _server_close_cb; // 从管理端关闭连接
     EventCallback _event_cb;
+    LowWaterCallback _low_water_cb;
+    HighWaterCallback _high_water_cb;
+    WriteCompleteCallback _write_complete_cb;
 };
 
 class Accepter {
 public:
     // 接收连接的回调函数, 参数为新连接的套接字
     using AcceptCallback = std::function<void(int)>;
-    Accepter(EventLoop* loop, uint16_t port, AcceptCallback cb = nullptr)
-        : _sock(CreateServer(port))
+    // listen_fd不为-1时接管已经在监听的套接字(如从旧进程接收的), 不再创建新的
+    Accepter(EventLoop* loop, uint16_t port, AcceptCallback cb = nullptr, int listen_fd = -1)
+        : _sock(CreateServer(port, listen_fd))
+        , _loop(loop)
         , _channel(_sock.GetFd(), loop)
         , _accept_cb(std::move(cb)) {
+        if (listen_fd != -1) _sock.NonBlock();
         _channel.SetReadCallback([this] { HandleRead(); });
     }
     void SetAcceptCallback(const AcceptCallback& cb) { _accept_cb = cb; }
-    void Listen() { _channel.EnableRead(); }
+    using StoppedCallback = std::function<void()>;
+    void Listen() {
+        _listening = true;
+        _channel.EnableAccept();
+    }
+    // 停止接收新连接, 监听套接字保持打开, 内核继续在队列中保存完成握手的连接; 必须在所属的事件循环线程中调用.
+    // io_uring的accept请求撤销生效之前接收的连接仍然交给接收回调, 全部交出之后调用cb(epoll下立即调用);
+    // 调用cb之前不能销毁Accepter
+    void Stop(StoppedCallback cb = nullptr) {
+        _listening = false;
+        _stopped_cb = std::move(cb);
+        _loop->TakeAccepted(&_channel, _accepted);
+        Deliver();
+        _channel.Remove();
+        _channel.SetRevents(0);
+        CheckStopped();
+    }
+    int GetFd() const { return _sock.GetFd(); }
 private:
-    int CreateServer(uint16_t port) {
+    int CreateServer(uint16_t port, int listen_fd) {
+        if (listen_fd != -1) return listen_fd;
         if (!_sock.CreateServer(port, false)) {
             lg(Fatal, "create server failed, port: %d", port);
             throw std::runtime_error("create server failed");
@@ -915,18 +3032,153 @@ private:
         return _sock.GetFd();
     }
 
+    void Deliver() {
+        for (int fd : _accepted) {
+            if (_accept_cb) _accept_cb(fd);
+            else close(fd);
+        }
+        _accepted.clear();
+    }
+    void CheckStopped() {
+        if (!_stopped_cb || _loop->AcceptPending(&_channel)) return;
+        auto cb = std::move(_stopped_cb);
+        _stopped_cb = nullptr;
+        cb();
+    }
     void HandleRead() {
-        int newfd = _sock.Accept();
-        if (newfd != -1) {
+        // io_uring的accept请求已经接收了新连接
+        bool multishot = _loop->TakeAccepted(&_channel, _accepted);
+        Deliver();
+        // 停止之后只交出撤销生效之前接收的连接, 不再从监听队列中取
+        if (!_listening) return CheckStopped();
+        if (multishot) return;
+        // 一次读事件中尽量取完已完成握手的连接, 减少事件循环的往返
+        for (int i = 0; i < kMaxAcceptPerEvent; i++) {
+            int newfd = _sock.Accept();
+            if (newfd == -1) break;
             if (_accept_cb) _accept_cb(newfd);
+            else close(newfd);
         }
     }
 private:
+    // 每次读事件最多接收的连接数, 避免连接风暴时饿死同一事件循环中的其他连接
+    static constexpr int kMaxAcceptPerEvent = 256;
+
     Socket _sock; // 监听套接字
+    EventLoop* _loop;
     Channel _channel; // 事件通道
     AcceptCallback _accept_cb; // 接收连接的回调函数
+    std::vector<int> _accepted; // 从事件监控中取出的新连接
+    bool _listening = false;
+    StoppedCallback _stopped_cb; // 停止之后等待撤销完成
 };
 
+// 通过Unix域套接字在新旧进程之间传递监听套接字(SCM_RIGHTS): 新进程启动时从旧进程接收,
+// 监听队列中已经完成握手的连接由新进程继续接收, 重启期间不会出现拒绝连接
+namespace Handoff {
+    constexpr size_t kMaxFds = 64; // 一次最多传递的套接字数量
+    constexpr int kTimeoutMs = 1000; // 等待旧进程发送的超时时间
+
+    inline bool MakeAddress(const std::string& path, struct sockaddr_un& addr) {
+        addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            lg(Error, "invalid handoff path: %s", path.c_str());
+            return false;
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+    // 连接path上的旧进程并接收它的监听套接字(阻塞, 在启动时调用), 没有旧进程时返回空
+    inline std::vector<int> Receive(const std::string& path) {
+        struct sockaddr_un addr;
+        if (!MakeAddress(path, addr)) return {};
+        Socket sock(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (sock.GetFd() == -1) {
+            lg(Error, "create handoff socket failed: %s", strerror(errno));
+            return {};
+        }
+        struct timeval tv = { kTimeoutMs / 1000, (kTimeoutMs % 1000) * 1000 };
+        setsockopt(sock.GetFd(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (connect(sock.GetFd(), reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+            // 没有旧进程(或者旧进程已经退出)
+            if (errno != ENOENT && errno != ECONNREFUSED) lg(Warning, "connect handoff socket %s failed: %s", path.c_str(), strerror(errno));
+            return {};
+        }
+        // 只接收同一用户的进程发送的套接字, 防止其他用户占用这个路径冒充旧进程
+        struct ucred cred{};
+        socklen_t len = sizeof(cred);
+        if (getsockopt(sock.GetFd(), SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || cred.uid != geteuid()) {
+            lg(Warning, "refuse listening sockets from uid %d at %s", static_cast<int>(cred.uid), path.c_str());
+            return {};
+        }
+        char data;
+        struct iovec iov = { &data, 1 };
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxFds)];
+        struct msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock.GetFd(), &msg, MSG_CMSG_CLOEXEC) <= 0) {
+            lg(Warning, "receive listening sockets from %s failed: %s", path.c_str(), strerror(errno));
+            return {};
+        }
+        std::vector<int> fds;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            size_t old = fds.size();
+            fds.resize(old + n);
+            memcpy(fds.data() + old, CMSG_DATA(cmsg), n * sizeof(int));
+        }
+        if (msg.msg_flags & MSG_CTRUNC) lg(Warning, "some listening sockets from %s were truncated", path.c_str());
+        return fds;
+    }
+    // 把监听套接字发送给已连接的新进程
+    inline bool Send(int fd, const std::vector<int>& fds) {
+        size_t n = std::min(fds.size(), kMaxFds);
+        char data = 'L';
+        struct iovec iov = { &data, 1 };
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxFds)]{};
+        struct msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (n > 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+            memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * n);
+        }
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+            lg(Error, "send listening sockets failed: %s", strerror(errno));
+            return false;
+        }
+        return true;
+    }
+    // 在path上创建非阻塞的监听套接字(替换旧进程留下的路径), 只允许同一用户连接, 失败返回-1
+    inline int Listen(const std::string& path) {
+        struct sockaddr_un addr;
+        if (!MakeAddress(path, addr)) return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            lg(Error, "create handoff socket failed: %s", strerror(errno));
+            return -1;
+        }
+        unlink(path.c_str());
+        if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1 || chmod(path.c_str(), 0600) == -1
+            || listen(fd, 16) == -1) {
+            lg(Error, "listen on handoff socket %s failed: %s", path.c_str(), strerror(errno));
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+}
+
 class NetWork {
 public:
     NetWork() { signal(SIGPIPE, SIG_IGN); }
@@ -938,67 +3190,709 @@ public:
     using MessageCallback = std::function<void(const PtrConnection&, Buffer*)>;
     using CloseCallback = std::function<void(const PtrConnection&)>;
     using EventCallback = std::function<void(const PtrConnection&)>;
+    using HighWaterCallback = Connection::HighWaterCallback;
+    using WriteCompleteCallback = Connection::WriteCompleteCallback;
+    using DrainCallback = std::function<void(const PtrConnection&)>;
+    static constexpr uint64_t kDefaultDrainTimeoutMs = 30000; // 排空连接的默认期限
 
-    explicit TcpServer(int port, int thread_num = 0)
-        : _next_id(0)
+    // backend选择事件监控的实现方式, io_uring不可用时退回epoll
+    explicit TcpServer(int port, int thread_num = 0, PollerBackend backend = PollerBackend::kEpoll)
+        : _port(port)
+        , _next_id(0)
         , _timeout(0)
         , _inactivity_release(false)
-        , _accepter(&_baseloop, port, [this](auto && PH1) { NewConnection(std::forward<decltype(PH1)>(PH1)); })
+        , _baseloop(backend)
         , _threadpool(&_baseloop, thread_num) {
         _threadpool.Create();
-        _accepter.Listen();
+        auto loops = _threadpool.GetLoops();
+        for (size_t i = 0; i < loops.size(); i++) {
+            _shards.push_back(std::make_unique<Shard>(loops[i], i));
+        }
     }
 
     void SetConnectedCallback(const ConnectedCallback& cb) { _connected_cb = cb; }
     void SetMessageCallback(const MessageCallback& cb) { _message_cb = cb; }
     void SetCloseCallback(const CloseCallback& cb) { _close_cb = cb; }
     void SetEventCallback(const EventCallback& cb) { _event_cb = cb; }
+    // 每个连接的输出队列超过mark时调用, 可以用来限制生产者
+    void SetHighWaterCallback(const HighWaterCallback& cb, size_t mark) {
+        _high_water_cb = cb;
+        _high_water_mark = mark;
+    }
+    void SetWriteCompleteCallback(const WriteCompleteCallback& cb) { _write_complete_cb = cb; }
+    // 连接的输出队列超过mark时自动暂停读取对端的输入, 回落到一半以下时恢复
+    void SetOutputLimit(size_t mark) {
+        _high_water_mark = mark;
+        _pause_read_on_high_water = mark > 0;
+    }
 
     void EnableInactivityRelease(int timeout) {
         _inactivity_release = true;
         _timeout = timeout;
     }
     void DisableInactivityRelease() { _inactivity_release = false; }
-    void Start() { _baseloop.Start(); }
-    void RunAfter(uint64_t timeout, const TimerTask::TaskFunc& task) {
-        _next_id++;
-        _baseloop.RunInLoop([this, timeout, task] { _runAfter(_next_id, timeout, task); });
+    // 设置每个连接每次读事件最多读取的字节数
+    void SetReadBudget(size_t budget) { _read_budget = budget; }
+    // 设置每个连接每次写事件最多发送的字节数
+    void SetWriteBudget(size_t budget) { _write_budget = budget; }
+    // 连接使用边缘触发模式, 读写事件只注册一次, 读写时一直处理到EAGAIN或预算用完
+    void EnableEdgeTrigger() { _edge_trigger = true; }
+    // 每个从属事件循环各自持有一个SO_REUSEPORT监听套接字, 由内核分发新连接,
+    // 连接在接收它的事件循环中直接创建, 不再经过主事件循环转交, 需要在Start之前设置
+    void EnableReusePort() { _reuse_port = true; }
+    // 把处理连接的事件循环线程依次绑定到cpus中的CPU上, 见LoopThreadPool::SetAffinity
+    void SetCpuAffinity(const std::vector<int>& cpus, bool numa_local = true) { _threadpool.SetAffinity(cpus, numa_local); }
+    // 新连接的分配策略, SO_REUSEPORT模式下由内核分配, 不使用该策略; 需要在Start之前设置
+    void SetDispatchPolicy(DispatchPolicy policy) { _threadpool.SetDispatchPolicy(policy); }
+    void SetDispatcher(const LoopThreadPool::Dispatcher& dispatcher) { _threadpool.SetDispatcher(dispatcher); }
+    // 事件循环阻塞等待前先忙轮询us微秒, 并对新连接设置SO_BUSY_POLL(在驱动支持时直接轮询网卡队列), 0表示关闭
+    void SetBusyPoll(uint64_t us) {
+        _busy_poll_us = us;
+        for (EventLoop* loop : GetLoops()) loop->SetBusyPoll(us);
+    }
+    // 开始接收连接, Stop排空所有连接之后返回
+    void Start() {
+        Listen();
+        _baseloop.Start();
+    }
+    // 停止接收新连接并排空现有连接: 对每个连接调用排空回调(默认为Shutdown, 发送完输出后关闭),
+    // 所有连接关闭或者超过timeout_ms后强制关闭剩余的连接, 然后Start返回; 可以在任意线程中调用, 重复调用无效
+    void Stop(uint64_t timeout_ms = kDefaultDrainTimeoutMs) {
+        if (_stopping.exchange(true, std::memory_order_acq_rel)) return;
+        _baseloop.RunInLoop([this, timeout_ms] { BeginDrain(timeout_ms); });
+    }
+    // 是否已经开始停止, 上层可以据此不再保持长连接
+    bool IsStopping() const { return _stopping.load(std::memory_order_acquire); }
+    // 排空时对每个连接调用, 在连接所属的事件循环线程中执行; 需要在Start之前设置
+    void SetDrainCallback(const DrainCallback& cb) { _drain_cb = cb; }
+    // 平滑重启: Start时先从path上的旧进程接收监听套接字(没有旧进程时新建), 然后在path上等待下一个进程,
+    // 把监听套接字交给它之后以timeout_ms为期限排空连接并退出; 需要在Start之前设置
+    void EnableHandoff(const std::string& path, uint64_t timeout_ms = kDefaultDrainTimeoutMs) {
+        _handoff_path = path;
+        _handoff_timeout_ms = timeout_ms;
+    }
+    // 主事件循环, 只负责监听(SO_REUSEPORT模式下只处理定时任务等)
+    EventLoop* GetBaseLoop() { return &_baseloop; }
+    void RunAfter(uint64_t timeout, const TimerNode::TaskFunc& task) {
+        uint64_t id = ++_next_id;
+        _baseloop.RunInLoop([this, id, timeout, task] { _runAfter(id, timeout, task); });
+    }
+    // 处理连接的事件循环, 下标与连接id中的分片序号一致(没有工作线程时只有主事件循环)
+    std::vector<EventLoop*> GetLoops() const {
+        std::vector<EventLoop*> loops;
+        for (auto& shard : _shards) loops.push_back(shard->_loop);
+        return loops;
+    }
+    // 当前的连接总数
+    size_t ConnectionCount() const {
+        size_t count = 0;
+        for (auto& shard : _shards) count += shard->_loop->GetLoad().Connections();
+        return count;
+    }
+    // 对所有连接调用fn, fn在连接所属的事件循环线程中执行(异步), 可以在任意线程中调用
+    void ForEachConnection(const std::function<void(const PtrConnection&)>& fn) {
+        for (auto& shard : _shards) {
+            Shard* raw = shard.get();
+            raw->_loop->RunInLoop([raw, fn] {
+                // fn中关闭连接不会影响遍历(关闭在任务队列中完成)
+                std::vector<PtrConnection> conns;
+                conns.reserve(raw->_connections.size());
+                for (auto& [id, conn] : raw->_connections) conns.push_back(conn);
+                for (auto& conn : conns) fn(conn);
+                });
+        }
     }
 private:
-    // 为新连接创建Connection对象
-    void NewConnection(int newfd) {
-        _next_id++;
-        PtrConnection conn(new Connection(_threadpool.GetNextLoop(), _next_id, newfd));
+    // 每个事件循环各自管理自己的连接, 只在该事件循环线程中访问, 不需要加锁,
+    // 连接的创建和关闭都不用再切换线程; 连接id的高16位是分片序号, 各分片独立编号
+    struct Shard {
+        Shard(EventLoop* loop, size_t index) : _loop(loop), _index(index) {}
+        EventLoop* _loop;
+        size_t _index;
+        uint64_t _next_id = 0;
+        std::unordered_map<uint64_t, PtrConnection> _connections;
+        bool _draining = false; // 正在排空, 连接全部关闭后通知主事件循环
+        TimerNode _drain_timer; // 排空的期限
+    };
+    static constexpr int kShardIdShift = 48;
+private:
+    // 创建(或者从旧进程接收)监听套接字并开始接收连接
+    void Listen() {
+        std::vector<int> inherited;
+        if (!_handoff_path.empty()) {
+            inherited = InheritListeners();
+            ListenHandoff();
+        }
+        size_t used = _reuse_port ? _shards.size() : 1;
+        if (inherited.size() > used) {
+            // 多出的套接字队列中的连接会被内核重置
+            lg(Warning, "drop %zu inherited listening sockets", inherited.size() - used);
+            for (size_t i = used; i < inherited.size(); i++) close(inherited[i]);
+        }
+        auto inherited_fd = [&inherited](size_t i) { return i < inherited.size() ? inherited[i] : -1; };
+        if (!_reuse_port) {
+            auto accepter = std::make_unique<Accepter>(&_baseloop, _port, nullptr, inherited_fd(0));
+            // 连接在所属的事件循环线程中创建, 从该线程的空闲列表分配, 关闭后也归还到同一个列表
+            accepter->SetAcceptCallback([this](int fd) {
+                // 分配时就计入连接数, 同一批接收的连接才能看到前面的分配结果
+                Shard* shard = _shards[_threadpool.NextIndex()].get();
+                shard->_loop->GetLoad()._connections.fetch_add(1, std::memory_order_relaxed);
+                shard->_loop->RunInLoop([this, shard, fd] { NewConnection(shard, fd); });
+                });
+            accepter->Listen();
+            _accepters.push_back(std::move(accepter));
+            return;
+        }
+        for (auto& shard : _shards) {
+            EventLoop* loop = shard->_loop;
+            Shard* raw_shard = shard.get();
+            auto accepter = std::make_unique<Accepter>(loop, _port, nullptr, inherited_fd(raw_shard->_index));
+            accepter->SetAcceptCallback([this, raw_shard](int fd) {
+                raw_shard->_loop->GetLoad()._connections.fetch_add(1, std::memory_order_relaxed);
+                NewConnection(raw_shard, fd);
+                });
+            // 监听事件必须在所属的事件循环线程中注册
+            Accepter* raw = accepter.get();
+            loop->RunInLoop([raw] { raw->Listen(); });
+            _accepters.push_back(std::move(accepter));
+        }
+    }
+    // 在分片所属的事件循环线程中为新连接创建Connection对象
+    void NewConnection(Shard* shard, int newfd) {
+        uint64_t id = (static_cast<uint64_t>(shard->_index) << kShardIdShift) | ++shard->_next_id;
+        PtrConnection conn = std::allocate_shared<Connection>(PoolAllocator<Connection>(), shard->_loop, id, newfd);
         conn->SetMessageCallback(_message_cb);
         conn->SetCloseCallback(_close_cb);
         conn->SetConnectedCallback(_connected_cb);
         conn->SetEventCallback(_event_cb);
-        conn->SetServerCloseCallback([this](auto && PH1) { RemoveConnection(std::forward<decltype(PH1)>(PH1)); });
+        conn->SetServerCloseCallback([this, shard](const PtrConnection& conn) { RemoveConnection(shard, conn); });
+        conn->SetReadBudget(_read_budget);
+        conn->SetWriteBudget(_write_budget);
+        conn->SetHighWaterCallback(_high_water_cb, _high_water_mark);
+        conn->SetWriteCompleteCallback(_write_complete_cb);
+        conn->SetPauseReadOnHighWater(_pause_read_on_high_water);
+        if (_edge_trigger) conn->EnableEdgeTrigger();
         if (_inactivity_release) conn->EnableInactivityRelease(_timeout);
+        if (_busy_poll_us > 0) SetSocketBusyPoll(newfd);
+        shard->_connections[id] = conn;
+        shard->_loop->GetMetrics()._connections_opened.Add();
         conn->Establish();
-        _connections[_next_id] = conn;
     }
-    void RemoveConnection(const PtrConnection& conn) {
-        _baseloop.RunInLoop([this, conn] { _removeConnection(conn); });
+    // 提高SO_BUSY_POLL需要CAP_NET_ADMIN, 失败时只提示一次, 事件循环的忙轮询不受影响
+    void SetSocketBusyPoll(int fd) {
+        int us = static_cast<int>(std::min<uint64_t>(_busy_poll_us, INT_MAX));
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) == -1) {
+            static std::atomic<bool> warned{ false };
+            if (!warned.exchange(true)) lg(Warning, "set SO_BUSY_POLL failed: %s", strerror(errno));
+        }
     }
-    void _removeConnection(const PtrConnection& conn) {
-        _connections.erase(conn->GetId());
+    // 连接在所属的事件循环线程中关闭, 直接从本分片中移除
+    void RemoveConnection(Shard* shard, const PtrConnection& conn) {
+        shard->_connections.erase(conn->GetId());
+        shard->_loop->GetLoad()._connections.fetch_sub(1, std::memory_order_relaxed);
+        shard->_loop->GetMetrics()._connections_closed.Add();
+        if (shard->_draining && shard->_connections.empty()) ShardDrained(shard);
+    }
+    // 从旧进程接收监听套接字, 只保留监听本端口的
+    std::vector<int> InheritListeners() {
+        std::vector<int> fds;
+        for (int fd : Handoff::Receive(_handoff_path)) {
+            struct sockaddr_in addr{};
+            socklen_t len = sizeof(addr);
+            int listening = 0;
+            socklen_t optlen = sizeof(listening);
+            if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) == -1 || addr.sin_family != AF_INET
+                || ntohs(addr.sin_port) != _port || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen) == -1 || !listening) {
+                lg(Warning, "ignore inherited socket %d: not listening on port %d", fd, _port);
+                close(fd);
+                continue;
+            }
+            fds.push_back(fd);
+        }
+        if (!fds.empty()) lg(Info, "inherited %zu listening sockets from %s", fds.size(), _handoff_path.c_str());
+        return fds;
+    }
+    // 在主事件循环中等待下一个进程接收监听套接字
+    void ListenHandoff() {
+        int fd = Handoff::Listen(_handoff_path);
+        if (fd == -1) return;
+        _handoff_sock = std::make_unique<Socket>(fd);
+        _handoff_channel = std::make_unique<Channel>(fd, &_baseloop);
+        _handoff_channel->SetReadCallback([this] { HandleHandoff(); });
+        _handoff_channel->EnableRead();
+    }
+    void HandleHandoff() {
+        Socket peer(accept4(_handoff_sock->GetFd(), nullptr, nullptr, SOCK_CLOEXEC));
+        if (peer.GetFd() == -1 || IsStopping()) return;
+        // 监听套接字只交给同一用户的进程
+        struct ucred cred{};
+        socklen_t len = sizeof(cred);
+        if (getsockopt(peer.GetFd(), SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || cred.uid != geteuid()) {
+            lg(Warning, "reject listening socket handoff from uid %d", static_cast<int>(cred.uid));
+            return;
+        }
+        std::vector<int> fds;
+        for (auto& accepter : _accepters) fds.push_back(accepter->GetFd());
+        if (!Handoff::Send(peer.GetFd(), fds)) return;
+        lg(Info, "handed off %zu listening sockets to pid %d", fds.size(), static_cast<int>(cred.pid));
+        Stop(_handoff_timeout_ms);
+    }
+    // 在主事件循环中停止接收连接, 再通知每个分片排空
+    void BeginDrain(uint64_t timeout_ms) {
+        lg(Info, "stopping server, drain timeout %llu ms", static_cast<unsigned long long>(timeout_ms));
+        if (_handoff_channel) {
+            _handoff_channel->Remove();
+            _handoff_channel->SetRevents(0);
+        }
+        // 所有监听器都停止(已经接收的连接都转交给分片)之后再开始排空
+        _stopping_accepters = _accepters.size();
+        if (_stopping_accepters == 0) return DrainShards(timeout_ms);
+        for (size_t i = 0; i < _accepters.size(); i++) {
+            Accepter* raw = _accepters[i].get();
+            // SO_REUSEPORT模式下监听器与分片一一对应, 在分片的事件循环中移除
+            EventLoop* loop = _reuse_port ? _shards[i]->_loop : &_baseloop;
+            loop->RunInLoop([this, raw, timeout_ms] {
+                raw->Stop([this, timeout_ms] {
+                    _baseloop.RunInLoop([this, timeout_ms] {
+                        if (--_stopping_accepters == 0) DrainShards(timeout_ms);
+                        });
+                    });
+                });
+        }
+    }
+    void DrainShards(uint64_t timeout_ms) {
+        // 已经转交给分片的新连接排在排空任务之前创建, 同样会被排空
+        _draining_shards = _shards.size();
+        for (auto& shard : _shards) {
+            Shard* raw = shard.get();
+            raw->_loop->RunInLoop([this, raw, timeout_ms] { DrainShard(raw, timeout_ms); });
+        }
+    }
+    void DrainShard(Shard* shard, uint64_t timeout_ms) {
+        shard->_draining = true;
+        std::vector<PtrConnection> conns;
+        conns.reserve(shard->_connections.size());
+        for (auto& [id, conn] : shard->_connections) conns.push_back(conn);
+        for (auto& conn : conns) {
+            if (_drain_cb) _drain_cb(conn);
+            else conn->Shutdown();
+        }
+        shard->_drain_timer.SetTask([shard] {
+            lg(Warning, "drain timeout, force close %zu connections", shard->_connections.size());
+            // 关闭在任务队列中完成, 不影响遍历
+            for (auto& [id, conn] : shard->_connections) conn->ForceClose();
+            });
+        shard->_loop->AddTimer(&shard->_drain_timer, timeout_ms);
+        if (shard->_connections.empty()) ShardDrained(shard);
+    }
+    // 分片的连接全部关闭, 所有分片都排空后主事件循环退出
+    void ShardDrained(Shard* shard) {
+        shard->_draining = false;
+        shard->_loop->CancelTimer(&shard->_drain_timer);
+        _baseloop.RunInLoop([this] {
+            if (--_draining_shards > 0) return;
+            lg(Info, "server stopped");
+            _baseloop.Quit();
+            });
     }
 
-    void _runAfter(uint64_t id, uint64_t timeout, const TimerTask::TaskFunc& task) {
+    void _runAfter(uint64_t id, uint64_t timeout, const TimerNode::TaskFunc& task) {
         _baseloop.RunAfter(id, timeout, task);
     }
 private:
-    uint64_t _next_id;
+    int _port;
+    std::atomic<uint64_t> _next_id;
     int _timeout;
     bool _inactivity_release;
+    size_t _read_budget = kDefaultReadBudget;
+    size_t _write_budget = kDefaultWriteBudget;
+    bool _edge_trigger = false;
+    bool _reuse_port = false;
+    std::atomic<uint64_t> _busy_poll_us{ 0 };
+    size_t _high_water_mark = 0;
+    bool _pause_read_on_high_water = false;
     EventLoop _baseloop;
-    Accepter _accepter;
+    std::vector<std::unique_ptr<Accepter>> _accepters; // 监听器, SO_REUSEPORT模式下每个从属事件循环一个
+    std::vector<std::unique_ptr<Shard>> _shards; // 与事件循环一一对应
+    // 在监听器和分片之后声明: 析构时先退出并等待从属线程, 之后不会再有线程访问它们
     LoopThreadPool _threadpool; // 从属线程池
-    std::unordered_map<uint64_t, PtrConnection> _connections;
+    std::atomic<bool> _stopping{ false };
+    size_t _stopping_accepters = 0; // 还没有停止的监听器数, 只在主事件循环中访问
+    size_t _draining_shards = 0; // 还没有排空的分片数, 只在主事件循环中访问
+    DrainCallback _drain_cb;
+    std::string _handoff_path; // 传递监听套接字的Unix域套接字路径, 为空表示不开启
+    uint64_t _handoff_timeout_ms = kDefaultDrainTimeoutMs;
+    std::unique_ptr<Socket> _handoff_sock;
+    std::unique_ptr<Channel> _handoff_channel;
 
     ConnectedCallback _connected_cb;
     MessageCallback _message_cb;
     CloseCallback _close_cb;
     EventCallback _event_cb;
-};
\ No newline at end of file
+    HighWaterCallback _high_water_cb;
+    WriteCompleteCallback _write_complete_cb;
+};
+
+// 非阻塞连接器: 发起连接后等待可写事件, 单次连接的超时和失败后的重试都由时间轮驱动(指数退避加随机抖动)
+// 只支持点分十进制的IPv4地址(不做阻塞的域名解析), 所有接口必须在事件循环线程中调用
+class Connector {
+public:
+    // 连接成功时参数为已连接的非阻塞套接字(由回调接管), 重试用完或者地址无效时为-1
+    using ConnectCallback = std::function<void(int)>;
+    static constexpr uint64_t kDefaultTimeoutMs = 3000; // 单次连接的超时时间
+    static constexpr int kDefaultMaxRetries = 3; // 失败后默认最多重试的次数
+    static constexpr uint64_t kInitRetryDelayMs = 100; // 第一次重试前的等待时间, 之后每次翻倍
+    static constexpr uint64_t kMaxRetryDelayMs = 30000; // 重试等待时间的上限
+
+    Connector(EventLoop* loop, const std::string& ip, uint16_t port, ConnectCallback cb = nullptr)
+        : _loop(loop), _ip(ip), _port(port), _connect_cb(std::move(cb)) {
+        _timeout_timer.SetTask([this] { HandleTimeout(); });
+        _retry_timer.SetTask([this] { Connect(); });
+    }
+    ~Connector() { Stop(); }
+    Connector(const Connector&) = delete;
+    Connector& operator=(const Connector&) = delete;
+
+    void SetConnectCallback(const ConnectCallback& cb) { _connect_cb = cb; }
+    void SetTimeout(uint64_t ms) { _timeout_ms = ms; }
+    // 失败后最多重试的次数, 负数表示一直重试
+    void SetMaxRetries(int retries) { _max_retries = retries; }
+    const std::string& GetIp() const { return _ip; }
+    uint16_t GetPort() const { return _port; }
+    // 是否正在连接或者等待重试
+    bool IsConnecting() const { return _channel != nullptr || _retry_timer.IsLinked(); }
+    // 开始连接, 重试次数重新计算; 连接可能直接成功, 此时在Start中就会调用回调
+    void Start() {
+        Stop();
+        _retries = 0;
+        Connect();
+    }
+    // 放弃正在进行的连接和等待中的重试, 不调用回调
+    void Stop() {
+        _loop->CancelTimer(&_retry_timer);
+        int fd = TakeChannel();
+        if (fd != -1) close(fd);
+    }
+private:
+    void Connect() {
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_port);
+        if (inet_pton(AF_INET, _ip.c_str(), &addr.sin_addr) != 1) {
+            // 地址无效, 重试没有意义
+            lg(Error, "invalid address %s", _ip.c_str());
+            if (_connect_cb) _connect_cb(-1);
+            return;
+        }
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (fd == -1) {
+            Retry(errno);
+            return;
+        }
+        // 上游调用都是请求-响应式的, 关闭Nagle算法
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0) {
+            Connected(fd);
+            return;
+        }
+        int err = errno;
+        // EINTR时连接同样在后台继续进行
+        if (err != EINPROGRESS && err != EINTR) {
+            close(fd);
+            Retry(err);
+            return;
+        }
+        // 连接完成(无论成功与否)时套接字变为可写, 失败时还会带上EPOLLERR/EPOLLHUP
+        _channel = std::make_unique<Channel>(fd, _loop);
+        _channel->SetWriteCallback([this] { HandleWrite(); });
+        _channel->SetErrorCallback([this] { HandleWrite(); });
+        _channel->SetCloseCallback([this] { HandleWrite(); });
+        _channel->EnableWrite();
+        _loop->AddTimer(&_timeout_timer, _timeout_ms);
+    }
+    void HandleWrite() {
+        int fd = TakeChannel();
+        if (fd == -1) return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) err = errno;
+        if (err != 0) {
+            close(fd);
+            Retry(err);
+            return;
+        }
+        Connected(fd);
+    }
+    void HandleTimeout() {
+        int fd = TakeChannel();
+        if (fd == -1) return;
+        close(fd);
+        Retry(ETIMEDOUT);
+    }
+    // 停止监控正在连接的套接字并返回它, 没有时返回-1
+    int TakeChannel() {
+        _loop->CancelTimer(&_timeout_timer);
+        if (!_channel) return -1;
+        int fd = _channel->GetFd();
+        _channel->Remove();
+        // Channel可能正在处理事件(或者在本轮的就绪列表中排在后面), 清除就绪事件后留到任务队列中销毁
+        _channel->SetRevents(0);
+        _loop->QueueInLoop([ch = std::move(_channel)] {});
+        return fd;
+    }
+    void Retry(int err) {
+        if (_max_retries >= 0 && _retries >= _max_retries) {
+            lg(Error, "connect %s:%d failed: %s", _ip.c_str(), _port, strerror(err));
+            if (_connect_cb) _connect_cb(-1);
+            return;
+        }
+        uint64_t delay = std::min(kInitRetryDelayMs << std::min(_retries, 16), kMaxRetryDelayMs);
+        // 在[delay/2, delay]之间随机, 避免大量连接在上游恢复时同时重试
+        delay = delay / 2 + _rng() % (delay / 2 + 1);
+        _retries++;
+        lg(Warning, "connect %s:%d failed: %s, retry in %llu ms", _ip.c_str(), _port, strerror(err),
+            static_cast<unsigned long long>(delay));
+        _loop->AddTimer(&_retry_timer, delay);
+    }
+    // 回调可能销毁连接器, 调用之后不能再访问成员
+    void Connected(int fd) {
+        _retries = 0;
+        if (_connect_cb) _connect_cb(fd);
+        else close(fd);
+    }
+private:
+    EventLoop* _loop;
+    std::string _ip;
+    uint16_t _port;
+    uint64_t _timeout_ms = kDefaultTimeoutMs;
+    int _max_retries = kDefaultMaxRetries;
+    int _retries = 0; // 已经重试的次数
+    std::unique_ptr<Channel> _channel; // 正在连接的套接字
+    TimerNode _timeout_timer; // 单次连接的超时
+    TimerNode _retry_timer; // 等待重试
+    std::minstd_rand _rng{ std::random_device{}() };
+    ConnectCallback _connect_cb;
+};
+
+// 为连接器建立的套接字创建连接对象, 连接id的最高位为1, 与服务端的连接区分
+inline PtrConnection NewClientConnection(EventLoop* loop, int fd) {
+    static std::atomic<uint64_t> next_id{ 0 };
+    uint64_t id = (1ULL << 63) | next_id.fetch_add(1, std::memory_order_relaxed);
+    return std::allocate_shared<Connection>(PoolAllocator<Connection>(), loop, id, fd);
+}
+
+// 关闭不再被使用者持有的连接, 连接由关闭回调保持到真正关闭(输出队列中的数据发送完毕之后)
+inline void ShutdownDetached(const PtrConnection& conn) {
+    if (conn->GetState() == ConnectionState::kDisconnected) return;
+    conn->SetCloseCallback(nullptr);
+    conn->SetServerCloseCallback([keep = conn](const PtrConnection& self) mutable {
+        // 不能在回调执行过程中销毁回调本身, 引用留到任务中释放
+        self->GetLoop()->QueueInLoop([keep = std::move(keep)] {});
+        });
+    conn->Shutdown();
+}
+
+// 客户端: 通过Connector建立连接, 之后使用与服务端相同的Connection/Buffer收发数据,
+// 所有接口必须在事件循环线程中调用
+class TcpClient : private NetWork {
+public:
+    using ConnectedCallback = Connection::ConnectedCallback;
+    using MessageCallback = Connection::MessageCallback;
+    using CloseCallback = Connection::CloseCallback;
+    using WriteCompleteCallback = Connection::WriteCompleteCallback;
+    using ConnectFailedCallback = std::function<void()>;
+
+    TcpClient(EventLoop* loop, const std::string& ip, uint16_t port)
+        : _loop(loop), _connector(loop, ip, port, [this](int fd) { OnConnect(fd); }) {}
+    ~TcpClient() {
+        _connector.Stop();
+        if (_conn) ShutdownDetached(_conn);
+    }
+    TcpClient(const TcpClient&) = delete;
+    TcpClient& operator=(const TcpClient&) = delete;
+
+    void SetConnectedCallback(const ConnectedCallback& cb) { _connected_cb = cb; }
+    void SetMessageCallback(const MessageCallback& cb) { _message_cb = cb; }
+    void SetCloseCallback(const CloseCallback& cb) { _close_cb = cb; }
+    void SetWriteCompleteCallback(const WriteCompleteCallback& cb) { _write_complete_cb = cb; }
+    // 重试次数用完仍然没有连上时调用
+    void SetConnectFailedCallback(const ConnectFailedCallback& cb) { _connect_failed_cb = cb; }
+    void SetConnectTimeout(uint64_t ms) { _connector.SetTimeout(ms); }
+    void SetMaxRetries(int retries) { _connector.SetMaxRetries(retries); }
+    // 连接断开后自动重新连接, 调用Disconnect之后不再重连
+    void EnableReconnect() { _reconnect = true; }
+
+    // 发起连接, 已经连接或者正在连接时忽略
+    void Connect() {
+        if (_conn || _connector.IsConnecting()) return;
+        _disconnecting = false;
+        _connector.Start();
+    }
+    // 关闭连接(输出队列中的数据发送完毕后才真正关闭), 并放弃正在进行的连接
+    void Disconnect() {
+        _disconnecting = true;
+        _connector.Stop();
+        if (_conn) _conn->Shutdown();
+    }
+    // 当前的连接, 没有连上时为nullptr
+    const PtrConnection& GetConnection() const { return _conn; }
+    EventLoop* GetLoop() const { return _loop; }
+private:
+    void OnConnect(int fd) {
+        if (fd == -1) {
+            if (_connect_failed_cb) _connect_failed_cb();
+            return;
+        }
+        _conn = NewClientConnection(_loop, fd);
+        _conn->SetConnectedCallback(_connected_cb);
+        _conn->SetMessageCallback(_message_cb);
+        _conn->SetCloseCallback(_close_cb);
+        _conn->SetWriteCompleteCallback(_write_complete_cb);
+        _conn->SetServerCloseCallback([this](const PtrConnection&) { OnClose(); });
+        _conn->Establish();
+    }
+    void OnClose() {
+        // 连接在自己的关闭任务中持有引用, 这里可以直接释放
+        _conn.reset();
+        if (_reconnect && !_disconnecting) _connector.Start();
+    }
+private:
+    EventLoop* _loop;
+    Connector _connector;
+    PtrConnection _conn;
+    bool _reconnect = false;
+    bool _disconnecting = false;
+
+    ConnectedCallback _connected_cb;
+    MessageCallback _message_cb;
+    CloseCallback _close_cb;
+    WriteCompleteCallback _write_complete_cb;
+    ConnectFailedCallback _connect_failed_cb;
+};
+
+// 上游长连接池, 每个事件循环一个, 按"ip:port"分组复用空闲连接, 转发请求时不需要切换线程;
+// 所有接口必须在所属的事件循环线程中调用
+class ConnectionPool : private NetWork {
+public:
+    // 参数为可以使用的连接, 连接失败时为nullptr
+    using AcquireCallback = std::function<void(const PtrConnection&)>;
+    static constexpr size_t kDefaultMaxIdle = 32; // 每个上游最多保留的空闲连接数
+    static constexpr int kDefaultIdleTimeout = 60; // 空闲连接的超时时间(秒)
+
+    explicit ConnectionPool(EventLoop* loop) : _loop(loop) {}
+    ~ConnectionPool() {
+        // 正在使用的连接同样关闭, 之后不会再回调连接池
+        for (auto& [id, conn] : _connections) ShutdownDetached(conn);
+    }
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    void SetMaxIdle(size_t max_idle) { _max_idle = max_idle; }
+    void SetIdleTimeout(int seconds) { _idle_timeout = seconds; }
+    void SetConnectTimeout(uint64_t ms) { _connect_timeout_ms = ms; }
+    void SetMaxRetries(int retries) { _max_retries = retries; }
+    EventLoop* GetLoop() const { return _loop; }
+
+    // 取得一个到ip:port的连接: 优先使用最近归还的空闲连接(直接在Acquire中回调), 没有时新建连接
+    // 拿到连接后由使用者设置消息回调并发送请求
+    void Acquire(const std::string& ip, uint16_t port, AcquireCallback cb) {
+        std::string key = Key(ip, port);
+        auto it = _idle.find(key);
+        if (it != _idle.end()) {
+            auto& idle = it->second;
+            while (!idle.empty()) {
+                PtrConnection conn = std::move(idle.back());
+                idle.pop_back();
+                if (!conn->IsConnected()) continue;
+                conn->DisableInactivityRelease();
+                conn->SetMessageCallback(nullptr);
+                cb(conn);
+                return;
+            }
+        }
+        uint64_t id = ++_next_connector_id;
+        auto connector = std::make_unique<Connector>(_loop, ip, port);
+        connector->SetTimeout(_connect_timeout_ms);
+        connector->SetMaxRetries(_max_retries);
+        connector->SetConnectCallback([this, id, key = std::move(key), cb = std::move(cb)](int fd) {
+            OnConnect(id, key, cb, fd);
+            });
+        Connector* raw = connector.get();
+        _connecting.emplace(id, std::move(connector));
+        raw->Start();
+    }
+    // 归还连接, 使用者必须保证连接上没有未完成的请求和未读取的响应, 否则应该直接关闭连接;
+    // 使用者设置的消息、关闭和发送完毕回调会被清除; 空闲连接超过上限时直接关闭
+    void Release(const PtrConnection& conn) {
+        auto it = _keys.find(conn->GetId());
+        if (it == _keys.end() || !conn->IsConnected()) return;
+        conn->SetCloseCallback(nullptr);
+        conn->SetWriteCompleteCallback(nullptr);
+        auto& idle = _idle[it->second];
+        if (idle.size() >= _max_idle) {
+            conn->Shutdown();
+            return;
+        }
+        // 空闲时收到的数据说明上游出错或者要关闭连接, 不再复用
+        conn->SetMessageCallback([](const PtrConnection& conn, Buffer* buf) {
+            buf->MoveReadIdx(buf->ReadableSize());
+            conn->Shutdown();
+            });
+        conn->EnableInactivityRelease(_idle_timeout);
+        idle.push_back(conn);
+    }
+    // 空闲连接数
+    size_t IdleCount() const {
+        size_t count = 0;
+        for (auto& [key, idle] : _idle) count += idle.size();
+        return count;
+    }
+    // 连接池管理的连接总数(包括正在使用的)
+    size_t ConnectionCount() const { return _connections.size(); }
+private:
+    static std::string Key(const std::string& ip, uint16_t port) { return ip + ":" + std::to_string(port); }
+
+    void OnConnect(uint64_t id, const std::string& key, const AcquireCallback& cb, int fd) {
+        // 正在执行的就是连接器的回调, 连接器留到任务队列中销毁
+        auto it = _connecting.find(id);
+        std::unique_ptr<Connector> connector = std::move(it->second);
+        _connecting.erase(it);
+        if (fd == -1) {
+            cb(nullptr);
+            _loop->QueueInLoop([connector = std::move(connector)] {});
+            return;
+        }
+        PtrConnection conn = NewClientConnection(_loop, fd);
+        conn->SetServerCloseCallback([this](const PtrConnection& conn) { OnClose(conn); });
+        _connections[conn->GetId()] = conn;
+        _keys[conn->GetId()] = key;
+        conn->Establish();
+        cb(conn);
+        _loop->QueueInLoop([connector = std::move(connector)] {});
+    }
+    void OnClose(const PtrConnection& conn) {
+        auto it = _keys.find(conn->GetId());
+        if (it != _keys.end()) {
+            auto idle = _idle.find(it->second);
+            if (idle != _idle.end()) {
+                auto& list = idle->second;
+                list.erase(std::remove(list.begin(), list.end(), conn), list.end());
+                if (list.empty()) _idle.erase(idle);
+            }
+            _keys.erase(it);
+        }
+        _connections.erase(conn->GetId());
+    }
+private:
+    EventLoop* _loop;
+    size_t _max_idle = kDefaultMaxIdle;
+    int _idle_timeout = kDefaultIdleTimeout;
+    uint64_t _connect_timeout_ms = Connector::kDefaultTimeoutMs;
+    int _max_retries = Connector::kDefaultMaxRetries;
+    uint64_t _next_connector_id = 0;
+    std::unordered_map<uint64_t, std::unique_ptr<Connector>> _connecting; // 正在连接的连接器
+    std::unordered_map<uint64_t, PtrConnection> _connections; // 连接池管理的所有连接
+    std::unordered_map<uint64_t, std::string> _keys; // 连接所属的上游
+    std::unordered_map<std::string, std::vector<PtrConnection>> _idle; // 每个上游的空闲连接, 最近归还的在末尾
+};
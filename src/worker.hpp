@@ -0,0 +1,78 @@
+#pragma once
+#include "server.hpp"
+
+// 工作线程池, 执行耗时的任务(如压缩), 避免阻塞事件循环
+// 任务完成后需要操作连接时, 通过连接所属事件循环的QueueInLoop切换回去
+class WorkerPool {
+public:
+    explicit WorkerPool(int thread_num = 2) {
+        thread_num = std::max(thread_num, 1);
+        for (int i = 0; i < thread_num; i++) {
+            _threads.emplace_back([this] { Run(); });
+        }
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cond.notify_all();
+        for (auto& thread : _threads) thread.join();
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // 提交任务, 可以在任意线程中调用
+    template <class F>
+    void Submit(F&& f) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tasks.emplace_back(std::forward<F>(f));
+        }
+        _cond.notify_one();
+    }
+    // 等待执行的任务不少于max_pending时拒绝提交并返回false(0表示不限制), 可以在任意线程中调用
+    template <class F>
+    bool TrySubmit(F&& f, size_t max_pending) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (max_pending > 0 && _tasks.size() >= max_pending) {
+                _rejected.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            _tasks.emplace_back(std::forward<F>(f));
+        }
+        _cond.notify_one();
+        return true;
+    }
+    // 等待执行的任务数量
+    size_t Pending() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _tasks.size();
+    }
+    size_t ThreadCount() const { return _threads.size(); }
+    // TrySubmit拒绝的任务总数
+    uint64_t Rejected() const { return _rejected.load(std::memory_order_relaxed); }
+private:
+    void Run() {
+        for (;;) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cond.wait(lock, [this] { return _stop || !_tasks.empty(); });
+                // 退出前执行完已经提交的任务
+                if (_tasks.empty()) return;
+                task = std::move(_tasks.front());
+                _tasks.pop_front();
+            }
+            task();
+        }
+    }
+private:
+    mutable std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<Task> _tasks;
+    bool _stop = false;
+    std::atomic<uint64_t> _rejected{ 0 };
+    std::vector<std::thread> _threads;
+};